@@ -0,0 +1,46 @@
+#include "ClusterTable.h"
+#include <cstdint>
+#include <string>
+
+uint32_t ClusterTable::intern(const std::u32string &codepoints) {
+  auto found = index.find(codepoints);
+  if (found != index.end()) {
+    entries[found->second].references++;
+    return found->second;
+  }
+  uint32_t id;
+  if (!freeIds.empty()) {
+    id = freeIds.back();
+    freeIds.pop_back();
+  } else {
+    id = entries.size();
+    entries.emplace_back();
+  }
+  entries[id].codepoints = codepoints;
+  entries[id].references = 1;
+  index.emplace(codepoints, id);
+  return id;
+}
+
+void ClusterTable::retain(uint32_t id) { entries[id].references++; }
+
+void ClusterTable::release(uint32_t id) {
+  Cluster_Entry &entry = entries[id];
+  if (--entry.references > 0)
+    return;
+  index.erase(entry.codepoints);
+  entry.codepoints.clear();
+  freeIds.push_back(id);
+}
+
+const std::u32string &ClusterTable::get(uint32_t id) {
+  return entries[id].codepoints;
+}
+
+size_t ClusterTable::size() { return index.size(); }
+
+void ClusterTable::clear() {
+  entries.clear();
+  freeIds.clear();
+  index.clear();
+}
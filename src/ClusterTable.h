@@ -0,0 +1,32 @@
+#ifndef CLUSTER_TABLE_H
+#define CLUSTER_TABLE_H
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Side table for grapheme clusters of more than one codepoint (combining
+// marks, emoji ZWJ sequences, flags). A cell flagged CELL_CLUSTER stores the
+// id of its cluster instead of a codepoint, so cells stay fixed size.
+// Clusters are interned: identical sequences share one id, and ids are
+// reference counted by the cells holding them and reused once released.
+class ClusterTable {
+public:
+  uint32_t intern(const std::u32string &codepoints); // takes a reference
+  void retain(uint32_t id);
+  void release(uint32_t id);
+  const std::u32string &get(uint32_t id);
+  size_t size(); // live clusters
+  void clear();
+
+private:
+  typedef struct Cluster_Entry {
+    std::u32string codepoints;
+    uint32_t references = 0;
+  } Cluster_Entry;
+
+  std::vector<Cluster_Entry> entries;
+  std::vector<uint32_t> freeIds;
+  std::unordered_map<std::u32string, uint32_t> index;
+};
+#endif // !CLUSTER_TABLE_H
@@ -0,0 +1,144 @@
+#include "Config.h"
+#include "Logger.h"
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+Config *Config::instance = nullptr;
+
+Config::Config() {}
+
+Config *Config::get_instance() {
+  if (instance == nullptr)
+    instance = new Config();
+  return instance;
+}
+
+void Config::print_usage(const char *program) {
+  std::cout << "Usage: " << program << " [options]\n"
+            << "  --record <file>   record the session as asciicast v2\n"
+            << "  --replay <file>   replay an asciicast v2 recording\n"
+            << "  --fast            replay as fast as possible\n"
+            << "  --seek <seconds>  start the replay at the given time\n"
+            << "  --index           keep replay checkpoints in <file>.idx\n"
+            << "  --checkpoint-mb <n>  MB of output between checkpoints\n"
+            << "  --checkpoint-sec <n> seconds between checkpoints\n"
+            << "  --latency-hud     show latency and frame stats (Ctrl+Shift+L)\n"
+            << "  --latency-json <file>  write key latency on exit\n"
+            << "  --low-latency     draw key echoes immediately, vsync off\n"
+            << "  --no-login        don't start the shell as a login shell\n"
+            << "  --startup-timeline  log the startup timeline\n"
+            << "  --shell-pool <n>  keep n idle shells for new tabs, at most "
+            << SHELL_POOL_MAX << "\n"
+            << "  --daemon          serve detachable sessions on the socket\n"
+            << "  --attach          attach to the server, start it if needed\n"
+            << "  --headless        with --attach: type stdin, print screens\n"
+            << "  --socket <path>   server socket path\n"
+            << "  --no-shm          with --attach: grid diffs over the socket\n"
+            << "  --server          stay up, open a window for each --client\n"
+            << "  --client          open a window of the running --server\n"
+            << "  -h, --help        show this help" << std::endl;
+}
+
+// A number option's value, out_of_range when it isn't above min (or at least
+// min when it may equal it). Trailing junk is as invalid as no number at all.
+static double __parse_number(const std::string &value, double min,
+                             bool orEqual) {
+  size_t used;
+  double number = std::stod(value, &used);
+  if (used != value.size())
+    throw std::invalid_argument(value);
+  // written so that NaN fails too
+  if (!(number > min || (orEqual && number == min)))
+    throw std::out_of_range(value);
+  return number;
+}
+
+bool Config::parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    try {
+      if (arg == "-h" || arg == "--help") {
+        print_usage(argv[0]);
+        return false;
+      } else if (arg == "--record" && i + 1 < argc) {
+        recordPath = argv[++i];
+      } else if (arg == "--replay" && i + 1 < argc) {
+        replayPath = argv[++i];
+      } else if (arg == "--fast") {
+        replayFast = true;
+      } else if (arg == "--seek" && i + 1 < argc) {
+        replaySeek = __parse_number(argv[++i], 0, true);
+      } else if (arg == "--index") {
+        replayIndex = true;
+      } else if (arg == "--checkpoint-mb" && i + 1 < argc) {
+        double megabytes = __parse_number(argv[++i], 0, false);
+        if (megabytes >= (double)(SIZE_MAX >> 20))
+          throw std::out_of_range(argv[i]);
+        checkpointBytes = megabytes * (1 << 20);
+      } else if (arg == "--checkpoint-sec" && i + 1 < argc) {
+        checkpointSeconds = __parse_number(argv[++i], 0, false);
+      } else if (arg == "--latency-hud") {
+        latencyHud = true;
+      } else if (arg == "--latency-json" && i + 1 < argc) {
+        latencyPath = argv[++i];
+      } else if (arg == "--low-latency") {
+        lowLatency = true;
+      } else if (arg == "--no-login") {
+        loginShell = false;
+      } else if (arg == "--startup-timeline") {
+        startupTimeline = true;
+      } else if (arg == "--shell-pool" && i + 1 < argc) {
+        double pool = __parse_number(argv[++i], 0, true);
+        if (pool > SHELL_POOL_MAX || pool != (size_t)pool)
+          throw std::out_of_range(argv[i]);
+        shellPool = pool;
+      } else if (arg == "--daemon") {
+        daemon = true;
+      } else if (arg == "--attach") {
+        attach = true;
+      } else if (arg == "--headless") {
+        headless = true;
+      } else if (arg == "--server") {
+        server = true;
+      } else if (arg == "--client") {
+        client = true;
+      } else if (arg == "--no-shm") {
+        sharedGrids = false;
+      } else if (arg == "--socket" && i + 1 < argc) {
+        socketPath = argv[++i];
+      } else {
+        pretty_log("CONFIG", std::string("Unknown argument ") + arg, ERR);
+        print_usage(argv[0]);
+        return false;
+      }
+    } catch (const std::logic_error &) {
+      pretty_log("CONFIG", "Invalid value for " + arg + ": " + argv[i], ERR);
+      print_usage(argv[0]);
+      return false;
+    }
+  }
+  if (!recordPath.empty() && !replayPath.empty()) {
+    pretty_log("CONFIG", "--record and --replay can't be used together.", ERR);
+    return false;
+  }
+  if (attach && (daemon || !recordPath.empty() || !replayPath.empty())) {
+    pretty_log("CONFIG", "--attach can't be used with --daemon, --record or "
+                         "--replay.",
+               ERR);
+    return false;
+  }
+  if (server && (attach || daemon || client || !recordPath.empty() ||
+                 !replayPath.empty())) {
+    pretty_log("CONFIG", "--server can't be used with --attach, --daemon, "
+                         "--client, --record or --replay.",
+               ERR);
+    return false;
+  }
+  if (headless && !attach) {
+    pretty_log("CONFIG", "--headless needs --attach.", ERR);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#include <string>
+
+#define SHELL_POOL_MAX 16 // idle shells --shell-pool may ask for
+
+// Runtime options parsed from the command line
+class Config {
+public:
+  static Config *get_instance();
+  bool parse_args(int argc, char **argv);
+  void print_usage(const char *program);
+
+  std::string recordPath; // asciicast v2 file to record the PTY output into
+  std::string replayPath; // asciicast v2 file to replay instead of a shell
+  bool replayFast = false; // replay without honouring the event timestamps
+  double replaySeek = 0;   // start the replay at this many seconds
+  bool replayIndex = false; // keep replay checkpoints in a sidecar index
+  size_t checkpointBytes = 4 << 20; // output between replay checkpoints
+  double checkpointSeconds = 30;    // or recording time between them
+  bool latencyHud = false;  // show the latency/frame overlay at startup
+  std::string latencyPath; // JSON file for the key latency histogram on exit
+  bool lowLatency = false;  // present echoed keys right away, vsync off
+  bool loginShell = true;   // start $SHELL as a login shell
+  bool startupTimeline = false; // log where startup time goes
+  size_t shellPool = 0; // idle shells kept spawned for new tabs
+  bool daemon = false;   // serve detachable sessions, no window
+  bool attach = false;   // show the sessions of the server, spawn it if needed
+  bool headless = false; // attach without a window and print the screens
+  std::string socketPath; // server socket, SessionServer picks a default
+  bool sharedGrids = true; // attach through shared memory, else socket diffs
+  bool server = false; // stay up and open a window for every --client
+  bool client = false; // have the running --server open a window
+
+private:
+  Config();
+  static Config *instance;
+};
+#endif // !CONFIG_H
@@ -1,16 +1,584 @@
 #include "EscapeHandler.h"
+#include "Helper.h"
+#include <algorithm>
+#include <cstdint>
 #include <string>
 
-int handle_escape_sequence(std::string s, void (*callback)(int signal)) {
-  if (s.find("\x1b[") != std::string::npos)
-    return __handle_csi_escapes(s, callback);
-  return 0;
+#define REPLACEMENT_CHARACTER 0xFFFD
+
+EscapeHandler::EscapeHandler(Grid *primary, Grid *alternate)
+    : grid(primary), primary(primary), alternate(alternate) {}
+
+Grid *EscapeHandler::get_grid() { return grid; }
+bool EscapeHandler::is_alternate_screen() { return grid == alternate; }
+bool EscapeHandler::is_application_cursor() { return applicationCursor; }
+bool EscapeHandler::is_application_keypad() { return applicationKeypad; }
+
+// An update that never ends (the program died mid frame) stops holding the
+// screen after SYNCHRONIZED_UPDATE_TIMEOUT
+bool EscapeHandler::is_synchronized() {
+  return synchronized &&
+         std::chrono::steady_clock::now() - synchronizedSince <
+             std::chrono::milliseconds(SYNCHRONIZED_UPDATE_TIMEOUT);
+}
+
+void EscapeHandler::__set_synchronized(bool enabled) {
+  if (enabled && !synchronized)
+    synchronizedSince = std::chrono::steady_clock::now();
+  synchronized = enabled;
+}
+
+// Terminated string. Only the DCS =1s / =2s synchronized update markers are
+// acted on, the rest is ignored.
+void EscapeHandler::__string_dispatch() {
+  if (stringType != 'P' || stringLength != 3 || stringHead[0] != '=' ||
+      stringHead[2] != 's')
+    return;
+  if (stringHead[1] == '1')
+    __set_synchronized(true);
+  else if (stringHead[1] == '2')
+    __set_synchronized(false);
+}
+
+void EscapeHandler::reset() {
+  state = STATE_GROUND;
+  paramCount = 0;
+  subparams = 0;
+  privateMarker = intermediate = 0;
+  utf8Remaining = 0;
+}
+
+void EscapeHandler::feed(const char *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = data[i];
+
+    if (utf8Remaining > 0) {
+      if ((c & 0xC0) == 0x80) {
+        utf8Codepoint = (utf8Codepoint << 6) | (c & 0x3F);
+        if (--utf8Remaining == 0)
+          grid->print(utf8Codepoint);
+        continue;
+      }
+      // truncated sequence, the byte starts something new
+      utf8Remaining = 0;
+      grid->print(REPLACEMENT_CHARACTER);
+    }
+
+    // strings swallow everything up to their terminator
+    if (state == STATE_STRING) {
+      if (c == 0x07) {
+        __string_dispatch();
+        state = STATE_GROUND;
+      } else if (c == 0x18 || c == 0x1A) {
+        state = STATE_GROUND;
+      } else if (c == 0x1B) {
+        state = STATE_STRING_ESCAPE;
+      } else if (stringLength++ < MAX_STRING_HEAD) {
+        stringHead[stringLength - 1] = c;
+      }
+      continue;
+    }
+    if (state == STATE_STRING_ESCAPE) {
+      if (c == '\\')
+        __string_dispatch();
+      state = c == '\\' ? STATE_GROUND : STATE_STRING;
+      continue;
+    }
+
+    // control characters act in the middle of sequences too
+    if (c == 0x1B) {
+      state = STATE_ESCAPE;
+      intermediate = 0;
+      continue;
+    }
+    if (c == 0x18 || c == 0x1A) {
+      state = STATE_GROUND;
+      continue;
+    }
+    if (c < 0x20) {
+      __execute(c);
+      continue;
+    }
+
+    switch (state) {
+    case STATE_GROUND:
+      if (c < 0x7F) {
+        grid->print(c);
+      } else if (c >= 0x80) {
+        size_t length = utf8_sequence_length(c);
+        if (length < 2) {
+          grid->print(REPLACEMENT_CHARACTER);
+        } else {
+          utf8Remaining = length - 1;
+          utf8Codepoint = c & (0x7F >> length);
+        }
+      }
+      break;
+    case STATE_ESCAPE:
+      if (c == '[') {
+        state = STATE_CSI;
+        paramCount = 0;
+        subparams = 0;
+        privateMarker = intermediate = 0;
+      } else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+        state = STATE_STRING;
+        stringType = c;
+        stringLength = 0;
+      } else if (c == '(' || c == ')' || c == '*' || c == '+') {
+        state = STATE_CHARSET;
+      } else if (c >= 0x20 && c <= 0x2F) {
+        intermediate = c;
+        state = STATE_ESCAPE_INTERMEDIATE;
+      } else {
+        __escape_dispatch(c);
+        state = STATE_GROUND;
+      }
+      break;
+    case STATE_ESCAPE_INTERMEDIATE:
+      if (c >= 0x30)
+        state = STATE_GROUND;
+      break;
+    case STATE_CHARSET:
+      state = STATE_GROUND;
+      break;
+    case STATE_CSI:
+      if (c >= '0' && c <= '9') {
+        if (paramCount == 0)
+          params[paramCount++] = -1;
+        int &param = params[paramCount - 1];
+        if (param < 0)
+          param = 0;
+        if (param < 100000)
+          param = param * 10 + (c - '0');
+      } else if (c == ';' || c == ':') {
+        if (paramCount == 0)
+          params[paramCount++] = -1;
+        if (paramCount < MAX_CSI_PARAMS) {
+          if (c == ':')
+            subparams |= 1u << paramCount;
+          params[paramCount++] = -1;
+        }
+      } else if (c >= 0x3C && c <= 0x3F) {
+        privateMarker = c;
+      } else if (c >= 0x20 && c <= 0x2F) {
+        intermediate = c;
+      } else if (c >= 0x40 && c <= 0x7E) {
+        __csi_dispatch(c);
+        state = STATE_GROUND;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void EscapeHandler::__execute(unsigned char c) {
+  switch (c) {
+  case '\b':
+    grid->backspace();
+    break;
+  case '\t':
+    grid->tab();
+    break;
+  case '\n':
+  case '\v':
+  case '\f':
+    grid->line_feed();
+    break;
+  case '\r':
+    grid->carriage_return();
+    break;
+  default:
+    break; // BEL and the rest are ignored
+  }
+}
+
+void EscapeHandler::__escape_dispatch(unsigned char c) {
+  switch (c) {
+  case '7':
+    grid->save_cursor();
+    break;
+  case '8':
+    grid->restore_cursor();
+    break;
+  case 'D':
+    grid->line_feed();
+    break;
+  case 'E':
+    grid->carriage_return();
+    grid->line_feed();
+    break;
+  case 'M':
+    grid->reverse_index();
+    break;
+  case '=':
+    applicationKeypad = true;
+    break;
+  case '>':
+    applicationKeypad = false;
+    break;
+  case 'c':
+    __switch_screen(false);
+    grid->reset();
+    applicationCursor = applicationKeypad = false;
+    synchronized = false;
+    break;
+  default:
+    break;
+  }
+}
+
+// value of parameter i, fallback when missing or 0 for counts
+int EscapeHandler::__param(int i, int fallback) {
+  if (i >= paramCount || params[i] <= 0)
+    return fallback;
+  return params[i];
+}
+
+bool EscapeHandler::__is_subparam(int i) {
+  return i < paramCount && (subparams & (1u << i));
+}
+
+void EscapeHandler::__csi_dispatch(unsigned char c) {
+  if (intermediate)
+    return;
+  if (privateMarker) {
+    if (privateMarker == '?' && (c == 'h' || c == 'l'))
+      __set_mode(c == 'h');
+    return;
+  }
+  switch (c) {
+  case 'A':
+    grid->move_cursor_relative(-__param(0, 1), 0);
+    break;
+  case 'B':
+  case 'e':
+    grid->move_cursor_relative(__param(0, 1), 0);
+    break;
+  case 'C':
+  case 'a':
+    grid->move_cursor_relative(0, __param(0, 1));
+    break;
+  case 'D':
+    grid->move_cursor_relative(0, -__param(0, 1));
+    break;
+  case 'E':
+    grid->move_cursor_relative(__param(0, 1), 0);
+    grid->carriage_return();
+    break;
+  case 'F':
+    grid->move_cursor_relative(-__param(0, 1), 0);
+    grid->carriage_return();
+    break;
+  case 'G':
+  case '`':
+    grid->move_cursor(grid->get_cursor_row(), __param(0, 1) - 1);
+    break;
+  case 'd':
+    grid->move_cursor(__param(0, 1) - 1, grid->get_cursor_col());
+    break;
+  case 'H':
+  case 'f':
+    grid->move_cursor(__param(0, 1) - 1, __param(1, 1) - 1);
+    break;
+  case 'J':
+    grid->erase_display(__param(0, 0));
+    break;
+  case 'K':
+    grid->erase_line(__param(0, 0));
+    break;
+  case 'X':
+    grid->erase_chars(__param(0, 1));
+    break;
+  case 'P':
+    grid->delete_chars(__param(0, 1));
+    break;
+  case '@':
+    grid->insert_chars(__param(0, 1));
+    break;
+  case 'L':
+    grid->insert_lines(__param(0, 1));
+    break;
+  case 'M':
+    grid->delete_lines(__param(0, 1));
+    break;
+  case 'S':
+    grid->scroll_up(__param(0, 1));
+    break;
+  case 'T':
+    grid->scroll_down(__param(0, 1));
+    break;
+  case 'm':
+    __select_graphic_rendition();
+    break;
+  case 'r':
+    grid->set_scroll_region(__param(0, 0), __param(1, 0));
+    break;
+  case 's':
+    grid->save_cursor();
+    break;
+  case 'u':
+    grid->restore_cursor();
+    break;
+  default:
+    break;
+  }
+}
+
+// DECSET/DECRST
+void EscapeHandler::__set_mode(bool enabled) {
+  for (int i = 0; i < paramCount; i++) {
+    switch (params[i]) {
+    case 1:
+      applicationCursor = enabled;
+      break;
+    case 7:
+      grid->set_autowrap(enabled);
+      break;
+    case 25:
+      grid->set_cursor_visible(enabled);
+      break;
+    case 47:
+      __switch_screen(enabled);
+      break;
+    case 1047:
+      if (!enabled && is_alternate_screen())
+        grid->erase_display(2);
+      __switch_screen(enabled);
+      break;
+    case 2026:
+      __set_synchronized(enabled);
+      break;
+    case 1049:
+      // cursor is saved on the primary grid around the alternate screen
+      if (enabled && !is_alternate_screen())
+        grid->save_cursor();
+      __switch_screen(enabled);
+      if (enabled)
+        grid->erase_display(2);
+      else
+        grid->restore_cursor();
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// The pen, modes and cursor are terminal wide, they follow to the new grid
+void EscapeHandler::__switch_screen(bool toAlternate) {
+  Grid *target = toAlternate ? alternate : primary;
+  if (target == grid)
+    return;
+  target->set_pen(grid->get_pen());
+  target->set_autowrap(grid->is_autowrap());
+  target->set_cursor_visible(grid->is_cursor_visible());
+  target->move_cursor(grid->get_cursor_row(), grid->get_cursor_col());
+  // whoever draws the grid has to redraw all of it
+  target->mark_all_dirty();
+  grid = target;
+}
+
+// 38/48/58 arguments: 5;index or 2;r;g;b, or the ':' forms 5:index and
+// 2:colorspace:r:g:b where the colorspace id may be left out
+uint32_t EscapeHandler::__extended_color(int &i) {
+  int mode = __param(i + 1, 0);
+  if (mode == 5 && i + 2 < paramCount) {
+    int index = __param(i + 2, 0);
+    i += 2;
+    return COLOR_PALETTE(index & 0xFF);
+  }
+  if (mode == 2) {
+    int first = i + 2;
+    if (__is_subparam(i + 1)) {
+      int count = 0;
+      while (__is_subparam(first + count))
+        count++;
+      if (count >= 4)
+        first++;
+    }
+    if (first + 2 < paramCount) {
+      uint32_t color = COLOR_RGB(__param(first, 0) & 0xFF,
+                                 __param(first + 1, 0) & 0xFF,
+                                 __param(first + 2, 0) & 0xFF);
+      i = first + 2;
+      return color;
+    }
+  }
+  i = paramCount;
+  return COLOR_DEFAULT;
+}
+
+// Builds the new pen from the current one, the grid interns it once
+void EscapeHandler::__select_graphic_rendition() {
+  Style pen = grid->get_pen();
+  if (paramCount == 0)
+    pen = Style();
+  for (int i = 0; i < paramCount; i++) {
+    int param = params[i] < 0 ? 0 : params[i];
+    if (param == 0) {
+      pen = Style();
+    } else if (param == 1) {
+      pen.attrs |= ATTR_BOLD;
+    } else if (param == 2) {
+      pen.attrs |= ATTR_DIM;
+    } else if (param == 3) {
+      pen.attrs |= ATTR_ITALIC;
+    } else if (param == 4) {
+      // 4:n picks the underline style, 4:0 is off
+      pen.underline = UNDERLINE_SINGLE;
+      if (__is_subparam(i + 1)) {
+        int style = __param(++i, 0);
+        pen.underline = style <= UNDERLINE_DASHED ? style : UNDERLINE_SINGLE;
+      }
+    } else if (param == 5 || param == 6) {
+      pen.attrs |= ATTR_BLINK;
+    } else if (param == 7) {
+      pen.attrs |= ATTR_REVERSE;
+    } else if (param == 8) {
+      pen.attrs |= ATTR_HIDDEN;
+    } else if (param == 9) {
+      pen.attrs |= ATTR_STRIKE;
+    } else if (param == 21) {
+      pen.underline = UNDERLINE_DOUBLE;
+    } else if (param == 22) {
+      pen.attrs &= ~(ATTR_BOLD | ATTR_DIM);
+    } else if (param == 23) {
+      pen.attrs &= ~ATTR_ITALIC;
+    } else if (param == 24) {
+      pen.underline = UNDERLINE_NONE;
+    } else if (param == 25) {
+      pen.attrs &= ~ATTR_BLINK;
+    } else if (param == 27) {
+      pen.attrs &= ~ATTR_REVERSE;
+    } else if (param == 28) {
+      pen.attrs &= ~ATTR_HIDDEN;
+    } else if (param == 29) {
+      pen.attrs &= ~ATTR_STRIKE;
+    } else if (param >= 30 && param <= 37) {
+      pen.fg = COLOR_PALETTE(param - 30);
+    } else if (param == 38) {
+      pen.fg = __extended_color(i);
+    } else if (param == 39) {
+      pen.fg = COLOR_DEFAULT;
+    } else if (param >= 40 && param <= 47) {
+      pen.bg = COLOR_PALETTE(param - 40);
+    } else if (param == 48) {
+      pen.bg = __extended_color(i);
+    } else if (param == 49) {
+      pen.bg = COLOR_DEFAULT;
+    } else if (param == 58) {
+      pen.underlineColor = __extended_color(i);
+    } else if (param == 59) {
+      pen.underlineColor = COLOR_DEFAULT;
+    } else if (param >= 90 && param <= 97) {
+      pen.fg = COLOR_PALETTE(param - 90 + 8);
+    } else if (param >= 100 && param <= 107) {
+      pen.bg = COLOR_PALETTE(param - 100 + 8);
+    }
+  }
+  grid->set_pen(pen);
+}
+
+/*
+ * Checkpoint serialization of the parser state, a checkpoint can land in the
+ * middle of an escape or utf-8 sequence, of a string or of a synchronized
+ * update. The update keeps its age, a restored update is held for what is
+ * left of SYNCHRONIZED_UPDATE_TIMEOUT. Goes with the grids' SNAPSHOT_VERSION.
+ */
+void EscapeHandler::serialize(std::string &out) {
+  put_varint(out, is_alternate_screen());
+  put_varint(out, state);
+  put_varint(out, paramCount);
+  for (int i = 0; i < paramCount; i++)
+    put_varint(out, params[i] + 1);
+  put_varint(out, subparams);
+  put_varint(out, (unsigned char)privateMarker);
+  put_varint(out, (unsigned char)intermediate);
+  put_varint(out, utf8Codepoint);
+  put_varint(out, utf8Remaining);
+  put_varint(out, applicationCursor | applicationKeypad << 1);
+  put_varint(out, (unsigned char)stringType);
+  put_varint(out, stringLength);
+  for (int i = 0; i < std::min(stringLength, MAX_STRING_HEAD); i++)
+    put_varint(out, (unsigned char)stringHead[i]);
+  auto age = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - synchronizedSince);
+  put_varint(out, synchronized);
+  put_varint(out, synchronized ? std::max<int64_t>(age.count(), 0) : 0);
+}
+
+bool EscapeHandler::deserialize(const std::string &in, size_t &pos) {
+  uint64_t value[2];
+  if (!get_varint(in, pos, value[0]))
+    return false;
+  grid = value[0] ? alternate : primary;
+  grid->mark_all_dirty();
+  if (!get_varint(in, pos, value[0]) || !get_varint(in, pos, value[1]) ||
+      value[1] > MAX_CSI_PARAMS)
+    return false;
+  if (value[0] > STATE_CHARSET)
+    return false;
+  state = (State)value[0];
+  paramCount = value[1];
+  for (int i = 0; i < paramCount; i++) {
+    if (!get_varint(in, pos, value[0]))
+      return false;
+    params[i] = (int)value[0] - 1;
+  }
+  if (!get_varint(in, pos, value[0]))
+    return false;
+  subparams = value[0];
+  uint64_t marker, inter, codepoint, remaining, modes;
+  if (!get_varint(in, pos, marker) || !get_varint(in, pos, inter) ||
+      !get_varint(in, pos, codepoint) || !get_varint(in, pos, remaining) ||
+      !get_varint(in, pos, modes) || remaining > 3)
+    return false;
+  privateMarker = marker;
+  intermediate = inter;
+  utf8Codepoint = codepoint;
+  utf8Remaining = remaining;
+  applicationCursor = modes & 1;
+  applicationKeypad = modes & 2;
+  uint64_t type, length, head, sync, age;
+  if (!get_varint(in, pos, type) || !get_varint(in, pos, length) ||
+      length > INT32_MAX)
+    return false;
+  stringType = type;
+  stringLength = length;
+  for (int i = 0; i < std::min(stringLength, MAX_STRING_HEAD); i++) {
+    if (!get_varint(in, pos, head))
+      return false;
+    stringHead[i] = head;
+  }
+  if (!get_varint(in, pos, sync) || !get_varint(in, pos, age))
+    return false;
+  synchronized = sync;
+  synchronizedSince =
+      std::chrono::steady_clock::now() -
+      std::chrono::milliseconds(
+          std::min<uint64_t>(age, SYNCHRONIZED_UPDATE_TIMEOUT));
+  return true;
+}
+
+// The active screen and the key modes: what a mirror of the session needs
+// besides the grids, without the sequence in flight
+void EscapeHandler::serialize_modes(std::string &out) {
+  put_varint(out, is_alternate_screen() | applicationCursor << 1 |
+                      applicationKeypad << 2);
 }
 
-int __handle_csi_escapes(std::string s, void (*callback)(int signal)) {
-  if (s == "\x1b[2J") {
-    callback(SCR_CLEAR_SIGNAL);
-    return 1;
+bool EscapeHandler::deserialize_modes(const std::string &in, size_t &pos) {
+  uint64_t modes;
+  if (!get_varint(in, pos, modes))
+    return false;
+  Grid *target = modes & 1 ? alternate : primary;
+  if (target != grid) {
+    target->mark_all_dirty();
+    grid = target;
   }
-  return 0;
+  applicationCursor = modes & 2;
+  applicationKeypad = modes & 4;
+  return true;
 }
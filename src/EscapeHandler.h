@@ -1,9 +1,79 @@
 #ifndef ESCAPE_HANDLER_H
 #define ESCAPE_HANDLER_H
+#include "Grid.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
 
-#define SCR_CLEAR_SIGNAL 0
+#define MAX_CSI_PARAMS 16
+#define MAX_STRING_HEAD 4
+#define SYNCHRONIZED_UPDATE_TIMEOUT 150 // ms before a held frame is shown anyway
 
-int handle_escape_sequence(std::string s, void (*callback)(int signal));
-int __handle_csi_escapes(std::string s, void (*callback)(int signal));
+// VT/xterm byte stream parser.
+// Decodes utf-8, executes control characters and escape sequences and applies
+// the result to the active Grid. Sequences split across reads are resumed on
+// the next feed().
+// Full screen programs switch to the alternate grid (DECSET 47/1047/1049),
+// which has no scrollback and leaves the primary grid untouched.
+// Between begin and end of a synchronized update (DECSET 2026, or the DCS
+// =1s/=2s pair) the renderer keeps showing the last complete frame.
+class EscapeHandler {
+public:
+  EscapeHandler(Grid *primary, Grid *alternate);
+  Grid *get_grid();
+  bool is_alternate_screen();
+  bool is_application_cursor();
+  bool is_application_keypad();
+  bool is_synchronized();
+  void feed(const char *data, size_t size);
+  void reset();
+
+  void serialize(std::string &out);
+  bool deserialize(const std::string &in, size_t &pos);
+  void serialize_modes(std::string &out);
+  bool deserialize_modes(const std::string &in, size_t &pos);
+
+private:
+  enum State : uint8_t {
+    STATE_GROUND,
+    STATE_ESCAPE,
+    STATE_ESCAPE_INTERMEDIATE,
+    STATE_CSI,
+    STATE_STRING, // OSC, DCS, SOS, PM, APC: consumed until BEL/ST
+    STATE_STRING_ESCAPE,
+    STATE_CHARSET,
+  };
+  void __execute(unsigned char c);
+  void __escape_dispatch(unsigned char c);
+  void __csi_dispatch(unsigned char c);
+  void __set_mode(bool enabled);
+  void __string_dispatch();
+  void __set_synchronized(bool enabled);
+  void __switch_screen(bool alternate);
+  void __select_graphic_rendition();
+  uint32_t __extended_color(int &i);
+  int __param(int i, int fallback);
+  bool __is_subparam(int i);
+  Grid *grid; // active grid
+  Grid *primary;
+  Grid *alternate;
+  State state = STATE_GROUND;
+  int params[MAX_CSI_PARAMS];
+  int paramCount = 0;
+  uint32_t subparams = 0; // bit i: params[i] followed a ':' (SGR 4:3, 38:2:...)
+  char privateMarker = 0;
+  char intermediate = 0;
+  uint32_t utf8Codepoint = 0;
+  int utf8Remaining = 0;
+  char stringType = 0; // introducer of the string being consumed
+  char stringHead[MAX_STRING_HEAD];
+  int stringLength = 0; // bytes of the string, stringHead keeps the first
+  bool synchronized = false;
+  std::chrono::steady_clock::time_point synchronizedSince;
+  // key encoding modes, the keyboard handler reads them on the GLFW event
+  // thread without the session mutex
+  std::atomic<bool> applicationCursor = false; // DECCKM: arrows send SS3
+  std::atomic<bool> applicationKeypad = false; // DECKPAM: keypad sends SS3
+};
 #endif // !ESCAPE_HANDLER_H
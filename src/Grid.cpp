@@ -0,0 +1,1171 @@
+#include "Grid.h"
+#include "Helper.h"
+#include "Unicode.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#define TAB_WIDTH 8
+#define SNAPSHOT_VERSION 7
+
+Grid::Grid(uint32_t rows, uint32_t cols, bool scrollbackEnabled)
+    : rows(rows), cols(cols), lines(rows, Grid_Row(cols)), ring(rows),
+      scrollBottom(rows - 1), wrappedSlots(rows, 0),
+      scrollbackEnabled(scrollbackEnabled) {
+  for (uint32_t slot = 0; slot < rows; slot++)
+    ring[slot] = slot;
+  mark_all_dirty();
+}
+
+uint32_t Grid::get_rows() { return rows; }
+uint32_t Grid::get_cols() { return cols; }
+const Grid_Row &Grid::get_row(uint32_t row) { return __line(row); }
+uint32_t Grid::get_row_slot(uint32_t row) { return ring[__ring_position(row)]; }
+const Grid_Row &Grid::get_slot(uint32_t slot) { return lines[slot]; }
+size_t Grid::get_scrollback_size() {
+  return unreflowed.size() + scrollback.size();
+}
+void Grid::get_scrollback_row(size_t line, Grid_Row &out) {
+  __unpack_row(__scrollback_line(line), out);
+}
+size_t Grid::get_unreflowed_lines() { return unreflowed.size(); }
+uint64_t Grid::get_pushed_lines() { return pushedLines; }
+uint64_t Grid::get_rewrites() { return rewrites; }
+
+const Packed_Row &Grid::__scrollback_line(size_t line) {
+  return line < unreflowed.size() ? unreflowed[line]
+                                  : scrollback[line - unreflowed.size()];
+}
+uint32_t Grid::get_cursor_row() { return cursorRow; }
+uint32_t Grid::get_cursor_col() { return cursorCol; }
+bool Grid::is_cursor_visible() { return cursorVisible; }
+bool Grid::is_autowrap() { return autowrap; }
+const Style &Grid::get_pen() { return pen; }
+StyleTable &Grid::get_styles() { return styles; }
+ClusterTable &Grid::get_clusters() { return clusters; }
+
+bool Grid::is_slot_dirty(uint32_t slot) {
+  return dirtySlots[slot / 64] & (1ull << (slot % 64));
+}
+
+bool Grid::is_slot_wrapped(uint32_t slot) { return wrappedSlots[slot]; }
+
+Dirty_Span Grid::get_slot_dirty_span(uint32_t slot) {
+  return dirtySpans[slot];
+}
+
+void Grid::clear_slot_dirty(uint32_t slot) {
+  dirtySlots[slot / 64] &= ~(1ull << (slot % 64));
+  dirtySpans[slot] = {UINT16_MAX, 0};
+}
+
+void Grid::__mark_dirty(uint32_t slot, uint32_t first, uint32_t last) {
+  edits++;
+  dirtySlots[slot / 64] |= 1ull << (slot % 64);
+  Dirty_Span &span = dirtySpans[slot];
+  span.first = std::min<uint32_t>(span.first, first);
+  span.last = std::max<uint32_t>(span.last, last);
+}
+
+void Grid::mark_all_dirty() {
+  dirtySlots.assign((rows + 63) / 64, 0);
+  dirtySpans.assign(rows, {UINT16_MAX, 0});
+  for (uint32_t slot = 0; slot < rows; slot++)
+    __mark_dirty(slot, 0, cols);
+}
+
+// Mirrors of a grid in another process write whole slots, see GridSegment.
+// Cluster references of the row are the grid's from now on.
+void Grid::set_slot(uint32_t slot, const Grid_Row &row, bool wrapped) {
+  __release(lines[slot], 0, lines[slot].size());
+  size_t length = std::min<size_t>(row.size(), cols);
+  std::copy_n(row.begin(), length, lines[slot].begin());
+  std::fill(lines[slot].begin() + length, lines[slot].end(), Cell());
+  wrappedSlots[slot] = wrapped;
+  __mark_dirty(slot, 0, cols);
+}
+
+// slots[row] becomes the slot of the screen row. False, and the order left
+// as it was, unless slots holds every slot of the grid once.
+bool Grid::set_slot_order(const std::vector<uint32_t> &slots) {
+  if (slots.size() != rows)
+    return false;
+  std::vector<bool> used(rows, false);
+  for (uint32_t slot : slots) {
+    if (slot >= rows || used[slot])
+      return false;
+    used[slot] = true;
+  }
+  ring = slots;
+  ringOffset = 0;
+  return true;
+}
+
+// For styles interned from outside the grid: compacts the table when it is
+// about full, as a pen change would
+void Grid::collect_styles() {
+  if (styles.size() + 2 > MAX_STYLES && edits - collectEdits >= collectCost)
+    __collect_styles();
+}
+
+void Grid::set_pen(const Style &style) {
+  if (style == pen)
+    return;
+  pen = style;
+  __update_pen_styles();
+}
+
+// Erased cells keep the current background (xterm bce)
+void Grid::__update_pen_styles() {
+  // when the cells really use that many styles, retrying right away would
+  // rescan everything on each SGR: wait for as many edits as cells scanned
+  if (styles.size() + 2 > MAX_STYLES && edits - collectEdits >= collectCost)
+    __collect_styles();
+  Style blank;
+  blank.bg = pen.bg;
+  penStyle = styles.intern(pen);
+  blankStyle = styles.intern(blank);
+}
+
+// Rebuilds a full style table with only the styles cells still use. Pen
+// styles past the limit fall back to the default style until it has room.
+void Grid::__collect_styles() {
+  std::vector<uint16_t> remap(styles.size(), UINT16_MAX);
+  StyleTable used;
+  auto collect = [&](Grid_Row &line) {
+    for (Cell &cell : line) {
+      uint16_t &id = remap[cell.style];
+      if (id == UINT16_MAX)
+        id = used.intern(styles.get(cell.style));
+      cell.style = id;
+    }
+  };
+  for (Grid_Row &line : lines)
+    collect(line);
+  for (std::deque<Packed_Row> *packedLines : {&unreflowed, &scrollback}) {
+    for (Packed_Row &packed : *packedLines) {
+      unpacked.clear();
+      bool wrapped = __unpack_cells(packed, unpacked);
+      collect(unpacked);
+      __pack_row(unpacked, wrapped, packed);
+    }
+  }
+  styles = std::move(used);
+  mark_all_dirty();
+  collectEdits = edits;
+  collectCost = (lines.size() + get_scrollback_size()) * cols;
+}
+
+Cell Grid::__blank() {
+  Cell blank;
+  blank.style = blankStyle;
+  return blank;
+}
+
+// Drops the cluster references of cells about to be overwritten
+void Grid::__release(Grid_Row &row, uint32_t first, uint32_t last) {
+  if (clusters.size() == 0)
+    return;
+  for (uint32_t i = first; i < last; i++) {
+    if (row[i].flags & CELL_CLUSTER) {
+      clusters.release(row[i].codepoint);
+      row[i].flags &= ~CELL_CLUSTER;
+    }
+  }
+}
+
+uint32_t Grid::__ring_position(uint32_t row) {
+  uint32_t position = ringOffset + row;
+  return position < rows ? position : position - rows;
+}
+
+Grid_Row &Grid::__line(uint32_t row) {
+  return lines[ring[__ring_position(row)]];
+}
+
+void Grid::__clear_slot(uint32_t slot) {
+  wrappedSlots[slot] = false;
+  __release(lines[slot], 0, lines[slot].size());
+  std::fill(lines[slot].begin(), lines[slot].end(), __blank());
+  __mark_dirty(slot, 0, cols);
+}
+
+// Length of line without its trailing default cells. Mostly empty rows make
+// this the hot part of packing: cells are compared as 64-bit words, four at a
+// time.
+static size_t __trimmed_length(const Grid_Row &line) {
+  static_assert(sizeof(Cell) == 8);
+  auto word = [&line](size_t i) {
+    uint64_t value;
+    std::memcpy(&value, &line[i], sizeof(value));
+    return value;
+  };
+  Cell defaultCell;
+  uint64_t blank;
+  std::memcpy(&blank, &defaultCell, sizeof(blank));
+  size_t length = line.size();
+  while (length >= 4 &&
+         ((word(length - 1) ^ blank) | (word(length - 2) ^ blank) |
+          (word(length - 3) ^ blank) | (word(length - 4) ^ blank)) == 0)
+    length -= 4;
+  while (length > 0 && word(length - 1) == blank)
+    length--;
+  return length;
+}
+
+/*
+ * Packed rows: varint(length << 2 | wrapped << 1 | has clusters), then per
+ * run of cells sharing style and flags varint(count), varint(style),
+ * varint(flags) and the codepoints as varints. A line of one or two styles
+ * packs to little more than its text. Wrapped rows keep their trailing
+ * blanks, they are part of the line.
+ */
+#define PACKED_CLUSTERS 1
+#define PACKED_WRAPPED 2
+
+static bool __is_wrapped(const Packed_Row &packed) {
+  return packed[0] & PACKED_WRAPPED;
+}
+
+// Returns whether the row holds cluster references
+bool Grid::__pack_row(const Grid_Row &line, bool wrapped, Packed_Row &out) {
+  size_t length = wrapped ? line.size() : __trimmed_length(line);
+  bool hasClusters = false;
+  // built in a scratch buffer, the scrollback copy is allocated once at its
+  // final size
+  packing.clear();
+  put_varint(packing, length << 2 | (wrapped ? PACKED_WRAPPED : 0));
+  for (size_t start = 0, end; start < length; start = end) {
+    const Cell &first = line[start];
+    end = start + 1;
+    while (end < length && line[end].style == first.style &&
+           line[end].flags == first.flags)
+      end++;
+    hasClusters |= first.flags & CELL_CLUSTER;
+    put_varint(packing, end - start);
+    put_varint(packing, first.style);
+    put_varint(packing, first.flags);
+    for (size_t i = start; i < end; i++)
+      put_varint(packing, line[i].codepoint);
+  }
+  // the flags are the low bits of the first varint byte
+  if (hasClusters)
+    packing[0] |= PACKED_CLUSTERS;
+  out.assign(packing);
+  return hasClusters;
+}
+
+// Appends the cells of packed to out, returns whether the row is wrapped
+bool Grid::__unpack_cells(const Packed_Row &packed, Grid_Row &out) {
+  size_t pos = 0, i = out.size();
+  uint64_t header, count, style, flags, codepoint;
+  get_varint(packed, pos, header);
+  size_t length = header >> 2;
+  out.resize(i + length);
+  for (size_t end = i + length; i < end;) {
+    get_varint(packed, pos, count);
+    get_varint(packed, pos, style);
+    get_varint(packed, pos, flags);
+    for (uint64_t runEnd = i + count; i < runEnd; i++) {
+      get_varint(packed, pos, codepoint);
+      out[i] = {(uint32_t)codepoint, (uint16_t)style, (uint16_t)flags};
+    }
+  }
+  return header & PACKED_WRAPPED;
+}
+
+void Grid::__unpack_row(const Packed_Row &packed, Grid_Row &out) {
+  out.clear();
+  __unpack_cells(packed, out);
+  if (out.size() < cols)
+    out.resize(cols);
+}
+
+void Grid::__release_packed(const Packed_Row &packed) {
+  if (!(packed[0] & PACKED_CLUSTERS))
+    return;
+  unpacked.clear();
+  __unpack_cells(packed, unpacked);
+  __release(unpacked, 0, unpacked.size());
+}
+
+// Drops the oldest lines until room more lines fit
+void Grid::__trim_scrollback(size_t room) {
+  while (get_scrollback_size() + room > SCROLLBACK_LINES) {
+    std::deque<Packed_Row> &oldest =
+        unreflowed.empty() ? scrollback : unreflowed;
+    __release_packed(oldest.front());
+    oldest.pop_front();
+  }
+}
+
+// Packs line into the scrollback, its cluster references go with it
+void Grid::__push_packed(const Grid_Row &line, bool wrapped) {
+  __trim_scrollback(1);
+  pushedLines++;
+  scrollback.emplace_back();
+  __pack_row(line, wrapped, scrollback.back());
+}
+
+// The screen row keeps its storage
+void Grid::__push_scrollback(uint32_t slot) {
+  __push_packed(lines[slot], wrappedSlots[slot]);
+  if (scrollback.back()[0] & PACKED_CLUSTERS)
+    for (Cell &cell : lines[slot])
+      cell.flags &= ~CELL_CLUSTER;
+}
+
+// Splits the cells of a logical line into rows of at most cols cells, a wide
+// character never straddles two rows
+static void __wrap_line(const Grid_Row &cells, uint32_t cols,
+                        std::vector<Grid_Row> &out,
+                        std::vector<uint8_t> &wrapped) {
+  size_t start = 0;
+  do {
+    size_t end = std::min<size_t>(start + cols, cells.size());
+    if (end < cells.size() && end - start > 1 &&
+        cells[end - 1].flags & CELL_WIDE)
+      end--;
+    out.emplace_back(cells.begin() + start, cells.begin() + end);
+    wrapped.push_back(end < cells.size());
+    start = end;
+  } while (start < cells.size());
+}
+
+// Rewraps the newest unreflowed logical lines to the current width
+void Grid::reflow_scrollback(size_t count) {
+  std::vector<Grid_Row> rewrapped;
+  std::vector<uint8_t> wrapped;
+  if (count > 0 && !unreflowed.empty())
+    rewrites++;
+  for (size_t n = 0; n < count && !unreflowed.empty(); n++) {
+    size_t first = unreflowed.size() - 1;
+    while (first > 0 && __is_wrapped(unreflowed[first - 1]))
+      first--;
+    unpacked.clear();
+    for (size_t i = first; i < unreflowed.size(); i++)
+      __unpack_cells(unreflowed[i], unpacked);
+    unreflowed.erase(unreflowed.begin() + first, unreflowed.end());
+    rewrapped.clear();
+    wrapped.clear();
+    __wrap_line(unpacked, cols, rewrapped, wrapped);
+    for (size_t i = rewrapped.size(); i-- > 0;) {
+      scrollback.emplace_front();
+      __pack_row(rewrapped[i], wrapped[i], scrollback.front());
+    }
+  }
+  __trim_scrollback(0);
+}
+
+// Scrolls rows [top, bottom] up, count rows leave at the top and blank ones
+// enter at the bottom. Only slot indices move, never cells.
+void Grid::__scroll_region_up(uint32_t top, uint32_t bottom, uint32_t count,
+                              bool toScrollback) {
+  uint32_t height = bottom - top + 1;
+  count = std::min(count, height);
+  if (top == 0 && bottom == rows - 1) {
+    // whole screen: the top slot becomes the bottom one
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t slot = ring[ringOffset];
+      if (toScrollback)
+        __push_scrollback(slot);
+      __clear_slot(slot);
+      ringOffset = ringOffset + 1 == rows ? 0 : ringOffset + 1;
+    }
+    return;
+  }
+  rotation.resize(height);
+  for (uint32_t i = 0; i < height; i++)
+    rotation[i] = ring[__ring_position(top + i)];
+  for (uint32_t i = 0; i < height; i++)
+    ring[__ring_position(top + i)] = rotation[(i + count) % height];
+  for (uint32_t i = 0; i < count; i++) {
+    if (toScrollback)
+      __push_scrollback(rotation[i]);
+    __clear_slot(rotation[i]);
+  }
+}
+
+void Grid::__scroll_region_down(uint32_t top, uint32_t bottom,
+                                uint32_t count) {
+  uint32_t height = bottom - top + 1;
+  count = std::min(count, height);
+  if (top == 0 && bottom == rows - 1) {
+    for (uint32_t i = 0; i < count; i++) {
+      ringOffset = ringOffset == 0 ? rows - 1 : ringOffset - 1;
+      __clear_slot(ring[ringOffset]);
+    }
+    return;
+  }
+  rotation.resize(height);
+  for (uint32_t i = 0; i < height; i++)
+    rotation[i] = ring[__ring_position(top + i)];
+  for (uint32_t i = 0; i < height; i++)
+    ring[__ring_position(top + i)] = rotation[(i + height - count) % height];
+  for (uint32_t i = height - count; i < height; i++)
+    __clear_slot(rotation[i]);
+}
+
+// Puts the slots back in screen order, used before reallocating the rows
+void Grid::__linearize() {
+  std::vector<Grid_Row> ordered(rows);
+  std::vector<uint8_t> orderedWrapped(rows);
+  for (uint32_t row = 0; row < rows; row++) {
+    ordered[row] = std::move(__line(row));
+    orderedWrapped[row] = wrappedSlots[get_row_slot(row)];
+  }
+  lines = std::move(ordered);
+  wrappedSlots = std::move(orderedWrapped);
+  ring.resize(rows);
+  for (uint32_t slot = 0; slot < rows; slot++)
+    ring[slot] = slot;
+  ringOffset = 0;
+}
+
+// Width of a cluster: the width of its base, except that an emoji
+// presentation selector or a regional indicator pair (a flag) makes it wide
+static int __cluster_width(const std::u32string &codepoints) {
+  Grapheme_Break base = grapheme_break_property(codepoints[0]);
+  if (base == GB_REGIONAL_INDICATOR && codepoints.size() > 1 &&
+      grapheme_break_property(codepoints[1]) == GB_REGIONAL_INDICATOR)
+    return 2;
+  if (base == GB_EXTENDED_PICTOGRAPHIC &&
+      codepoints.find(0xFE0F) != std::u32string::npos)
+    return 2;
+  return unicode_width(codepoints[0]);
+}
+
+void Grid::__track_cluster(uint32_t slot, uint32_t col) {
+  clusterSlot = slot;
+  clusterCol = col;
+  clusterEdits = edits;
+  clusterCursorRow = cursorRow;
+  clusterCursorCol = cursorCol;
+  clusterWrapPending = wrapPending;
+}
+
+// Appends codepoint to the cluster of the last printed cell
+void Grid::__extend_cluster(uint32_t codepoint) {
+  Grid_Row &line = lines[clusterSlot];
+  Cell &cell = line[clusterCol];
+  std::u32string codepoints;
+  if (cell.flags & CELL_CLUSTER)
+    codepoints = clusters.get(cell.codepoint);
+  else
+    codepoints.push_back(cell.codepoint);
+  codepoints.push_back(codepoint);
+  uint32_t id = clusters.intern(codepoints);
+  if (cell.flags & CELL_CLUSTER)
+    clusters.release(cell.codepoint);
+  cell.codepoint = id;
+  cell.flags |= CELL_CLUSTER;
+  uint32_t last = clusterCol + (cell.flags & CELL_WIDE ? 2 : 1);
+  // the cluster turned wide: take the next cell as its spacer when the
+  // cursor still sits there
+  if (!(cell.flags & CELL_WIDE) && !wrapPending && clusterCol + 1 < cols &&
+      __cluster_width(codepoints) == 2) {
+    if (line[last].flags & CELL_WIDE && last + 1 < cols) {
+      __release(line, last + 1, last + 2);
+      line[last + 1] = __blank();
+    }
+    __release(line, last, last + 1);
+    line[last] = {0, cell.style, CELL_WIDE_SPACER};
+    cell.flags |= CELL_WIDE;
+    last = std::min(last + 2, cols);
+    if (clusterCol + 2 < cols) {
+      cursorCol = clusterCol + 2;
+    } else {
+      cursorCol = cols - 1;
+      wrapPending = true;
+    }
+  }
+  __mark_dirty(clusterSlot, clusterCol, last);
+  __track_cluster(clusterSlot, clusterCol);
+}
+
+void Grid::print(uint32_t codepoint) {
+  // the state after a boundary only depends on codepoint, a stale state
+  // matters when it claims a continuation
+  if (!grapheme_break(grapheme, codepoint)) {
+    // a cluster only continues if nothing happened since its last codepoint
+    if (edits == clusterEdits && cursorRow == clusterCursorRow &&
+        cursorCol == clusterCursorCol && wrapPending == clusterWrapPending) {
+      __extend_cluster(codepoint);
+      return;
+    }
+    grapheme = Grapheme_State();
+    grapheme_break(grapheme, codepoint);
+  }
+  int width = unicode_width(codepoint);
+  if (width == 0)
+    return; // nothing to attach to, no cell of its own either
+  if (width == 2 && cols < 2) {
+    // no row has room for a wide character
+    codepoint = 0xFFFD;
+    width = 1;
+  }
+  if (wrapPending && autowrap) {
+    wrappedSlots[get_row_slot(cursorRow)] = true;
+    carriage_return();
+    line_feed();
+  }
+  if (width == 2 && cursorCol + 1 == cols) {
+    // a wide character doesn't fit in the last column
+    if (!autowrap)
+      return;
+    wrappedSlots[get_row_slot(cursorRow)] = true;
+    carriage_return();
+    line_feed();
+  }
+  uint32_t slot = get_row_slot(cursorRow);
+  Grid_Row &line = lines[slot];
+  uint32_t first = cursorCol, last = cursorCol + width;
+  assert(last <= cols);
+  // overwriting half of a wide character blanks the other half
+  __release(line, first, last);
+  if (line[first].flags & CELL_WIDE_SPACER && first > 0) {
+    __release(line, first - 1, first);
+    line[--first] = __blank();
+  }
+  if (line[last - 1].flags & CELL_WIDE && last < cols) {
+    __release(line, last, last + 1);
+    line[last++] = __blank();
+  }
+  if (width == 1) {
+    line[cursorCol] = {codepoint, penStyle, 0};
+  } else {
+    line[cursorCol] = {codepoint, penStyle, CELL_WIDE};
+    line[cursorCol + 1] = {0, penStyle, CELL_WIDE_SPACER};
+  }
+  __mark_dirty(slot, first, last);
+  uint32_t col = cursorCol;
+  if (cursorCol + width < cols) {
+    cursorCol += width;
+  } else {
+    cursorCol = cols - 1;
+    wrapPending = true;
+  }
+  __track_cluster(slot, col);
+}
+
+void Grid::carriage_return() {
+  cursorCol = 0;
+  wrapPending = false;
+}
+
+void Grid::line_feed() {
+  wrapPending = false;
+  if (cursorRow == scrollBottom)
+    scroll_up(1);
+  else if (cursorRow + 1 < rows)
+    cursorRow++;
+}
+
+void Grid::reverse_index() {
+  wrapPending = false;
+  if (cursorRow == scrollTop)
+    __scroll_region_down(scrollTop, scrollBottom, 1);
+  else if (cursorRow > 0)
+    cursorRow--;
+}
+
+void Grid::backspace() {
+  wrapPending = false;
+  if (cursorCol > 0)
+    cursorCol--;
+}
+
+void Grid::tab() {
+  wrapPending = false;
+  cursorCol = std::min(cols - 1, (cursorCol / TAB_WIDTH + 1) * TAB_WIDTH);
+}
+
+void Grid::move_cursor(int row, int col) {
+  wrapPending = false;
+  cursorRow = std::clamp(row, 0, (int)rows - 1);
+  cursorCol = std::clamp(col, 0, (int)cols - 1);
+}
+
+void Grid::move_cursor_relative(int rows, int cols) {
+  move_cursor((int)cursorRow + rows, (int)cursorCol + cols);
+}
+
+// mode 0: cursor to end, 1: start to cursor, 2: screen, 3: scrollback
+void Grid::erase_display(int mode) {
+  if (mode == 3) {
+    __trim_scrollback(SCROLLBACK_LINES);
+    rewrites++;
+    return;
+  }
+  uint32_t first = mode == 0 ? cursorRow + 1 : 0;
+  uint32_t last = mode == 1 ? cursorRow : rows;
+  if (mode != 2)
+    erase_line(mode);
+  for (uint32_t row = first; row < last; row++)
+    __clear_slot(get_row_slot(row));
+}
+
+// mode 0: cursor to end, 1: start to cursor, 2: whole line
+void Grid::erase_line(int mode) {
+  uint32_t slot = get_row_slot(cursorRow);
+  uint32_t first = mode == 0 ? cursorCol : 0;
+  uint32_t last = mode == 1 ? cursorCol + 1 : cols;
+  __release(lines[slot], first, last);
+  std::fill(lines[slot].begin() + first, lines[slot].begin() + last,
+            __blank());
+  __mark_dirty(slot, first, last);
+}
+
+void Grid::erase_chars(int count) {
+  uint32_t slot = get_row_slot(cursorRow);
+  count = std::clamp(count, 1, (int)(cols - cursorCol));
+  __release(lines[slot], cursorCol, cursorCol + count);
+  std::fill_n(lines[slot].begin() + cursorCol, count, __blank());
+  __mark_dirty(slot, cursorCol, cursorCol + count);
+}
+
+void Grid::delete_chars(int count) {
+  uint32_t slot = get_row_slot(cursorRow);
+  Grid_Row &line = lines[slot];
+  count = std::clamp(count, 1, (int)(cols - cursorCol));
+  __release(line, cursorCol, cursorCol + count);
+  std::move(line.begin() + cursorCol + count, line.end(),
+            line.begin() + cursorCol);
+  std::fill(line.end() - count, line.end(), __blank());
+  __mark_dirty(slot, cursorCol, cols);
+}
+
+void Grid::insert_chars(int count) {
+  uint32_t slot = get_row_slot(cursorRow);
+  Grid_Row &line = lines[slot];
+  count = std::clamp(count, 1, (int)(cols - cursorCol));
+  __release(line, cols - count, cols);
+  std::move_backward(line.begin() + cursorCol, line.end() - count,
+                     line.end());
+  std::fill_n(line.begin() + cursorCol, count, __blank());
+  __mark_dirty(slot, cursorCol, cols);
+}
+
+void Grid::insert_lines(int count) {
+  if (cursorRow < scrollTop || cursorRow > scrollBottom)
+    return;
+  __scroll_region_down(cursorRow, scrollBottom, std::max(count, 1));
+  cursorCol = 0;
+  wrapPending = false;
+}
+
+void Grid::delete_lines(int count) {
+  if (cursorRow < scrollTop || cursorRow > scrollBottom)
+    return;
+  __scroll_region_up(cursorRow, scrollBottom, std::max(count, 1), false);
+  cursorCol = 0;
+  wrapPending = false;
+}
+
+// xterm only keeps lines scrolled off the top of the screen
+void Grid::scroll_up(int count) {
+  __scroll_region_up(scrollTop, scrollBottom, std::max(count, 1),
+                     scrollTop == 0 && scrollbackEnabled);
+}
+
+void Grid::scroll_down(int count) {
+  __scroll_region_down(scrollTop, scrollBottom, std::max(count, 1));
+}
+
+// DECSTBM, 1-based inclusive margins, 0 selects the screen edge
+void Grid::set_scroll_region(int top, int bottom) {
+  top = top <= 0 ? 0 : top - 1;
+  bottom = bottom <= 0 ? rows - 1 : std::min(bottom - 1, (int)rows - 1);
+  if (top >= bottom)
+    return;
+  scrollTop = top;
+  scrollBottom = bottom;
+  move_cursor(0, 0);
+}
+
+void Grid::save_cursor() {
+  savedRow = cursorRow;
+  savedCol = cursorCol;
+  savedPen = pen;
+}
+
+void Grid::restore_cursor() {
+  move_cursor(savedRow, savedCol);
+  set_pen(savedPen);
+}
+
+void Grid::set_autowrap(bool enabled) { autowrap = enabled; }
+void Grid::set_cursor_visible(bool visible) { cursorVisible = visible; }
+
+void Grid::reset() {
+  pen = Style();
+  savedPen = Style();
+  for (Grid_Row &line : lines)
+    std::fill(line.begin(), line.end(), Cell());
+  std::fill(wrappedSlots.begin(), wrappedSlots.end(), false);
+  unreflowed.clear();
+  scrollback.clear();
+  styles.clear();
+  clusters.clear();
+  penStyle = blankStyle = STYLE_DEFAULT;
+  cursorRow = cursorCol = savedRow = savedCol = 0;
+  scrollTop = 0;
+  scrollBottom = rows - 1;
+  wrapPending = false;
+  autowrap = cursorVisible = true;
+  rewrites++;
+  mark_all_dirty();
+}
+
+void Grid::resize(uint32_t rows, uint32_t cols) {
+  if (rows == 0 || cols == 0)
+    return;
+  __linearize();
+  if (scrollbackEnabled)
+    __reflow_screen(rows, cols);
+  else
+    __crop_screen(rows, cols);
+  ring.resize(rows);
+  for (uint32_t slot = 0; slot < rows; slot++)
+    ring[slot] = slot;
+  this->rows = rows;
+  this->cols = cols;
+  scrollTop = 0;
+  scrollBottom = rows - 1;
+  cursorRow = std::min(cursorRow, rows - 1);
+  cursorCol = std::min(cursorCol, cols - 1);
+  savedRow = std::min(savedRow, rows - 1);
+  savedCol = std::min(savedCol, cols - 1);
+  wrapPending = false;
+  rewrites++;
+  mark_all_dirty();
+}
+
+// Rewraps the logical lines on the (linearized) screen to newCols. The line
+// holding the first screen row can start in the scrollback, its rows are
+// pulled back. The cursor keeps its place in its line.
+void Grid::__reflow_screen(uint32_t newRows, uint32_t newCols) {
+  std::vector<Packed_Row> pulled;
+  for (;;) {
+    std::deque<Packed_Row> &newest =
+        scrollback.empty() ? unreflowed : scrollback;
+    if (newest.empty() || !__is_wrapped(newest.back()))
+      break;
+    pulled.push_back(std::move(newest.back()));
+    newest.pop_back();
+  }
+  if (newCols != cols) {
+    // everything in the scrollback now has the wrong width
+    for (Packed_Row &packed : scrollback)
+      unreflowed.push_back(std::move(packed));
+    scrollback.clear();
+  }
+  // rows below the cursor only count when they hold something
+  uint32_t used = cursorRow + 1;
+  for (uint32_t row = rows; row > used; row--) {
+    if (__trimmed_length(lines[row - 1]) > 0) {
+      used = row;
+      break;
+    }
+  }
+
+  std::vector<Grid_Row> rewrapped;
+  std::vector<uint8_t> wrapped;
+  size_t cursorOffset = SIZE_MAX;
+  uint32_t newCursorRow = 0, newCursorCol = 0;
+  Grid_Row &cells = unpacked;
+  cells.clear();
+  auto endLine = [&]() {
+    size_t first = rewrapped.size();
+    __wrap_line(cells, newCols, rewrapped, wrapped);
+    if (cursorOffset != SIZE_MAX) {
+      size_t start = 0;
+      for (size_t i = first; i < rewrapped.size(); i++) {
+        size_t length = rewrapped[i].size();
+        if (cursorOffset < start + length || i + 1 == rewrapped.size()) {
+          newCursorRow = i;
+          newCursorCol = std::min<size_t>(cursorOffset - start, newCols - 1);
+          break;
+        }
+        start += length;
+      }
+      cursorOffset = SIZE_MAX;
+    }
+    cells.clear();
+  };
+  for (auto packed = pulled.rbegin(); packed != pulled.rend(); packed++)
+    __unpack_cells(*packed, cells);
+  for (uint32_t row = 0; row < used; row++) {
+    Grid_Row &line = lines[row];
+    size_t length = wrappedSlots[row] ? line.size() : __trimmed_length(line);
+    if (row == cursorRow)
+      cursorOffset = cells.size() + cursorCol;
+    cells.insert(cells.end(), line.begin(), line.begin() + length);
+    if (!wrappedSlots[row])
+      endLine();
+  }
+  if (!cells.empty())
+    endLine();
+
+  // keep the cursor on screen: rows above go to the scrollback, rows below
+  // that don't fit are dropped
+  size_t start = 0;
+  if (rewrapped.size() > newRows)
+    start = std::min<size_t>(rewrapped.size() - newRows, newCursorRow);
+  for (size_t i = 0; i < start; i++)
+    __push_packed(rewrapped[i], wrapped[i]);
+  lines.assign(newRows, Grid_Row(newCols));
+  wrappedSlots.assign(newRows, false);
+  for (size_t i = start; i < rewrapped.size(); i++) {
+    if (i - start < newRows) {
+      lines[i - start] = std::move(rewrapped[i]);
+      lines[i - start].resize(newCols);
+      wrappedSlots[i - start] = wrapped[i];
+    } else {
+      __release(rewrapped[i], 0, rewrapped[i].size());
+    }
+  }
+  cursorRow = newCursorRow - start;
+  cursorCol = newCursorCol;
+}
+
+// Full screen programs redraw after a resize, their grid is only cut or
+// padded, keeping the cursor row
+void Grid::__crop_screen(uint32_t newRows, uint32_t newCols) {
+  uint32_t cut = 0;
+  while (rows - cut > newRows && cursorRow > 0) {
+    __release(lines[cut], 0, lines[cut].size());
+    cut++;
+    cursorRow--;
+  }
+  lines.erase(lines.begin(), lines.begin() + cut);
+  for (uint32_t row = newRows; row < lines.size(); row++)
+    __release(lines[row], 0, lines[row].size());
+  lines.resize(newRows, Grid_Row(newCols));
+  for (Grid_Row &line : lines) {
+    if (line.size() > newCols)
+      __release(line, newCols, line.size());
+    line.resize(newCols);
+  }
+  wrappedSlots.assign(newRows, false);
+}
+
+/*
+ * Checkpoint serialization
+ * Rows are stored without their trailing default cells (unless wrapped) and
+ * every cell only carries its colors/attributes when they differ from the
+ * previous cell.
+ * Cluster cells store their codepoints in place of the cluster id, ids are
+ * handed out again when the rows are read back.
+ */
+static void __put_style(std::string &out, const Style &style) {
+  put_varint(out, style.fg);
+  put_varint(out, style.bg);
+  put_varint(out, style.underlineColor);
+  put_varint(out, style.attrs | style.underline << 8);
+}
+
+static bool __get_style(const std::string &in, size_t &pos, Style &style) {
+  uint64_t fg, bg, underlineColor, attrs;
+  if (!get_varint(in, pos, fg) || !get_varint(in, pos, bg) ||
+      !get_varint(in, pos, underlineColor) || !get_varint(in, pos, attrs))
+    return false;
+  style.fg = fg;
+  style.bg = bg;
+  style.underlineColor = underlineColor;
+  style.attrs = attrs & 0xFF;
+  style.underline = attrs >> 8;
+  return true;
+}
+
+// Style ids are local to a table, rows carry the styles themselves
+static void __put_row(std::string &out, const Grid_Row &row, bool wrapped,
+                      StyleTable &styles, ClusterTable &clusters) {
+  size_t length = wrapped ? row.size() : __trimmed_length(row);
+  put_varint(out, length << 1 | wrapped);
+  Cell previous;
+  for (size_t i = 0; i < length; i++) {
+    const Cell &cell = row[i];
+    bool changed = cell.style != previous.style || cell.flags != previous.flags;
+    if (!(cell.flags & CELL_CLUSTER)) {
+      put_varint(out, ((uint64_t)cell.codepoint << 1) | changed);
+    } else {
+      const std::u32string &codepoints = clusters.get(cell.codepoint);
+      put_varint(out, ((uint64_t)codepoints.size() << 1) | changed);
+    }
+    if (changed) {
+      __put_style(out, styles.get(cell.style));
+      put_varint(out, cell.flags);
+      previous = cell;
+    }
+    if (cell.flags & CELL_CLUSTER)
+      for (char32_t codepoint : clusters.get(cell.codepoint))
+        put_varint(out, codepoint);
+  }
+}
+
+// Reads exactly the stored cells of a row. Every cell and every codepoint
+// of a cluster takes at least a byte, lengths past the input are corrupt.
+static bool __get_row(const std::string &in, size_t &pos, Grid_Row &row,
+                      bool &wrapped, StyleTable &styles,
+                      ClusterTable &clusters) {
+  uint64_t length, value;
+  if (!get_varint(in, pos, length))
+    return false;
+  wrapped = length & 1;
+  length >>= 1;
+  if (length > in.length() - pos)
+    return false;
+  row.assign(length, Cell());
+  Cell previous;
+  for (uint64_t i = 0; i < length; i++) {
+    if (!get_varint(in, pos, value))
+      return false;
+    if (value & 1) {
+      Style style;
+      uint64_t flags;
+      if (!__get_style(in, pos, style) || !get_varint(in, pos, flags))
+        return false;
+      previous.style = styles.intern(style);
+      previous.flags = flags;
+    }
+    uint32_t codepoint = value >> 1;
+    if (previous.flags & CELL_CLUSTER) {
+      // a cluster holds at least its base codepoint
+      if ((value >> 1) > in.length() - pos)
+        return false;
+      std::u32string codepoints(value >> 1, 0);
+      for (char32_t &c : codepoints) {
+        uint64_t read;
+        if (!get_varint(in, pos, read))
+          return false;
+        c = read;
+      }
+      if (codepoints.empty())
+        return false;
+      codepoint = clusters.intern(codepoints);
+    }
+    row[i] = previous;
+    row[i].codepoint = codepoint;
+  }
+  return true;
+}
+
+void Grid::serialize(std::string &out, size_t scrollbackTail) {
+  put_varint(out, SNAPSHOT_VERSION);
+  put_varint(out, rows);
+  put_varint(out, cols);
+  put_varint(out, cursorRow);
+  put_varint(out, cursorCol);
+  put_varint(out, savedRow);
+  put_varint(out, savedCol);
+  put_varint(out, scrollTop);
+  put_varint(out, scrollBottom);
+  put_varint(out, wrapPending | autowrap << 1 | cursorVisible << 2);
+  __put_style(out, pen);
+  __put_style(out, savedPen);
+  size_t tail = std::min(scrollbackTail, get_scrollback_size());
+  size_t first = get_scrollback_size() - tail;
+  put_varint(out, tail);
+  // leading rows of the tail that still have the width before a resize
+  put_varint(out, unreflowed.size() - std::min(first, unreflowed.size()));
+  for (size_t i = first; i < get_scrollback_size(); i++) {
+    unpacked.clear();
+    bool wrapped = __unpack_cells(__scrollback_line(i), unpacked);
+    __put_row(out, unpacked, wrapped, styles, clusters);
+  }
+  for (uint32_t row = 0; row < rows; row++)
+    __put_row(out, __line(row), wrappedSlots[get_row_slot(row)], styles,
+              clusters);
+}
+
+// The snapshot is decoded into a grid of its own and replaces this one only
+// once all of it decoded, a corrupt snapshot leaves the grid as it was
+bool Grid::deserialize(const std::string &in, size_t &pos) {
+  Grid decoded(1, 1, scrollbackEnabled);
+  size_t end = pos;
+  if (!decoded.__decode(in, end))
+    return false;
+  restore(std::move(decoded));
+  pos = end;
+  return true;
+}
+
+// Takes the contents of a decoded grid. The counters mirrors and caches
+// compare against go on from this grid's, the restore counts as a rewrite.
+void Grid::restore(Grid &&decoded) {
+  uint64_t oldEdits = edits, oldPushed = pushedLines, oldRewrites = rewrites;
+  *this = std::move(decoded);
+  edits = oldEdits;
+  pushedLines = oldPushed;
+  rewrites = oldRewrites + 1;
+  mark_all_dirty();
+}
+
+// Reads a snapshot into a freshly constructed grid. Sizes are checked
+// before anything is allocated for them, without overflowing.
+bool Grid::__decode(const std::string &in, size_t &pos) {
+  uint64_t version, newRows, newCols, values[6], flags, tail, unreflowedTail;
+  if (!get_varint(in, pos, version) || version != SNAPSHOT_VERSION ||
+      !get_varint(in, pos, newRows) || !get_varint(in, pos, newCols))
+    return false;
+  for (uint64_t &value : values)
+    if (!get_varint(in, pos, value))
+      return false;
+  if (!get_varint(in, pos, flags) || !__get_style(in, pos, pen) ||
+      !__get_style(in, pos, savedPen) || !get_varint(in, pos, tail) ||
+      !get_varint(in, pos, unreflowedTail) || unreflowedTail > tail)
+    return false;
+  // every row takes at least a byte of the input
+  size_t remaining = in.length() - pos;
+  if (newRows == 0 || newCols == 0 || newRows > SNAPSHOT_MAX_SIDE ||
+      newCols > SNAPSHOT_MAX_SIDE || newRows * newCols > SNAPSHOT_MAX_CELLS ||
+      newRows > remaining || tail > remaining - newRows)
+    return false;
+  if (values[0] >= newRows || values[1] >= newCols || values[2] >= newRows ||
+      values[3] >= newCols || values[4] > values[5] || values[5] >= newRows)
+    return false;
+  rows = newRows;
+  cols = newCols;
+  lines.assign(rows, Grid_Row());
+  wrappedSlots.assign(rows, false);
+  ring.resize(rows);
+  for (uint32_t slot = 0; slot < rows; slot++)
+    ring[slot] = slot;
+  cursorRow = values[0];
+  cursorCol = values[1];
+  savedRow = values[2];
+  savedCol = values[3];
+  scrollTop = values[4];
+  scrollBottom = values[5];
+  wrapPending = flags & 1;
+  autowrap = flags & 2;
+  cursorVisible = flags & 4;
+  __update_pen_styles();
+  unreflowed.resize(unreflowedTail);
+  scrollback.resize(tail - unreflowedTail);
+  for (std::deque<Packed_Row> *packedLines : {&unreflowed, &scrollback}) {
+    for (Packed_Row &packed : *packedLines) {
+      bool wrapped;
+      if (!__get_row(in, pos, unpacked, wrapped, styles, clusters))
+        return false;
+      __pack_row(unpacked, wrapped, packed);
+    }
+  }
+  for (uint32_t row = 0; row < rows; row++) {
+    bool wrapped;
+    if (!__get_row(in, pos, lines[row], wrapped, styles, clusters) ||
+        lines[row].size() > cols)
+      return false;
+    lines[row].resize(cols);
+    wrappedSlots[row] = wrapped;
+  }
+  return true;
+}
+
+/*
+ * Damage serialization, mirrors the grid in another process
+ * The cursor, the newest newLines scrollback lines, the slot order and the
+ * rows of the dirty slots, whose damage is cleared. Slots are the grid's own:
+ * the mirror starts from a snapshot followed by the damage of every slot
+ * (mark_all_dirty()), a scroll then costs the slot order and one row.
+ * A resize or a rewritten scrollback (get_rewrites()) needs a new snapshot.
+ */
+void Grid::serialize_damage(std::string &out, size_t newLines) {
+  put_varint(out, rows);
+  put_varint(out, cols);
+  put_varint(out, cursorRow);
+  put_varint(out, cursorCol);
+  put_varint(out, wrapPending | autowrap << 1 | cursorVisible << 2);
+  serialize_lines(out, newLines);
+  put_varint(out, ringOffset);
+  for (uint32_t slot : ring)
+    put_varint(out, slot);
+  uint32_t dirty = 0;
+  for (uint32_t slot = 0; slot < rows; slot++)
+    dirty += is_slot_dirty(slot);
+  put_varint(out, dirty);
+  for (uint32_t slot = 0; slot < rows; slot++) {
+    if (!is_slot_dirty(slot))
+      continue;
+    serialize_slot(out, slot);
+    clear_slot_dirty(slot);
+  }
+}
+
+// The rows read are marked dirty for the mirror's own renderer
+bool Grid::deserialize_damage(const std::string &in, size_t &pos) {
+  uint64_t newRows, newCols, cursor[2], flags, count, value;
+  if (!get_varint(in, pos, newRows) || !get_varint(in, pos, newCols) ||
+      newRows != rows || newCols != cols || !get_varint(in, pos, cursor[0]) ||
+      !get_varint(in, pos, cursor[1]) || !get_varint(in, pos, flags))
+    return false;
+  cursorRow = std::min<uint64_t>(cursor[0], rows - 1);
+  cursorCol = std::min<uint64_t>(cursor[1], cols - 1);
+  wrapPending = flags & 1;
+  autowrap = flags & 2;
+  cursorVisible = flags & 4;
+  collect_styles();
+  if (!deserialize_lines(in, pos) || !get_varint(in, pos, value) ||
+      value >= rows)
+    return false;
+  ringOffset = value;
+  for (uint32_t &slot : ring) {
+    if (!get_varint(in, pos, value) || value >= rows)
+      return false;
+    slot = value;
+  }
+  if (!get_varint(in, pos, count))
+    return false;
+  for (uint64_t i = 0; i < count; i++)
+    if (!deserialize_slot(in, pos))
+      return false;
+  return true;
+}
+
+// The newest newLines scrollback lines
+void Grid::serialize_lines(std::string &out, size_t newLines) {
+  size_t count = std::min(newLines, get_scrollback_size());
+  put_varint(out, count);
+  for (size_t i = get_scrollback_size() - count; i < get_scrollback_size();
+       i++) {
+    unpacked.clear();
+    bool wrapped = __unpack_cells(__scrollback_line(i), unpacked);
+    __put_row(out, unpacked, wrapped, styles, clusters);
+  }
+}
+
+// Appends the lines to the scrollback
+bool Grid::deserialize_lines(const std::string &in, size_t &pos) {
+  uint64_t count;
+  if (!get_varint(in, pos, count))
+    return false;
+  for (uint64_t i = 0; i < count; i++) {
+    bool wrapped;
+    if (!__get_row(in, pos, unpacked, wrapped, styles, clusters))
+      return false;
+    __push_packed(unpacked, wrapped);
+  }
+  return true;
+}
+
+void Grid::serialize_slot(std::string &out, uint32_t slot) {
+  put_varint(out, slot);
+  __put_row(out, lines[slot], wrappedSlots[slot], styles, clusters);
+}
+
+bool Grid::deserialize_slot(const std::string &in, size_t &pos) {
+  uint64_t slot;
+  bool wrapped;
+  if (!get_varint(in, pos, slot) || slot >= rows)
+    return false;
+  __release(lines[slot], 0, lines[slot].size());
+  if (!__get_row(in, pos, lines[slot], wrapped, styles, clusters))
+    return false;
+  lines[slot].resize(cols);
+  wrappedSlots[slot] = wrapped;
+  __mark_dirty(slot, 0, cols);
+  return true;
+}
@@ -0,0 +1,196 @@
+#ifndef GRID_H
+#define GRID_H
+#include "ClusterTable.h"
+#include "StyleTable.h"
+#include "Unicode.h"
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Cell layout flags
+#define CELL_WIDE (1 << 0)        // first cell of a double width character
+#define CELL_WIDE_SPACER (1 << 1) // second cell of a double width character
+#define CELL_CLUSTER (1 << 2)     // codepoint is an id in the cluster table
+
+#define SCROLLBACK_LINES 10000
+// Largest grids a snapshot or a client of the session server may ask for
+#define SNAPSHOT_MAX_SIDE 0xFFFF     // rows or cols, the most a winsize holds
+#define SNAPSHOT_MAX_CELLS (1 << 24) // rows x cols
+
+// 8 bytes: colors and attributes live in the style table
+typedef struct Cell {
+  uint32_t codepoint = ' ';
+  uint16_t style = STYLE_DEFAULT;
+  uint16_t flags = 0;
+  bool operator==(const Cell &other) const = default;
+} Cell;
+
+typedef std::vector<Cell> Grid_Row;
+
+// A scrollback line: trailing blanks trimmed, cells run-length encoded by
+// style and flags (see Grid::__pack_row). Expanded back to cells on demand.
+// Rows ending in an autowrap are flagged, a logical line is a run of wrapped
+// rows and the row that ends it.
+typedef std::string Packed_Row;
+
+// Columns [first, last) of a row touched since the damage was cleared
+typedef struct Dirty_Span {
+  uint16_t first;
+  uint16_t last;
+} Dirty_Span;
+
+// Screen contents of the terminal: rows x cols cells, the cursor and the
+// scrollback lines that scrolled off the top.
+// The escape handler drives the mutations, the renderer reads the rows.
+//
+// Row storage never moves when scrolling: screen rows live in slots and a
+// ring of slot indices gives their order. Scrolling the screen advances the
+// ring offset, scrolling a DECSTBM region rotates the slot indices inside
+// it. Damage is tracked per slot (a bitmap plus the damaged column span), so
+// consumers caching per slot data only rebuild the slots that were written.
+//
+// A width change rewraps the logical lines on the screen right away and
+// leaves the scrollback to reflow_scrollback(): lines older than the resize
+// stay as they were until they are reflowed, newest first.
+//
+// print() segments the codepoint stream into grapheme clusters as it goes:
+// a codepoint continuing the cluster of the last printed cell is appended to
+// that cell through the cluster table instead of taking a cell of its own.
+class Grid {
+public:
+  Grid(uint32_t rows, uint32_t cols, bool scrollbackEnabled = true);
+  uint32_t get_rows();
+  uint32_t get_cols();
+  const Grid_Row &get_row(uint32_t row);
+  uint32_t get_row_slot(uint32_t row);
+  const Grid_Row &get_slot(uint32_t slot);
+  size_t get_scrollback_size();
+  void get_scrollback_row(size_t line, Grid_Row &out); // 0 is the oldest
+  size_t get_unreflowed_lines(); // scrollback lines [0, n) still unreflowed
+  void reflow_scrollback(size_t lines);
+  uint32_t get_cursor_row();
+  uint32_t get_cursor_col();
+  bool is_cursor_visible();
+  bool is_autowrap();
+  const Style &get_pen();
+  void set_pen(const Style &style);
+  StyleTable &get_styles();
+  ClusterTable &get_clusters();
+  bool is_slot_dirty(uint32_t slot);
+  bool is_slot_wrapped(uint32_t slot);
+  Dirty_Span get_slot_dirty_span(uint32_t slot);
+  void clear_slot_dirty(uint32_t slot);
+  void mark_all_dirty();
+  void set_slot(uint32_t slot, const Grid_Row &row, bool wrapped);
+  bool set_slot_order(const std::vector<uint32_t> &slots);
+  void collect_styles();
+
+  void print(uint32_t codepoint);
+  void carriage_return();
+  void line_feed();
+  void reverse_index();
+  void backspace();
+  void tab();
+  void move_cursor(int row, int col);
+  void move_cursor_relative(int rows, int cols);
+  void erase_display(int mode);
+  void erase_line(int mode);
+  void erase_chars(int count);
+  void delete_chars(int count);
+  void insert_chars(int count);
+  void insert_lines(int count);
+  void delete_lines(int count);
+  void scroll_up(int count);
+  void scroll_down(int count);
+  void set_scroll_region(int top, int bottom);
+  void save_cursor();
+  void restore_cursor();
+  void set_autowrap(bool enabled);
+  void set_cursor_visible(bool visible);
+  void reset();
+  void resize(uint32_t rows, uint32_t cols);
+
+  void serialize(std::string &out, size_t scrollbackTail);
+  bool deserialize(const std::string &in, size_t &pos);
+  void restore(Grid &&decoded);
+  uint64_t get_pushed_lines();
+  uint64_t get_rewrites();
+  void serialize_damage(std::string &out, size_t newLines);
+  bool deserialize_damage(const std::string &in, size_t &pos);
+  void serialize_lines(std::string &out, size_t newLines);
+  bool deserialize_lines(const std::string &in, size_t &pos);
+  void serialize_slot(std::string &out, uint32_t slot);
+  bool deserialize_slot(const std::string &in, size_t &pos);
+
+private:
+  bool __decode(const std::string &in, size_t &pos);
+  Cell __blank();
+  Grid_Row &__line(uint32_t row);
+  uint32_t __ring_position(uint32_t row);
+  void __clear_slot(uint32_t slot);
+  void __push_scrollback(uint32_t slot);
+  void __push_packed(const Grid_Row &line, bool wrapped);
+  void __trim_scrollback(size_t room);
+  const Packed_Row &__scrollback_line(size_t line);
+  bool __pack_row(const Grid_Row &line, bool wrapped, Packed_Row &out);
+  bool __unpack_cells(const Packed_Row &packed, Grid_Row &out);
+  void __unpack_row(const Packed_Row &packed, Grid_Row &out);
+  void __release_packed(const Packed_Row &packed);
+  void __reflow_screen(uint32_t newRows, uint32_t newCols);
+  void __crop_screen(uint32_t newRows, uint32_t newCols);
+  void __scroll_region_up(uint32_t top, uint32_t bottom, uint32_t count,
+                          bool toScrollback);
+  void __scroll_region_down(uint32_t top, uint32_t bottom, uint32_t count);
+  void __linearize();
+  void __mark_dirty(uint32_t slot, uint32_t first, uint32_t last);
+  void __update_pen_styles();
+  void __collect_styles();
+  void __release(Grid_Row &row, uint32_t first, uint32_t last);
+  void __extend_cluster(uint32_t codepoint);
+  void __track_cluster(uint32_t slot, uint32_t col);
+  uint32_t rows;
+  uint32_t cols;
+  std::vector<Grid_Row> lines;  // row storage indexed by slot
+  std::vector<uint32_t> ring;   // slots in screen order from ringOffset
+  uint32_t ringOffset = 0;
+  std::vector<uint32_t> rotation; // scratch for region scrolls
+  uint32_t scrollTop = 0;         // DECSTBM margins, inclusive
+  uint32_t scrollBottom;
+  std::vector<uint8_t> wrappedSlots; // slot's row continues on the next one
+  std::deque<Packed_Row> unreflowed;  // older than the last width change
+  std::deque<Packed_Row> scrollback;
+  Grid_Row unpacked;  // scratch for packed rows
+  Packed_Row packing; // scratch for __pack_row
+  bool scrollbackEnabled;
+  std::vector<uint64_t> dirtySlots; // one bit per slot
+  std::vector<Dirty_Span> dirtySpans;
+  uint64_t edits = 0; // bumped on every mutation of the cells
+  uint64_t pushedLines = 0; // lines ever pushed to the scrollback
+  uint64_t rewrites = 0; // size changes and scrollback edits but appending
+  StyleTable styles;
+  uint64_t collectEdits = 0; // edits at the last style collection
+  uint64_t collectCost = 0;  // cells it scanned
+  ClusterTable clusters;
+  // segmentation state and position of the last printed cell, valid while
+  // nothing but print() touched the grid or the cursor since
+  Grapheme_State grapheme;
+  uint64_t clusterEdits = UINT64_MAX;
+  uint32_t clusterSlot = 0;
+  uint32_t clusterCol = 0;
+  uint32_t clusterCursorRow = 0;
+  uint32_t clusterCursorCol = 0;
+  bool clusterWrapPending = false;
+  uint32_t cursorRow = 0;
+  uint32_t cursorCol = 0;
+  bool wrapPending = false; // cursor sits past the last column
+  bool autowrap = true;
+  bool cursorVisible = true;
+  Style pen;
+  uint16_t penStyle = STYLE_DEFAULT;   // id of pen
+  uint16_t blankStyle = STYLE_DEFAULT; // id of erased cells, pen.bg only
+  uint32_t savedRow = 0;
+  uint32_t savedCol = 0;
+  Style savedPen;
+};
+#endif // !GRID_H
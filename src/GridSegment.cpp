@@ -0,0 +1,297 @@
+#include "GridSegment.h"
+#include "Helper.h"
+#include "Logger.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+GridSegment::GridSegment() {}
+
+GridSegment::~GridSegment() {
+  if (memory != nullptr)
+    munmap(memory, size);
+  if (fd >= 0)
+    close(fd);
+}
+
+size_t GridSegment::__grid_size(uint32_t rows, uint32_t cols) {
+  return sizeof(Segment_Grid) + rows * sizeof(uint32_t) +
+         rows * (sizeof(Segment_Row) + cols * sizeof(Segment_Cell));
+}
+
+static uint32_t *__slot_order(char *base) {
+  return (uint32_t *)(base + sizeof(Segment_Grid));
+}
+
+static Segment_Row *__row(char *base, uint32_t rows, uint32_t cols,
+                          uint32_t slot) {
+  return (Segment_Row *)(base + sizeof(Segment_Grid) +
+                         rows * sizeof(uint32_t) +
+                         slot * (sizeof(Segment_Row) +
+                                 cols * sizeof(Segment_Cell)));
+}
+
+// Server side: a segment sized for the grids as they are now
+GridSegment *GridSegment::create(Grid *primary, Grid *alternate) {
+  GridSegment *segment = new GridSegment();
+  segment->alternateOffset =
+      __grid_size(primary->get_rows(), primary->get_cols());
+  segment->size = segment->alternateOffset +
+                  __grid_size(alternate->get_rows(), alternate->get_cols());
+  segment->fd = memfd_create("terminal-grids", MFD_CLOEXEC);
+  if (segment->fd == -1 || ftruncate(segment->fd, segment->size) == -1) {
+    pretty_log("SEGMENT", "Can't create a grid segment.", ERR);
+    delete segment;
+    return nullptr;
+  }
+  void *memory = mmap(nullptr, segment->size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, segment->fd, 0);
+  if (memory == MAP_FAILED) {
+    pretty_log("SEGMENT", "Can't map a grid segment.", ERR);
+    delete segment;
+    return nullptr;
+  }
+  segment->memory = (char *)memory;
+  return segment;
+}
+
+// Client side: the segment the server sent along with the snapshot that
+// gave the grids their size
+GridSegment *GridSegment::map(int fd, Grid *primary, Grid *alternate) {
+  GridSegment *segment = new GridSegment();
+  segment->fd = fd;
+  segment->alternateOffset =
+      __grid_size(primary->get_rows(), primary->get_cols());
+  segment->size = segment->alternateOffset +
+                  __grid_size(alternate->get_rows(), alternate->get_cols());
+  struct stat info;
+  if (fstat(fd, &info) == -1 || (size_t)info.st_size != segment->size) {
+    pretty_log("SEGMENT", "The grid segment doesn't fit the grids.", ERR);
+    delete segment;
+    return nullptr;
+  }
+  void *memory = mmap(nullptr, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    pretty_log("SEGMENT", "Can't map a grid segment.", ERR);
+    delete segment;
+    return nullptr;
+  }
+  segment->memory = (char *)memory;
+  segment->seenPrimary.assign(primary->get_rows(), 0);
+  segment->seenAlternate.assign(alternate->get_rows(), 0);
+  return segment;
+}
+
+int GridSegment::get_fd() { return fd; }
+
+// Copies the dirty rows of both grids into the segment and clears their
+// damage. Called with the session mutex held. Rows the segment can't hold
+// are appended to rows, per grid a count and for each row its generation,
+// the length and Grid::serialize_slot().
+void GridSegment::publish(Grid *primary, Grid *alternate, std::string &rows) {
+  __publish_grid(primary, memory, rows);
+  __publish_grid(alternate, memory + alternateOffset, rows);
+}
+
+void GridSegment::__publish_grid(Grid *grid, char *base, std::string &rows) {
+  Segment_Grid *header = (Segment_Grid *)base;
+  uint32_t height = grid->get_rows(), width = grid->get_cols();
+  StyleTable &styles = grid->get_styles();
+  std::string clusterRows;
+  uint32_t clusterCount = 0;
+  for (uint32_t slot = 0; slot < height; slot++) {
+    if (!grid->is_slot_dirty(slot))
+      continue;
+    Segment_Row *row = __row(base, height, width, slot);
+    Segment_Cell *out = (Segment_Cell *)(row + 1);
+    const Grid_Row &line = grid->get_slot(slot);
+    uint32_t sequence = row->sequence.load(std::memory_order_relaxed);
+    row->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bool clusters = false;
+    for (uint32_t col = 0; col < width; col++) {
+      const Cell &cell = line[col];
+      const Style &style = styles.get(cell.style);
+      Segment_Cell &shared = out[col];
+      shared.codepoint = cell.codepoint;
+      shared.flags = cell.flags & ~CELL_CLUSTER;
+      shared.fg = style.fg;
+      shared.bg = style.bg;
+      shared.underlineColor = style.underlineColor;
+      shared.attrs = style.attrs;
+      shared.underline = style.underline;
+      if (cell.flags & CELL_CLUSTER) {
+        clusters = true;
+        shared.codepoint = grid->get_clusters().get(cell.codepoint)[0];
+      }
+    }
+    row->flags = (grid->is_slot_wrapped(slot) ? SEGMENT_ROW_WRAPPED : 0) |
+                 (clusters ? SEGMENT_ROW_CLUSTERS : 0);
+    row->sequence.store(sequence + 2, std::memory_order_release);
+    if (clusters) {
+      std::string serialized;
+      grid->serialize_slot(serialized, slot);
+      put_varint(clusterRows, sequence + 2);
+      put_varint(clusterRows, serialized.size());
+      clusterRows += serialized;
+      clusterCount++;
+    }
+    grid->clear_slot_dirty(slot);
+  }
+  uint32_t sequence = header->sequence.load(std::memory_order_relaxed);
+  header->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->rows = height;
+  header->cols = width;
+  header->cursorRow = grid->get_cursor_row();
+  header->cursorCol = grid->get_cursor_col();
+  header->flags = grid->is_autowrap() | grid->is_cursor_visible() << 1;
+  uint32_t *order = __slot_order(base);
+  for (uint32_t row = 0; row < height; row++)
+    order[row] = grid->get_row_slot(row);
+  header->sequence.store(sequence + 2, std::memory_order_release);
+  put_varint(rows, clusterCount);
+  rows += clusterRows;
+}
+
+// Reads the rows whose generation changed into the mirrors, then the rows
+// publish() serialized from in. Called with the session mutex held. False
+// when the grids no longer have the segment's size, a snapshot follows.
+bool GridSegment::read(Grid *primary, Grid *alternate, const std::string &in,
+                       size_t &pos) {
+  return __read_grid(primary, memory, seenPrimary) &&
+         __read_grid(alternate, memory + alternateOffset, seenAlternate) &&
+         __read_serialized(primary, seenPrimary, in, pos) &&
+         __read_serialized(alternate, seenAlternate, in, pos);
+}
+
+// A serialized row whose generation the segment has moved past is stale:
+// the client read the newer row from the segment, or the next notification
+// carries it
+bool GridSegment::__read_serialized(Grid *grid,
+                                    const std::vector<uint32_t> &seen,
+                                    const std::string &in, size_t &pos) {
+  uint64_t count, generation, length, slot;
+  if (!get_varint(in, pos, count))
+    return false;
+  for (uint64_t i = 0; i < count; i++) {
+    if (!get_varint(in, pos, generation) || !get_varint(in, pos, length) ||
+        length > in.size() - pos)
+      return false;
+    size_t end = pos + length, peek = pos;
+    if (!get_varint(in, peek, slot) || slot >= seen.size())
+      return false;
+    if (seen[slot] == generation && !grid->deserialize_slot(in, pos))
+      return false;
+    pos = end;
+  }
+  return true;
+}
+
+// Waits out a writer, false after SEGMENT_WRITER_WAIT: a server that died
+// mid publish leaves the sequence odd for good
+static bool __begin_read(const std::atomic<uint32_t> &sequence,
+                         uint32_t &value) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(SEGMENT_WRITER_WAIT);
+  while ((value = sequence.load(std::memory_order_acquire)) & 1) {
+    if (std::chrono::steady_clock::now() >= deadline)
+      return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// False when a writer moved the sequence while it was copied
+static bool __end_read(const std::atomic<uint32_t> &sequence,
+                       uint32_t value) {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return sequence.load(std::memory_order_relaxed) == value;
+}
+
+// The slot order is read before and checked after the rows: a publish that
+// overtook the read leaves rows newer than the order, the grid is read again.
+// False as well when a writer never finishes or the order isn't one of the
+// grid's slots, the rows read so far stay and the next read goes on.
+bool GridSegment::__read_grid(Grid *grid, char *base,
+                              std::vector<uint32_t> &seen) {
+  Segment_Grid *header = (Segment_Grid *)base;
+  uint32_t height = grid->get_rows(), width = grid->get_cols();
+  std::vector<uint32_t> order(height);
+  copy.resize(width);
+  cells.resize(width);
+  for (int attempt = 0; attempt < SEGMENT_READ_RETRIES; attempt++) {
+    uint32_t headerSequence;
+    Segment_Grid state;
+    do {
+      if (!__begin_read(header->sequence, headerSequence))
+        return false;
+      state.rows = header->rows;
+      state.cols = header->cols;
+      state.cursorRow = header->cursorRow;
+      state.cursorCol = header->cursorCol;
+      state.flags = header->flags;
+      memcpy(order.data(), __slot_order(base), height * sizeof(uint32_t));
+    } while (!__end_read(header->sequence, headerSequence));
+    if (state.rows == 0)
+      return true; // nothing published yet
+    if (state.rows != height || state.cols != width)
+      return false;
+    grid->collect_styles();
+    for (uint32_t slot = 0; slot < height; slot++) {
+      Segment_Row *row = __row(base, height, width, slot);
+      uint32_t sequence, flags;
+      do {
+        if (!__begin_read(row->sequence, sequence))
+          return false;
+        if (sequence == seen[slot])
+          break;
+        memcpy((void *)copy.data(), row + 1, width * sizeof(Segment_Cell));
+        flags = row->flags;
+      } while (!__end_read(row->sequence, sequence));
+      if (sequence == seen[slot])
+        continue;
+      seen[slot] = sequence;
+      if (flags & SEGMENT_ROW_CLUSTERS)
+        continue; // comes with the notification
+      // neighbouring cells mostly share their style
+      Style style;
+      uint16_t id = STYLE_DEFAULT;
+      for (uint32_t col = 0; col < width; col++) {
+        const Segment_Cell &shared = copy[col];
+        if (shared.fg != style.fg || shared.bg != style.bg ||
+            shared.underlineColor != style.underlineColor ||
+            shared.attrs != style.attrs ||
+            shared.underline != style.underline) {
+          style.fg = shared.fg;
+          style.bg = shared.bg;
+          style.underlineColor = shared.underlineColor;
+          style.attrs = shared.attrs;
+          style.underline = shared.underline;
+          id = grid->get_styles().intern(style);
+        }
+        cells[col].codepoint = shared.codepoint;
+        // cluster ids are the server's, those rows come serialized
+        cells[col].flags = shared.flags & ~CELL_CLUSTER;
+        cells[col].style = id;
+      }
+      grid->set_slot(slot, cells, flags & SEGMENT_ROW_WRAPPED);
+    }
+    if (__end_read(header->sequence, headerSequence) ||
+        attempt + 1 == SEGMENT_READ_RETRIES) {
+      if (!grid->set_slot_order(order))
+        return false;
+      grid->move_cursor(state.cursorRow, state.cursorCol);
+      grid->set_autowrap(state.flags & 1);
+      grid->set_cursor_visible(state.flags & 2);
+      return true;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,81 @@
+#ifndef GRID_SEGMENT_H
+#define GRID_SEGMENT_H
+#include "Grid.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Segment row flags
+#define SEGMENT_ROW_WRAPPED (1 << 0)
+#define SEGMENT_ROW_CLUSTERS (1 << 1) // sent over the socket, cells hold bases
+#define SEGMENT_READ_RETRIES 3 // rereads of a grid a publish overtook
+#define SEGMENT_WRITER_WAIT 50 // ms a reader waits out a writer, then fails
+
+// A cell with its style resolved, style ids are local to the server's table
+typedef struct Segment_Cell {
+  uint32_t codepoint;
+  uint32_t fg;
+  uint32_t bg;
+  uint32_t underlineColor;
+  uint16_t flags;
+  uint8_t attrs;
+  uint8_t underline;
+} Segment_Cell;
+
+// Seqlocks: the sequence is odd while the server writes what follows, a
+// reader copies it and retries when the sequence moved meanwhile. An even
+// sequence also is the generation of the row, the client rereads a row
+// only when it changed.
+typedef struct Segment_Row {
+  std::atomic<uint32_t> sequence;
+  uint32_t flags;
+} Segment_Row; // followed by cols Segment_Cells
+
+typedef struct Segment_Grid {
+  std::atomic<uint32_t> sequence;
+  uint32_t rows; // 0 until the first publish
+  uint32_t cols;
+  uint32_t cursorRow;
+  uint32_t cursorCol;
+  uint32_t flags; // autowrap, cursor visible
+} Segment_Grid; // followed by the slot of each screen row, then the rows
+
+// The grids of a session in a shared memory segment (memfd) of their size,
+// the server publishes them and the client maps the segment read only.
+// publish() copies the dirty rows into the segment, the client then reads
+// the rows whose generation changed straight into its mirror: no encoding
+// on either side, the socket carries a notification.
+// Rows with grapheme clusters and new scrollback lines don't fit fixed
+// cells; they go along with the notification, serialized, the rows tagged
+// with their generation.
+// A resize needs a new segment, the server sends it with a snapshot.
+class GridSegment {
+public:
+  static GridSegment *create(Grid *primary, Grid *alternate);
+  static GridSegment *map(int fd, Grid *primary, Grid *alternate);
+  ~GridSegment();
+  int get_fd();
+  void publish(Grid *primary, Grid *alternate, std::string &rows);
+  bool read(Grid *primary, Grid *alternate, const std::string &in,
+            size_t &pos);
+
+private:
+  GridSegment();
+  static size_t __grid_size(uint32_t rows, uint32_t cols);
+  void __publish_grid(Grid *grid, char *base, std::string &rows);
+  bool __read_grid(Grid *grid, char *base, std::vector<uint32_t> &seen);
+  static bool __read_serialized(Grid *grid, const std::vector<uint32_t> &seen,
+                                const std::string &in, size_t &pos);
+  int fd = -1;
+  char *memory = nullptr;
+  size_t size = 0;
+  size_t alternateOffset = 0;
+  // client: generations of the rows in the mirror
+  std::vector<uint32_t> seenPrimary;
+  std::vector<uint32_t> seenAlternate;
+  std::vector<Segment_Cell> copy; // scratch for a row being read
+  Grid_Row cells;
+};
+#endif // !GRID_SEGMENT_H
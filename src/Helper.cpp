@@ -1,4 +1,5 @@
 #include "Helper.h"
+#include <cstdint>
 #include <string>
 std::string get_bytes(const char *str, int size) {
   std::string res;
@@ -10,24 +11,184 @@ std::string get_bytes(const char *str, int size) {
   return res;
 }
 
-// PTY_Payload struct
-PTY_Payload::PTY_Payload(std::string payload, int payload_type)
-    : data(payload), type(payload_type) {}
+// number of bytes in the utf-8 sequence started by lead, 0 if it isn't a lead
+size_t utf8_sequence_length(unsigned char lead) {
+  if (lead < 0x80)
+    return 1;
+  if ((lead & 0xE0) == 0xC0)
+    return 2;
+  if ((lead & 0xF0) == 0xE0)
+    return 3;
+  if ((lead & 0xF8) == 0xF0)
+    return 4;
+  return 0;
+}
+
+// length of the prefix of str that doesn't end in a truncated utf-8 sequence
+size_t utf8_complete_length(const std::string &str) {
+  size_t len = str.length();
+  for (size_t back = 1; back <= 3 && back <= len; back++) {
+    unsigned char c = str[len - back];
+    if ((c & 0xC0) == 0x80)
+      continue; // continuation byte, keep looking for the lead byte
+    size_t need = utf8_sequence_length(c);
+    return need > back ? len - back : len;
+  }
+  return len;
+}
+
+// Escapes str as the body of a JSON string.
+// Invalid utf-8 bytes are replaced by U+FFFD since JSON can't carry them.
+std::string json_escape(const std::string &str) {
+  static const char *hex = "0123456789abcdef";
+  std::string res;
+  res.reserve(str.length());
+  size_t i = 0;
+  while (i < str.length()) {
+    unsigned char c = str[i];
+    if (c < 0x80) {
+      if (c == '"' || c == '\\') {
+        res += '\\';
+        res += c;
+      } else if (c == '\n') {
+        res += "\\n";
+      } else if (c == '\r') {
+        res += "\\r";
+      } else if (c == '\t') {
+        res += "\\t";
+      } else if (c < 0x20 || c == 0x7F) {
+        res += "\\u00";
+        res += hex[c >> 4];
+        res += hex[c & 0xF];
+      } else {
+        res += c;
+      }
+      i++;
+      continue;
+    }
+    size_t need = utf8_sequence_length(c);
+    bool valid = need > 1 && i + need <= str.length();
+    for (size_t k = 1; valid && k < need; k++)
+      valid = ((unsigned char)str[i + k] & 0xC0) == 0x80;
+    if (valid) {
+      res.append(str, i, need);
+      i += need;
+    } else {
+      res += "\xEF\xBF\xBD";
+      i++;
+    }
+  }
+  return res;
+}
+
+void utf8_append(std::string &res, uint32_t cp) {
+  if (cp < 0x80) {
+    res += (char)cp;
+  } else if (cp < 0x800) {
+    res += (char)(0xC0 | (cp >> 6));
+    res += (char)(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    res += (char)(0xE0 | (cp >> 12));
+    res += (char)(0x80 | ((cp >> 6) & 0x3F));
+    res += (char)(0x80 | (cp & 0x3F));
+  } else {
+    res += (char)(0xF0 | (cp >> 18));
+    res += (char)(0x80 | ((cp >> 12) & 0x3F));
+    res += (char)(0x80 | ((cp >> 6) & 0x3F));
+    res += (char)(0x80 | (cp & 0x3F));
+  }
+}
 
-// PTY_Payload_list struct
-PTY_Payload_List::PTY_Payload_List(PTY_Payload *node)
-    : curr(node), next(nullptr) {}
+// Value of the 4 hex digits at pos, -1 when they are cut off or not hex
+static int32_t __parse_hex4(const std::string &str, size_t pos) {
+  if (pos + 4 > str.length())
+    return -1;
+  int32_t value = 0;
+  for (size_t i = pos; i < pos + 4; i++) {
+    char c = str[i];
+    int32_t digit;
+    if (c >= '0' && c <= '9')
+      digit = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      digit = c - 'A' + 10;
+    else
+      return -1;
+    value = value << 4 | digit;
+  }
+  return value;
+}
+
+// Reverse of json_escape, str is the body of a JSON string without quotes
+std::string json_unescape(const std::string &str) {
+  std::string res;
+  res.reserve(str.length());
+  for (size_t i = 0; i < str.length(); i++) {
+    if (str[i] != '\\' || i + 1 == str.length()) {
+      res += str[i];
+      continue;
+    }
+    char c = str[++i];
+    switch (c) {
+    case 'n':
+      res += '\n';
+      break;
+    case 'r':
+      res += '\r';
+      break;
+    case 't':
+      res += '\t';
+      break;
+    case 'b':
+      res += '\b';
+      break;
+    case 'f':
+      res += '\f';
+      break;
+    case 'u': {
+      int32_t cp = __parse_hex4(str, i + 1);
+      i += 4;
+      if (cp >= 0xD800 && cp < 0xDC00) {
+        // surrogate pair, a high surrogate without a low one is invalid
+        int32_t low = -1;
+        if (i + 2 < str.length() && str[i + 1] == '\\' && str[i + 2] == 'u')
+          low = __parse_hex4(str, i + 3);
+        if (low >= 0xDC00 && low < 0xE000) {
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+          i += 6;
+        } else {
+          cp = -1;
+        }
+      } else if (cp >= 0xDC00 && cp < 0xE000) {
+        cp = -1; // a low surrogate on its own
+      }
+      utf8_append(res, cp < 0 ? 0xFFFD : cp);
+      break;
+    }
+    default:
+      res += c;
+    }
+  }
+  return res;
+}
+
+// LEB128 style variable length integers used by the checkpoint format
+void put_varint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out += (char)(0x80 | (value & 0x7F));
+    value >>= 7;
+  }
+  out += (char)value;
+}
 
-// erases the PTY_Payload_List
-PTY_Payload_List *erase_PTY_Payload_List(PTY_Payload_List *node) {
-  PTY_Payload_List *temp = node;
-  while (temp->next) {
-    PTY_Payload_List *prev = temp;
-    temp = temp->next;
-    delete prev->curr;
-    prev->curr = nullptr;
-    delete prev;
-    prev = nullptr;
+bool get_varint(const std::string &in, size_t &pos, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; pos < in.length() && shift < 64; shift += 7) {
+    unsigned char c = in[pos++];
+    value |= (uint64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80))
+      return true;
   }
-  return temp;
+  return false;
 }
@@ -1,26 +1,16 @@
 #ifndef HELPER_H
 #define HELPER_H
+#include <cstdint>
 #include <string>
 
 // Helper functions
 std::string get_bytes(const char *str, int size);
+size_t utf8_sequence_length(unsigned char lead);
+size_t utf8_complete_length(const std::string &str);
+std::string json_escape(const std::string &str);
+std::string json_unescape(const std::string &str);
+void utf8_append(std::string &out, uint32_t codepoint);
+void put_varint(std::string &out, uint64_t value);
+bool get_varint(const std::string &in, size_t &pos, uint64_t &value);
 
-// Helper structures
-
-#define PAYLOAD_INS 0 // instruction payload
-#define PAYLOAD_STR 1 // string payload
-
-typedef struct PTY_Payload {
-  std::string data;
-  int type;
-  PTY_Payload(std::string paylaod, int payload_type);
-} PTY_Payload;
-
-typedef struct PTY_Payload_List {
-  PTY_Payload *curr;
-  PTY_Payload_List *next;
-  PTY_Payload_List(PTY_Payload *node);
-} PTY_Payload_List;
-
-PTY_Payload_List *erase_PTY_Payload_List(PTY_Payload_List *node);
 #endif
@@ -0,0 +1,12 @@
+#ifndef IMGUI_CONFIG_H
+#define IMGUI_CONFIG_H
+// ImGui build options, included by imgui.h through IMGUI_USER_CONFIG
+
+// The current context is per thread. The render thread sets it for every
+// window, on the font worker it stays null: ImGui::MemAlloc() only reports
+// to the current context's debug allocation hook, so the worker's atlas
+// allocations never touch a context the render thread is using.
+struct ImGuiContext;
+extern thread_local ImGuiContext *ImGuiThreadContext; // in Terminal.cpp
+#define GImGui ImGuiThreadContext
+#endif // !IMGUI_CONFIG_H
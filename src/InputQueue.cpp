@@ -0,0 +1,24 @@
+#include "InputQueue.h"
+#include <atomic>
+
+InputQueue::InputQueue() {}
+
+// Producer side, false when the ring is full
+bool InputQueue::push(const Input_Event &event) {
+  size_t next = tail.load(std::memory_order_relaxed);
+  if (next - head.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+    return false;
+  events[next & (INPUT_QUEUE_SIZE - 1)] = event;
+  tail.store(next + 1, std::memory_order_release);
+  return true;
+}
+
+// Consumer side, false when the ring is empty
+bool InputQueue::pop(Input_Event &event) {
+  size_t first = head.load(std::memory_order_relaxed);
+  if (first == tail.load(std::memory_order_acquire))
+    return false;
+  event = events[first & (INPUT_QUEUE_SIZE - 1)];
+  head.store(first + 1, std::memory_order_release);
+  return true;
+}
@@ -0,0 +1,43 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define INPUT_QUEUE_SIZE 1024 // events in flight, a power of two
+
+struct Terminal_Window;
+
+enum Input_Kind : uint8_t {
+  INPUT_MOUSE_POS,    // x, y; -FLT_MAX once the cursor left the window
+  INPUT_MOUSE_BUTTON, // code: the button
+  INPUT_SCROLL,       // x, y
+  INPUT_FOCUS,        // down: focused
+  INPUT_COMMAND,      // code: a command bound to a key
+};
+
+typedef struct Input_Event {
+  Input_Kind kind;
+  Terminal_Window *window;
+  int code = 0;
+  bool down = false;
+  float x = 0.0f;
+  float y = 0.0f;
+} Input_Event;
+
+// Single producer, single consumer ring of input events: the GLFW event
+// thread pushes, the render thread pops before each frame. Neither side
+// waits for the other, a full ring drops the event.
+class InputQueue {
+public:
+  InputQueue();
+  bool push(const Input_Event &event);
+  bool pop(Input_Event &event);
+
+private:
+  Input_Event events[INPUT_QUEUE_SIZE];
+  // apart so the two threads don't share a cache line
+  alignas(64) std::atomic<size_t> head = 0; // next to pop
+  alignas(64) std::atomic<size_t> tail = 0; // next to push
+};
+#endif // !INPUT_QUEUE_H
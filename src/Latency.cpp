@@ -0,0 +1,173 @@
+#include "Latency.h"
+#include "Logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+LatencyTracker *LatencyTracker::instance = nullptr;
+
+static double __elapsed_ms(std::chrono::steady_clock::time_point from,
+                           std::chrono::steady_clock::time_point to) {
+  return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+void Latency_Histogram::add(double ms) {
+  size_t bucket = std::max(0.0, ms) / LATENCY_BUCKET_MS;
+  buckets[std::min<size_t>(bucket, LATENCY_BUCKETS - 1)]++;
+  count++;
+  sum += ms;
+  max = std::max(max, ms);
+}
+
+double Latency_Histogram::mean() const { return count ? sum / count : 0; }
+
+// Upper edge of the bucket holding the p-th fraction of the samples
+double Latency_Histogram::percentile(double p) const {
+  uint64_t target = p * count, seen = 0;
+  for (size_t i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    seen += buckets[i];
+    if (seen > target)
+      return (i + 1) * LATENCY_BUCKET_MS;
+  }
+  return max;
+}
+
+LatencyTracker::LatencyTracker() {}
+
+LatencyTracker *LatencyTracker::get_instance() {
+  if (instance == nullptr)
+    instance = new LatencyTracker();
+  return instance;
+}
+
+const char *LatencyTracker::get_stage_name(Latency_Stage stage) {
+  switch (stage) {
+  case LATENCY_KEY_TO_WRITE:
+    return "key_to_write";
+  case LATENCY_WRITE_TO_ECHO:
+    return "write_to_echo";
+  case LATENCY_ECHO_TO_SWAP:
+    return "echo_to_swap";
+  case LATENCY_TOTAL:
+    return "total";
+  default:
+    return "";
+  }
+}
+
+void LatencyTracker::key_pressed(uint32_t session) {
+  std::lock_guard<std::mutex> lock(mutex);
+  // keys that never got an echo, e.g. with echo off, don't pile up
+  if (pending.size() == LATENCY_PENDING)
+    pending.pop_front();
+  Latency_Sample sample;
+  sample.key = std::chrono::steady_clock::now();
+  sample.session = session;
+  pending.push_back(sample);
+}
+
+void LatencyTracker::input_written(uint32_t session) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  for (Latency_Sample &sample : pending) {
+    if (sample.session == session && !sample.written) {
+      sample.write = now;
+      sample.written = true;
+    }
+  }
+}
+
+// Returns whether the read is the echo of a key
+bool LatencyTracker::output_read(uint32_t session) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  bool echo = false;
+  for (Latency_Sample &sample : pending) {
+    if (sample.session == session && sample.written && !sample.echoed) {
+      sample.echo = now;
+      sample.echoed = echo = true;
+    }
+  }
+  return echo;
+}
+
+// Called with the active session's mutex held before its snapshot is taken,
+// output read before this point is part of the frame
+void LatencyTracker::frame_started() {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  frameStart = now;
+}
+
+void LatencyTracker::frame_presented() {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  // each sample completes on its own, a key that never echoes doesn't hold
+  // back the ones after it and is dropped once stale, not recorded
+  for (auto it = pending.begin(); it != pending.end();) {
+    Latency_Sample &sample = *it;
+    if (__elapsed_ms(sample.key, now) > LATENCY_STALE) {
+      it = pending.erase(it);
+      continue;
+    }
+    if (!sample.echoed || sample.echo > frameStart) {
+      it++;
+      continue;
+    }
+    histograms[LATENCY_KEY_TO_WRITE].add(
+        __elapsed_ms(sample.key, sample.write));
+    histograms[LATENCY_WRITE_TO_ECHO].add(
+        __elapsed_ms(sample.write, sample.echo));
+    histograms[LATENCY_ECHO_TO_SWAP].add(__elapsed_ms(sample.echo, now));
+    histograms[LATENCY_TOTAL].add(__elapsed_ms(sample.key, now));
+    it = pending.erase(it);
+  }
+}
+
+Latency_Histogram LatencyTracker::get_histogram(Latency_Stage stage) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return histograms[stage];
+}
+
+/*
+ * {"bucket_ms": 0.5, "stages": {"<stage>": {"count": n, "mean_ms": ..,
+ *  "p50_ms": .., "p99_ms": .., "max_ms": .., "histogram": [..]}, ..}}
+ */
+bool LatencyTracker::export_json(const std::string &path) {
+  std::ofstream file(path, std::ios::out | std::ios::trunc);
+  if (!file.is_open()) {
+    pretty_log("LATENCY", "Can't open " + path, ERR);
+    return false;
+  }
+  char number[32];
+  auto put = [&](const char *key, double value) {
+    snprintf(number, sizeof(number), "%.3f", value);
+    file << '"' << key << "\": " << number;
+  };
+  file << "{";
+  put("bucket_ms", LATENCY_BUCKET_MS);
+  file << ", \"stages\": {";
+  for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+    Latency_Histogram histogram = get_histogram((Latency_Stage)stage);
+    file << (stage ? ", " : "") << '"'
+         << get_stage_name((Latency_Stage)stage) << "\": {\"count\": "
+         << histogram.count << ", ";
+    put("mean_ms", histogram.mean());
+    file << ", ";
+    put("p50_ms", histogram.percentile(0.5));
+    file << ", ";
+    put("p99_ms", histogram.percentile(0.99));
+    file << ", ";
+    put("max_ms", histogram.max);
+    file << ", \"histogram\": [";
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+      file << (i ? ", " : "") << histogram.buckets[i];
+    file << "]}";
+  }
+  file << "}}\n";
+  pretty_log("LATENCY", "Latency histogram written to " + path);
+  return true;
+}
@@ -0,0 +1,70 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#define LATENCY_BUCKETS 64   // the last bucket collects everything above
+#define LATENCY_BUCKET_MS 0.5
+#define LATENCY_PENDING 64 // keys waiting for their write, echo or frame
+#define LATENCY_STALE 1000 // ms after which a key's sample is dropped
+
+enum Latency_Stage : uint8_t {
+  LATENCY_KEY_TO_WRITE,  // key callback to the PTY write
+  LATENCY_WRITE_TO_ECHO, // PTY write to the first PTY read after it
+  LATENCY_ECHO_TO_SWAP,  // that read to the buffer swap of the frame showing it
+  LATENCY_TOTAL,         // key callback to buffer swap
+  LATENCY_STAGES,
+};
+
+typedef struct Latency_Histogram {
+  uint64_t count = 0;
+  double sum = 0; // ms
+  double max = 0;
+  std::array<uint32_t, LATENCY_BUCKETS> buckets{};
+
+  void add(double ms);
+  double mean() const;
+  double percentile(double p) const;
+} Latency_Histogram;
+
+// Input-to-photon latency of key presses.
+// Every key sent to the PTY is followed through the writer thread, the reader
+// thread and the render loop. A key counts as echoed by the first read of its
+// session after its write, and as shown by the first frame that started
+// rendering after that read. Output of other sessions, e.g. a build in a
+// background tab, echoes nothing.
+class LatencyTracker {
+public:
+  static LatencyTracker *get_instance();
+  void key_pressed(uint32_t session);
+  void input_written(uint32_t session);
+  bool output_read(uint32_t session);
+  void frame_started();
+  void frame_presented();
+  Latency_Histogram get_histogram(Latency_Stage stage);
+  bool export_json(const std::string &path);
+  static const char *get_stage_name(Latency_Stage stage);
+
+private:
+  LatencyTracker();
+  typedef std::chrono::steady_clock::time_point Time_Point;
+  typedef struct Latency_Sample {
+    Time_Point key;
+    Time_Point write;
+    Time_Point echo;
+    uint32_t session = 0; // Session::get_id() of the key's pane
+    bool written = false;
+    bool echoed = false;
+  } Latency_Sample;
+
+  static LatencyTracker *instance;
+  std::deque<Latency_Sample> pending; // oldest first
+  Time_Point frameStart;
+  std::array<Latency_Histogram, LATENCY_STAGES> histograms;
+  std::mutex mutex;
+};
+#endif // !LATENCY_H
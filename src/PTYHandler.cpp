@@ -1,206 +1,197 @@
 #include "PTYHandler.h"
-#include "Helper.h"
+#include "Config.h"
 #include "Logger.h"
+#include "ShellPool.h"
+#include <cerrno>
+#include <chrono>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
-#include <pty.h>
-#include <regex>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <pwd.h>
+#include <spawn.h>
 #include <string>
-#include <thread>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
-PTY_Payload_List *__filter_escape_sequence(const char *arr);
+extern char **environ;
 
-PTYHandler *PTYHandler::instance = nullptr;
-static bool input_signal = true;
-
-PTYHandler *PTYHandler::get_instance() {
-  if (instance == nullptr)
-    instance = new PTYHandler();
-  return instance;
+// Takes an idle shell from the pool, or spawns one when the pool is empty.
+// A pooled shell's prompt is already in pooledOutput.
+PTYHandler::PTYHandler() {
+  pretty_log("PTY", "PTYHandler constructor called.");
+  spawnTime = std::chrono::steady_clock::now();
+  Pooled_Shell shell;
+  if (ShellPool::get_instance()->claim(shell)) {
+    master_fd = shell.masterFd;
+    shellPid = shell.pid;
+    pooledOutput = std::move(shell.output);
+    pretty_log("PTY", "Using pooled shell, pid " + std::to_string(shellPid));
+  } else if (!spawn_shell(master_fd, shellPid)) {
+    throw "Can't start the shell";
+  }
 }
 
+// Hangs up the shell, the I/O thread reaps it
 PTYHandler::~PTYHandler() {
   close(master_fd);
-  close(slave_fd);
-  exit();
-  pretty_log("PTY", "PTYHandler send exit signal.");
-  writer.join();
-  reader.join();
-}
-PTYHandler::PTYHandler() {
-  pretty_log("PTY", "PTYHandler constructor called.");
-  if (openpty(&master_fd, &slave_fd, slave_name, nullptr, nullptr) == -1) {
-    throw "Can't open PTY";
-  }
-  pretty_log("PTY", std::string("Created PTY name ") + slave_name);
-  init();
+  kill(shellPid, SIGHUP);
+  pretty_log("PTY", "Hung up shell " + std::to_string(shellPid));
 }
-void PTYHandler::set_output_callback(
-    void (*callback)(PTY_Payload_List *payloadList)) {
-  output_callback = callback;
+
+void PTYHandler::set_recorder(Recorder *recorder) {
+  this->recorder = recorder;
 }
-void PTYHandler::init() {
-  pretty_log("PTY",
-             std::string("Fork started for master and slave side of pty."));
-  pid_t pid = fork();
-  if (pid == -1) {
-    pretty_log("PTY",
-               std::string("Fork failed for master and slave side of pty."),
-               ERR);
-    throw "Can't Fork for Shell to start";
-  }
-  if (pid == 0) {
-    // Slave thread running the shell
-    __init_slave();
-  } else {
-    // master thread running IO
-    __init_master();
+// The kernel sends SIGWINCH to the foreground job when the size changes.
+// width and height are the text area in pixels.
+void PTYHandler::set_window_size(uint32_t rows, uint32_t cols, uint32_t width,
+                                 uint32_t height) {
+  struct winsize size = {(unsigned short)rows, (unsigned short)cols,
+                         (unsigned short)width, (unsigned short)height};
+  if (ioctl(master_fd, TIOCSWINSZ, &size) == -1) {
+    pretty_log("PTY", "Setting the PTY window size failed.", ERR);
+    return;
   }
+  if (recorder != nullptr)
+    recorder->resize(cols, rows);
+  pretty_log("PTY", "PTY window size set to " + std::to_string(cols) + "x" +
+                        std::to_string(rows));
 }
-void PTYHandler::send(std::string input) {
-  inputBuffer = input;
-  input_signal = false;
-  pretty_log("PTY", std::string("PTY recieved input data stream ") + '<' +
-                        input + '>');
-}
-void PTYHandler::__init_master() {
-  pretty_log("PTY", "Master PTY init started.");
-  close(slave_fd);
-
-  writer = std::thread(&PTYHandler::__writer_thread, this);
 
-  reader = std::thread(&PTYHandler::__reader_thread, this);
+// $SHELL, else the user's login shell from the password database
+static std::string __user_shell() {
+  const char *shell = getenv("SHELL");
+  if (shell != nullptr && *shell)
+    return shell;
+  struct passwd *user = getpwuid(getuid());
+  if (user != nullptr && user->pw_shell != nullptr && *user->pw_shell)
+    return user->pw_shell;
+  return "/bin/sh";
 }
 
-void PTYHandler::__init_slave() {
-  pretty_log("PTY", std::string("Slave PTY init started."));
-  if (setsid() == -1) {
-    pretty_log("PTY", std::string("Slave PTY SID set failed."), ERR);
-    throw "Can't set sid for shell";
+// Opens a PTY of the default size and starts the user's shell on it, only the
+// master is ever open in this process.
+// posix_spawn uses vfork semantics, the large GUI process isn't copied.
+// The child starts a new session and opening the slave by name makes it the
+// controlling terminal, as TIOCSCTTY would.
+// The master is opened close-on-exec: the pool and the render thread spawn
+// shells concurrently, a shell must not keep another one's PTY open.
+bool PTYHandler::spawn_shell(int &masterFd, pid_t &pid) {
+  char slaveName[256];
+  struct winsize size = {PTY_DEFAULT_ROWS, PTY_DEFAULT_COLS, 0, 0};
+  masterFd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+  if (masterFd == -1 || grantpt(masterFd) == -1 || unlockpt(masterFd) == -1 ||
+      ptsname_r(masterFd, slaveName, sizeof(slaveName)) != 0 ||
+      ioctl(masterFd, TIOCSWINSZ, &size) == -1) {
+    pretty_log("PTY", "Can't open PTY", ERR);
+    if (masterFd != -1)
+      close(masterFd);
+    return false;
   }
-  // Set the slave PTY as the controlling terminal
-  if (ioctl(slave_fd, TIOCSCTTY, nullptr) == -1) {
-    pretty_log("PTY", std::string("Slave PTY IOCTL transfer failed."), ERR);
-    throw "Can't transfer IO control to shell";
+  pretty_log("PTY", std::string("Created PTY name ") + slaveName);
+
+  std::string shell = __user_shell();
+  // a leading '-' in argv[0] asks for a login shell
+  std::string name = shell.substr(shell.rfind('/') + 1);
+  if (Config::get_instance()->loginShell)
+    name = "-" + name;
+  char *argv[] = {name.data(), nullptr};
+
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attributes;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, slaveName, O_RDWR,
+                                   0);
+  posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID);
+  int error =
+      posix_spawn(&pid, shell.c_str(), &actions, &attributes, argv, environ);
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    pretty_log("PTY", "Spawning " + shell + " failed: " + strerror(error),
+               ERR);
+    close(masterFd);
+    return false;
   }
-  close(master_fd);
-  // Redirect standard input, output, and error to the slave
-  pretty_log("PTY", std::string("Bash started on slave side."));
-  dup2(slave_fd, STDIN_FILENO);
-  dup2(slave_fd, STDOUT_FILENO);
-  dup2(slave_fd, STDERR_FILENO);
-  close(slave_fd);
-  execlp("stdbuf", "stdbuf", "-o0", "bash", nullptr);
-  pretty_log("PTY", std::string("Bash startup failed."), ERR);
+  pretty_log("PTY", "Started " + shell + " as " + name + ", pid " +
+                        std::to_string(pid));
+  return true;
 }
 
-void PTYHandler::exit() {
-  pretty_log("PTY", "Exit called.", ERR);
-  running = false;
+// Queues input for the I/O thread, the caller never blocks on the shell
+void PTYHandler::send(const std::string &input) {
+  std::lock_guard<std::mutex> lock(inputMutex);
+  pendingInput += input;
 }
 
-void PTYHandler::__writer_thread() {
-  pretty_log("PTY", "Master PTY fork for writer started.");
-  // Writer thread
-  while (running) {
-    if (!input_signal) {
-      pretty_log("PTY", "Writer got input.");
-      size_t bytes_written =
-          write(master_fd, inputBuffer.c_str(), inputBuffer.length());
-      if (bytes_written == inputBuffer.length()) {
-        pretty_log("PTY", "Writer input passed to shell.");
-      } else if (bytes_written <= 0) {
-        pretty_log("PTY", "Writer input passing to shell fragmented.", ERR);
-      } else {
-        pretty_log("PTY", "Writer input passing to shell failed.", ERR);
-      }
-      input_signal = true;
-    }
-  }
+bool PTYHandler::has_input() {
+  std::lock_guard<std::mutex> lock(inputMutex);
+  return !pendingInput.empty();
 }
-void PTYHandler::__reader_thread() {
-  // Reader Thread
-  pretty_log("PTY", "Master PTY fork for reader started.");
-  char buffer[256];
-  ssize_t bytes_read;
-  bytes_read = read(master_fd, buffer, sizeof(buffer) - 1);
-  while (running) {
-    if (output_callback != nullptr && bytes_read > 0) {
-      buffer[bytes_read] = '\0';
-      auto res = __filter_escape_sequence(buffer);
-      output_callback(res);
-      pretty_log("PTY", "Reader tranfered data to callback.");
+
+// Writes as much of the queued input as the PTY takes, keys typed while the
+// shell wasn't reading go out in one write. False when the PTY is gone.
+bool PTYHandler::write_input() {
+  std::lock_guard<std::mutex> lock(inputMutex);
+  while (!pendingInput.empty()) {
+    ssize_t bytes_written =
+        write(master_fd, pendingInput.data(), pendingInput.length());
+    if (bytes_written < 0 && errno == EINTR)
+      continue;
+    if (bytes_written < 0 && errno == EAGAIN)
+      return true; // the rest once the PTY has room
+    if (bytes_written <= 0) {
+      pretty_log("PTY", "Writer input passing to shell failed.", ERR);
+      pendingInput.clear();
+      return false;
     }
-    bytes_read = read(master_fd, buffer, sizeof(buffer) - 1);
+    pendingInput.erase(0, bytes_written);
   }
-}
-std::string escape_regex_special_chars(const std::string &str) {
-  return std::regex_replace(str, std::regex("([\\^$.|?*+()\\[\\]{}\\\\])"),
-                            "\\$1");
+  return true;
 }
 
-PTY_Payload_List *__filter_escape_sequence(const char *arr) {
-  std::string input(arr);
-  std::regex ansi_escape("\\x1b\\[[\\?\\d;]*[a-zA-Z]");
-
-  // Iterator for matching all occurrences
-  auto begin = std::sregex_iterator(input.begin(), input.end(), ansi_escape);
-  auto end = std::sregex_iterator();
-
-  PTY_Payload_List *head = nullptr;
-  PTY_Payload_List *tail = nullptr;
-
-  size_t last_pos = 0;
-
-  // Iterate through all matches
-  for (auto it = begin; it != end; ++it) {
-    std::smatch match = *it;
-    size_t start_pos = match.position();
-
-    // Add non-control string before the match
-    if (start_pos > last_pos) {
-      std::string text = input.substr(last_pos, start_pos - last_pos);
-      if (!text.empty()) {
-        PTY_Payload *payload = new PTY_Payload(text, PAYLOAD_STR);
-        PTY_Payload_List *node = new PTY_Payload_List(payload);
-        if (!head) {
-          head = tail = node;
-        } else {
-          tail->next = node;
-          tail = node;
-        }
-      }
-    }
+// Bytes read, 0 once the shell and everything else on the PTY exited (EIO),
+// -1 when there is nothing to read
+ssize_t PTYHandler::read_output(char *buffer, size_t size) {
+  ssize_t bytes_read = read(master_fd, buffer, size);
+  if (bytes_read > 0) {
+    __output_arrived(buffer, bytes_read);
+    return bytes_read;
+  }
+  if (bytes_read < 0 && (errno == EINTR || errno == EAGAIN))
+    return -1;
+  return 0;
+}
 
-    // Add the control sequence
-    std::string control = match.str();
-    PTY_Payload *payload = new PTY_Payload(control, PAYLOAD_INS);
-    PTY_Payload_List *node = new PTY_Payload_List(payload);
-    if (!head) {
-      head = tail = node;
-    } else {
-      tail->next = node;
-      tail = node;
-    }
+// What a pooled shell wrote while idle, its prompt; handed out once
+std::string PTYHandler::take_pooled_output() {
+  std::string output;
+  output.swap(pooledOutput);
+  if (!output.empty())
+    __output_arrived(output.data(), output.size());
+  return output;
+}
 
-    last_pos = start_pos + match.length();
-  }
+int PTYHandler::get_fd() { return master_fd; }
 
-  // Add any remaining text after the last match
-  if (last_pos < input.length()) {
-    std::string text = input.substr(last_pos);
-    if (!text.empty()) {
-      PTY_Payload *payload = new PTY_Payload(text, PAYLOAD_STR);
-      PTY_Payload_List *node = new PTY_Payload_List(payload);
-      if (!head) {
-        head = tail = node;
-      } else {
-        tail->next = node;
-        tail = node;
-      }
-    }
+void PTYHandler::__output_arrived(const char *data, size_t size) {
+  if (firstOutputMs < 0) {
+    firstOutputMs = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - spawnTime)
+                        .count();
+    pretty_log("PTY", "Shell first output after " +
+                          std::to_string(firstOutputMs) + " ms.");
   }
-
-  return head;
+  if (recorder != nullptr)
+    recorder->record(data, size);
 }
+
+// Time from the session's start to the first byte the shell wrote (its
+// prompt), -1 while there was none
+double PTYHandler::get_first_output_ms() { return firstOutputMs; }
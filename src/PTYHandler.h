@@ -1,33 +1,43 @@
 #ifndef PTYHANDLER_H
 #define PTYHANDLER_H
-#include "Helper.h"
+#include "Recorder.h"
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <mutex>
 #include <string>
-#include <thread>
+#include <sys/types.h>
 
+#define PTY_DEFAULT_COLS 80 // size a shell is spawned at, before any window
+#define PTY_DEFAULT_ROWS 24
+
+// The PTY of one session and the shell on it. The master is non-blocking,
+// SessionManager's I/O thread does all the reads and writes.
 class PTYHandler {
 public:
-  static PTYHandler *get_instance();
+  PTYHandler();
   ~PTYHandler();
-  void init();
-  void send(std::string input);
-  void set_output_callback(void (*callback)(PTY_Payload_List *payloadList));
-  void exit();
+  void send(const std::string &input);
+  bool has_input();
+  bool write_input();
+  ssize_t read_output(char *buffer, size_t size);
+  std::string take_pooled_output();
+  int get_fd();
+  void set_recorder(Recorder *recorder);
+  void set_window_size(uint32_t rows, uint32_t cols, uint32_t width,
+                       uint32_t height);
+  double get_first_output_ms();
+  static bool spawn_shell(int &masterFd, pid_t &pid);
 
 private:
-  PTYHandler();
-  void __init_slave();
-  void __init_master();
-  static PTYHandler *instance;
-  int master_fd;
-  int slave_fd;
-  char slave_name[256];
-  std::string inputBuffer;
-  void (*output_callback)(PTY_Payload_List *payloadList) = nullptr;
-  bool running = true;
-  void __reader_thread();
-  void __writer_thread();
-  std::thread reader;
-  std::thread writer;
+  void __output_arrived(const char *data, size_t size);
+  int master_fd = -1;
+  pid_t shellPid = -1;
+  std::string pooledOutput; // written by a pooled shell while it was idle
+  std::chrono::steady_clock::time_point spawnTime;
+  std::atomic<double> firstOutputMs = -1;
+  std::string pendingInput; // queued by send(), drained by write_input()
+  std::mutex inputMutex;
+  Recorder *recorder = nullptr;
 };
 #endif //! PTYHANDLER_H
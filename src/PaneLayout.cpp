@@ -0,0 +1,128 @@
+#include "PaneLayout.h"
+#include "Session.h"
+#include <vector>
+
+PaneLayout::PaneLayout(Session *session) : root(new Pane), focused(root) {
+  root->session = session;
+}
+
+PaneLayout::~PaneLayout() { __free(root); }
+
+void PaneLayout::__free(Pane *pane) {
+  if (pane == nullptr)
+    return;
+  __free(pane->children[0]);
+  __free(pane->children[1]);
+  delete pane;
+}
+
+Session *PaneLayout::get_focused() {
+  return focused != nullptr ? focused->session : nullptr;
+}
+
+void PaneLayout::set_focused(Session *session) {
+  Pane *pane = __find(root, session);
+  if (pane != nullptr)
+    focused = pane;
+}
+
+// Moves the focus step leaves on, in reading order, wrapping around
+void PaneLayout::focus_next(int step) {
+  std::vector<Session *> sessions;
+  get_sessions(sessions);
+  size_t index = 0;
+  while (index < sessions.size() && sessions[index] != get_focused())
+    index++;
+  size_t count = sessions.size();
+  set_focused(sessions[(index + count + step % (int)count) % count]);
+}
+
+// The focused pane becomes a split of itself and a pane showing session,
+// which takes the focus
+void PaneLayout::split(Split_Direction direction, Session *session) {
+  Pane *pane = focused;
+  for (Pane *&child : pane->children) {
+    child = new Pane;
+    child->parent = pane;
+  }
+  pane->children[0]->session = pane->session;
+  pane->children[1]->session = session;
+  pane->session = nullptr;
+  pane->split = direction;
+  focused = pane->children[1];
+}
+
+// Drops the session's pane, its sibling takes the space of the split.
+// Returns false once no pane is left.
+bool PaneLayout::remove(Session *session) {
+  Pane *pane = __find(root, session);
+  if (pane == nullptr)
+    return root != nullptr;
+  Pane *parent = pane->parent;
+  if (parent == nullptr) {
+    delete root;
+    root = focused = nullptr;
+    return false;
+  }
+  Pane *sibling = parent->children[parent->children[0] == pane ? 1 : 0];
+  // the sibling moves up into the parent's place
+  sibling->parent = parent->parent;
+  if (parent->parent == nullptr)
+    root = sibling;
+  else
+    parent->parent->children[parent->parent->children[0] == parent ? 0 : 1] =
+        sibling;
+  delete pane;
+  delete parent;
+  if (focused == pane || focused == parent) {
+    focused = sibling;
+    while (focused->split != SPLIT_NONE)
+      focused = focused->children[0];
+  }
+  return true;
+}
+
+// The sessions of the leaves in reading order
+void PaneLayout::get_sessions(std::vector<Session *> &out) {
+  std::vector<Pane_View> views;
+  get_views({0, 0, 0, 0}, 0, views);
+  for (const Pane_View &view : views)
+    out.push_back(view.session);
+}
+
+// Viewport of every leaf within area, splits leave gap pixels between their
+// children
+void PaneLayout::get_views(const Pane_Rect &area, float gap,
+                           std::vector<Pane_View> &out) {
+  if (root != nullptr)
+    __collect(root, area, gap, out);
+}
+
+void PaneLayout::__collect(Pane *pane, const Pane_Rect &rect, float gap,
+                           std::vector<Pane_View> &out) {
+  if (pane->split == SPLIT_NONE) {
+    out.push_back({pane->session, rect});
+    return;
+  }
+  Pane_Rect first = rect, second = rect;
+  if (pane->split == SPLIT_HORIZONTAL) {
+    first.width = (rect.width - gap) * pane->ratio;
+    second.x = rect.x + first.width + gap;
+    second.width = rect.width - first.width - gap;
+  } else {
+    first.height = (rect.height - gap) * pane->ratio;
+    second.y = rect.y + first.height + gap;
+    second.height = rect.height - first.height - gap;
+  }
+  __collect(pane->children[0], first, gap, out);
+  __collect(pane->children[1], second, gap, out);
+}
+
+Pane *PaneLayout::__find(Pane *pane, Session *session) {
+  if (pane == nullptr)
+    return nullptr;
+  if (pane->split == SPLIT_NONE)
+    return pane->session == session ? pane : nullptr;
+  Pane *found = __find(pane->children[0], session);
+  return found != nullptr ? found : __find(pane->children[1], session);
+}
@@ -0,0 +1,53 @@
+#ifndef PANE_LAYOUT_H
+#define PANE_LAYOUT_H
+#include "Session.h"
+#include <cstdint>
+#include <vector>
+
+enum Split_Direction : uint8_t {
+  SPLIT_NONE,       // a leaf showing a session
+  SPLIT_HORIZONTAL, // children side by side
+  SPLIT_VERTICAL,   // children stacked
+};
+
+typedef struct Pane_Rect {
+  float x, y, width, height;
+} Pane_Rect;
+
+typedef struct Pane_View {
+  Session *session;
+  Pane_Rect rect;
+} Pane_View;
+
+typedef struct Pane {
+  Split_Direction split = SPLIT_NONE;
+  Session *session = nullptr; // leaves only
+  float ratio = 0.5f;         // share of the first child
+  Pane *children[2] = {nullptr, nullptr};
+  Pane *parent = nullptr;
+} Pane;
+
+// The panes of one tab: a tree of splits with a session in every leaf. The
+// sessions are owned by SessionManager, the layout only points at them.
+class PaneLayout {
+public:
+  PaneLayout(Session *session);
+  ~PaneLayout();
+  Session *get_focused();
+  void set_focused(Session *session);
+  void focus_next(int step);
+  void split(Split_Direction direction, Session *session);
+  bool remove(Session *session);
+  void get_sessions(std::vector<Session *> &out);
+  void get_views(const Pane_Rect &area, float gap,
+                 std::vector<Pane_View> &out);
+
+private:
+  Pane *__find(Pane *pane, Session *session);
+  void __collect(Pane *pane, const Pane_Rect &rect, float gap,
+                 std::vector<Pane_View> &out);
+  void __free(Pane *pane);
+  Pane *root;
+  Pane *focused;
+};
+#endif // !PANE_LAYOUT_H
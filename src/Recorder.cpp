@@ -0,0 +1,99 @@
+#include "Recorder.h"
+#include "Helper.h"
+#include "Logger.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+
+Recorder::Recorder(std::string path, uint32_t width, uint32_t height)
+    : file(path, std::ios::out | std::ios::trunc) {
+  if (!file.is_open()) {
+    pretty_log("REC", std::string("Can't open recording file ") + path, ERR);
+    throw "Can't open recording file";
+  }
+  const char *shell = getenv("SHELL");
+  file << "{\"version\": 2, \"width\": " << width << ", \"height\": " << height
+       << ", \"timestamp\": " << time(nullptr) << ", \"env\": {\"SHELL\": \""
+       << json_escape(shell ? shell : "") << "\", \"TERM\": \"xterm\"}}\n";
+  file.flush();
+  start = std::chrono::steady_clock::now();
+  writer = std::thread(&Recorder::__writer_thread, this);
+  pretty_log("REC", std::string("Recording to ") + path);
+}
+
+Recorder::~Recorder() { close(); }
+
+double Recorder::__elapsed() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void Recorder::__push_event(char type, std::string data) {
+  double time = __elapsed();
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queue.push_back({time, type, std::move(data)});
+  }
+  queueSignal.notify_one();
+}
+
+void Recorder::record(const char *data, size_t size) {
+  __push_event('o', std::string(data, size));
+}
+
+// asciicast resize event, "<width>x<height>"
+void Recorder::resize(uint32_t width, uint32_t height) {
+  __push_event('r', std::to_string(width) + "x" + std::to_string(height));
+}
+
+void Recorder::close() {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  queueSignal.notify_one();
+  writer.join();
+  file.close();
+  pretty_log("REC", "Recording closed.");
+}
+
+void Recorder::__writer_thread() {
+  std::vector<Recorder_Event> batch;
+  std::unique_lock<std::mutex> lock(queueMutex);
+  while (running || !queue.empty()) {
+    queueSignal.wait(lock, [this] { return !running || !queue.empty(); });
+    batch.swap(queue);
+    lock.unlock();
+    for (Recorder_Event &event : batch)
+      __write_event(event);
+    batch.clear();
+    // flush once per batch, a crash loses at most the events in flight
+    file.flush();
+    lock.lock();
+  }
+}
+
+void Recorder::__write_event(Recorder_Event &event) {
+  char time[32];
+  snprintf(time, sizeof(time), "%.6f", event.time);
+  if (event.type != 'o') {
+    file << '[' << time << ", \"" << event.type << "\", \""
+         << json_escape(event.data) << "\"]\n";
+    return;
+  }
+  // a read can split a utf-8 sequence, carry the tail into the next event
+  std::string data = pending + event.data;
+  size_t complete = utf8_complete_length(data);
+  pending = data.substr(complete);
+  if (complete == 0)
+    return;
+  data.resize(complete);
+  file << '[' << time << ", \"o\", \"" << json_escape(data) << "\"]\n";
+}
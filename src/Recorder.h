@@ -0,0 +1,43 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records the raw PTY output stream to an asciicast v2 file.
+// record() only queues the bytes, the disk IO happens on a writer thread so
+// the PTY reader never waits on the file.
+class Recorder {
+public:
+  Recorder(std::string path, uint32_t width, uint32_t height);
+  ~Recorder();
+  void record(const char *data, size_t size);
+  void resize(uint32_t width, uint32_t height);
+  void close();
+
+private:
+  typedef struct Recorder_Event {
+    double time; // seconds since the recording started
+    char type;   // 'o' output, 'r' resize
+    std::string data;
+  } Recorder_Event;
+
+  double __elapsed();
+  void __push_event(char type, std::string data);
+  void __writer_thread();
+  void __write_event(Recorder_Event &event);
+  std::ofstream file;
+  std::chrono::steady_clock::time_point start;
+  std::vector<Recorder_Event> queue;
+  std::mutex queueMutex;
+  std::condition_variable queueSignal;
+  std::string pending; // truncated utf-8 sequence left by the last event
+  bool running = true;
+  std::thread writer;
+};
+#endif // !RECORDER_H
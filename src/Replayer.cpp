@@ -0,0 +1,328 @@
+#include "Replayer.h"
+#include "Helper.h"
+#include "Logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#define INDEX_MAGIC "TRMIDX01"
+
+// value of a numeric field in the asciicast header, fallback if missing
+static uint32_t __header_field(const std::string &header, const char *name,
+                               uint32_t fallback) {
+  size_t pos = header.find(std::string("\"") + name + "\"");
+  if (pos == std::string::npos)
+    return fallback;
+  pos = header.find(':', pos);
+  if (pos == std::string::npos)
+    return fallback;
+  return std::strtoul(header.c_str() + pos + 1, nullptr, 10);
+}
+
+Replayer::Replayer(std::string path) : path(path), file(path) {
+  if (!file.is_open()) {
+    pretty_log("REPLAY", std::string("Can't open recording ") + path, ERR);
+    throw "Can't open recording file";
+  }
+  std::string header;
+  std::getline(file, header);
+  if (header.find("\"version\": 2") == std::string::npos &&
+      header.find("\"version\":2") == std::string::npos) {
+    pretty_log("REPLAY", "Recording is not asciicast v2.", ERR);
+    throw "Unsupported recording format";
+  }
+  offset = header.length() + 1;
+  fileSize = std::filesystem::file_size(path);
+  width = __header_field(header, "width", width);
+  height = __header_field(header, "height", height);
+  pretty_log("REPLAY", std::string("Loaded recording ") + path);
+}
+
+Replayer::~Replayer() { stop(); }
+
+void Replayer::set_checkpoints(void (*snapshot)(std::string &state),
+                               bool (*restore)(const std::string &state),
+                               size_t intervalBytes, double intervalSeconds,
+                               bool useIndex) {
+  snapshot_callback = snapshot;
+  restore_callback = restore;
+  checkpointBytes = intervalBytes;
+  checkpointSeconds = intervalSeconds;
+  this->useIndex = useIndex;
+  if (useIndex)
+    __load_index();
+}
+
+void Replayer::set_resize_callback(void (*callback)(uint32_t width,
+                                                    uint32_t height)) {
+  resize_callback = callback;
+}
+
+void Replayer::play(void (*callback)(const char *data, size_t size),
+                    bool fast) {
+  output_callback = callback;
+  this->fast = fast;
+  player = std::thread(&Replayer::__player_thread, this);
+}
+
+void Replayer::stop() {
+  running = false;
+  if (player.joinable())
+    player.join();
+}
+
+// Seeking happens on the player thread, this only posts the request
+void Replayer::seek(double time) { seekTarget = std::max(0.0, time); }
+
+bool Replayer::is_finished() { return finished; }
+double Replayer::get_time() { return time; }
+uint32_t Replayer::get_width() { return width; }
+uint32_t Replayer::get_height() { return height; }
+
+// Parses one `[time, "type", "data"]` event line
+bool Replayer::__parse_event(const std::string &line, double &time, char &type,
+                             std::string &data) {
+  size_t pos = line.find('[');
+  if (pos == std::string::npos)
+    return false;
+  char *end = nullptr;
+  time = std::strtod(line.c_str() + pos + 1, &end);
+  if (end == line.c_str() + pos + 1)
+    return false;
+  size_t typeStart = line.find('"', end - line.c_str());
+  if (typeStart == std::string::npos || typeStart + 2 >= line.length())
+    return false;
+  type = line[typeStart + 1];
+  size_t dataStart = line.find('"', line.find('"', typeStart + 1) + 1);
+  size_t dataEnd = line.rfind('"');
+  if (dataStart == std::string::npos || dataEnd <= dataStart)
+    return false;
+  data = json_unescape(line.substr(dataStart + 1, dataEnd - dataStart - 1));
+  return true;
+}
+
+// Reads up to the next output or resize event, false at the end of the
+// recording
+bool Replayer::__next_event(double &time, char &type, std::string &data) {
+  std::string line;
+  while (std::getline(file, line)) {
+    offset += line.length() + 1;
+    if (__parse_event(line, time, type, data) && (type == 'o' || type == 'r'))
+      return true;
+  }
+  return false;
+}
+
+void Replayer::__apply_event(double time, char type, const std::string &data) {
+  if (type == 'r') {
+    // "<width>x<height>"
+    char *end = nullptr;
+    uint32_t width = std::strtoul(data.c_str(), &end, 10);
+    uint32_t height = *end == 'x' ? std::strtoul(end + 1, nullptr, 10) : 0;
+    if (resize_callback && width > 0 && height > 0)
+      resize_callback(width, height);
+  } else if (output_callback && !data.empty()) {
+    output_callback(data.c_str(), data.length());
+  }
+  this->time = time;
+  if (snapshot_callback == nullptr)
+    return;
+  // a new checkpoint follows the last one before the position once an
+  // interval is reached and there is no later one before it; gaps left by
+  // dropped checkpoints fill up again on the next pass like the end does
+  auto next = std::upper_bound(
+      checkpoints.begin(), checkpoints.end(), offset,
+      [](uint64_t offset, const Replay_Checkpoint &cp) {
+        return offset < cp.offset;
+      });
+  if (next != checkpoints.begin()) {
+    const Replay_Checkpoint &previous = *std::prev(next);
+    if (previous.offset != passedOffset) {
+      passedOffset = previous.offset;
+      bytesSinceCheckpoint = 0;
+      if (previous.offset == offset)
+        return; // the event ends at the checkpoint
+    }
+    bytesSinceCheckpoint += data.length();
+    if (bytesSinceCheckpoint < checkpointBytes &&
+        time - previous.time < checkpointSeconds)
+      return;
+  }
+  next = checkpoints.insert(next, {time, offset, std::string()});
+  snapshot_callback(next->state);
+  passedOffset = offset;
+  bytesSinceCheckpoint = 0;
+}
+
+void Replayer::__seek(double target) {
+  auto it = std::upper_bound(
+      checkpoints.begin(), checkpoints.end(), target,
+      [](double t, const Replay_Checkpoint &cp) { return t < cp.time; });
+  bool restore = it != checkpoints.begin() && restore_callback != nullptr;
+  if (restore) {
+    --it;
+    // keep going from the current position when it's closer than the
+    // checkpoint
+    restore = target < time || it->offset > offset;
+  }
+  if (restore) {
+    if (!restore_callback(it->state)) {
+      // the one before it or the events from here on take over, the next
+      // pass over its events takes a new one and the index is written again
+      pretty_log("REPLAY", "Dropping corrupt checkpoint.", ERR);
+      checkpoints.erase(it);
+      indexedCheckpoints = 0;
+      __seek(target);
+      return;
+    }
+    file.clear();
+    file.seekg(it->offset);
+    offset = it->offset;
+    time = it->time;
+    passedOffset = it->offset;
+    bytesSinceCheckpoint = 0;
+  } else if (target < time) {
+    pretty_log("REPLAY", "Can't seek backwards without checkpoints.", ERR);
+    return;
+  }
+  // replay the events between the checkpoint and the target
+  double eventTime;
+  char type;
+  std::string data;
+  while (running) {
+    uint64_t lineStart = offset;
+    if (!__next_event(eventTime, type, data))
+      break;
+    if (eventTime > target) {
+      file.clear();
+      file.seekg(lineStart);
+      offset = lineStart;
+      break;
+    }
+    __apply_event(eventTime, type, data);
+  }
+  time = target;
+  finished = false;
+}
+
+void Replayer::__player_thread() {
+  pretty_log("REPLAY", fast ? "Replay started (fast)." : "Replay started.");
+  if (snapshot_callback && checkpoints.empty()) {
+    checkpoints.push_back({0, offset, std::string()});
+    snapshot_callback(checkpoints.back().state);
+  }
+  auto start = std::chrono::steady_clock::now();
+  std::string data;
+  double eventTime;
+  char type;
+  size_t bytes = 0, events = 0;
+  while (running) {
+    double target = seekTarget.exchange(-1);
+    if (target >= 0) {
+      __seek(target);
+      start = std::chrono::steady_clock::now() -
+              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::duration<double>(time.load()));
+      pretty_log("REPLAY", "Seeked to " + std::to_string(time.load()) + " s.");
+    }
+    if (finished || !__next_event(eventTime, type, data)) {
+      if (!finished) {
+        double elapsed = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        pretty_log("REPLAY", "Replay finished: " + std::to_string(events) +
+                                 " events, " + std::to_string(bytes) +
+                                 " bytes in " + std::to_string(elapsed) +
+                                 " ms.");
+        __save_index();
+        finished = true;
+      }
+      // stay around so the recording can still be seeked
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      continue;
+    }
+    if (!fast) {
+      auto due = start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::duration<double>(eventTime));
+      // sleep in slices so stop() and seek() aren't held up by idle periods
+      while (running && seekTarget < 0 &&
+             std::chrono::steady_clock::now() < due)
+        std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(
+            due - std::chrono::steady_clock::now(),
+            std::chrono::milliseconds(20)));
+      if (seekTarget >= 0)
+        continue; // the seek repositions the file, drop this event
+    }
+    __apply_event(eventTime, type, data);
+    bytes += data.length();
+    events++;
+  }
+}
+
+/*
+ * Sidecar index: magic, recording size, then per checkpoint its time, file
+ * offset and the serialized terminal state.
+ */
+void Replayer::__load_index() {
+  std::ifstream index(path + ".idx", std::ios::binary);
+  if (!index.is_open())
+    return;
+  std::string in((std::istreambuf_iterator<char>(index)),
+                 std::istreambuf_iterator<char>());
+  size_t pos = strlen(INDEX_MAGIC);
+  uint64_t size, count, cpOffset, length;
+  if (in.compare(0, pos, INDEX_MAGIC) != 0 || !get_varint(in, pos, size) ||
+      size != fileSize || !get_varint(in, pos, count)) {
+    pretty_log("REPLAY", "Ignoring stale checkpoint index.", ERR);
+    return;
+  }
+  std::vector<Replay_Checkpoint> loaded;
+  for (uint64_t i = 0; i < count; i++) {
+    double cpTime;
+    if (pos + sizeof(cpTime) > in.length())
+      return;
+    memcpy(&cpTime, in.data() + pos, sizeof(cpTime));
+    pos += sizeof(cpTime);
+    if (!get_varint(in, pos, cpOffset) || !get_varint(in, pos, length) ||
+        length > in.length() - pos)
+      return;
+    // seeks search the checkpoints by time and resume the file at offset
+    if (!(cpTime >= 0) || cpOffset > fileSize ||
+        (!loaded.empty() && (cpTime < loaded.back().time ||
+                             cpOffset < loaded.back().offset))) {
+      pretty_log("REPLAY", "Ignoring corrupt checkpoint index.", ERR);
+      return;
+    }
+    loaded.push_back({cpTime, cpOffset, in.substr(pos, length)});
+    pos += length;
+  }
+  checkpoints = std::move(loaded);
+  indexedCheckpoints = checkpoints.size();
+  pretty_log("REPLAY", "Loaded " + std::to_string(indexedCheckpoints) +
+                           " checkpoints from index.");
+}
+
+void Replayer::__save_index() {
+  if (!useIndex || checkpoints.size() <= indexedCheckpoints)
+    return;
+  std::string out = INDEX_MAGIC;
+  put_varint(out, fileSize);
+  put_varint(out, checkpoints.size());
+  for (Replay_Checkpoint &cp : checkpoints) {
+    out.append((const char *)&cp.time, sizeof(cp.time));
+    put_varint(out, cp.offset);
+    put_varint(out, cp.state.length());
+    out += cp.state;
+  }
+  std::ofstream index(path + ".idx", std::ios::binary | std::ios::trunc);
+  index.write(out.data(), out.length());
+  indexedCheckpoints = checkpoints.size();
+  pretty_log("REPLAY", "Saved " + std::to_string(indexedCheckpoints) +
+                           " checkpoints (" + std::to_string(out.length()) +
+                           " bytes) to index.");
+}
@@ -0,0 +1,75 @@
+#ifndef REPLAYER_H
+#define REPLAYER_H
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Plays an asciicast v2 recording back into an output callback.
+// Output events are delivered either at their recorded time or, in fast mode,
+// as fast as the callback consumes them. Resize events go to the resize
+// callback.
+//
+// With checkpoints enabled the player snapshots the terminal state every few
+// MB/seconds of output, a seek restores the closest earlier snapshot and only
+// replays the events after it. Snapshots can be kept in a sidecar index file
+// (<recording>.idx) so later runs seek without building them again.
+class Replayer {
+public:
+  Replayer(std::string path);
+  ~Replayer();
+  void set_checkpoints(void (*snapshot)(std::string &state),
+                       bool (*restore)(const std::string &state),
+                       size_t intervalBytes, double intervalSeconds,
+                       bool useIndex);
+  void set_resize_callback(void (*callback)(uint32_t width, uint32_t height));
+  void play(void (*callback)(const char *data, size_t size), bool fast);
+  void seek(double time);
+  void stop();
+  bool is_finished();
+  double get_time();
+  uint32_t get_width();
+  uint32_t get_height();
+
+private:
+  typedef struct Replay_Checkpoint {
+    double time;     // time of the last event applied
+    uint64_t offset; // file offset of the next event
+    std::string state;
+  } Replay_Checkpoint;
+
+  void __player_thread();
+  bool __next_event(double &time, char &type, std::string &data);
+  void __apply_event(double time, char type, const std::string &data);
+  void __seek(double time);
+  void __load_index();
+  void __save_index();
+  bool __parse_event(const std::string &line, double &time, char &type,
+                     std::string &data);
+  std::string path;
+  std::ifstream file;
+  uint64_t fileSize = 0;
+  uint64_t offset = 0; // offset of the next line in file
+  uint32_t width = 80;
+  uint32_t height = 24;
+  void (*output_callback)(const char *data, size_t size) = nullptr;
+  void (*resize_callback)(uint32_t width, uint32_t height) = nullptr;
+  void (*snapshot_callback)(std::string &state) = nullptr;
+  bool (*restore_callback)(const std::string &state) = nullptr;
+  std::vector<Replay_Checkpoint> checkpoints;
+  size_t indexedCheckpoints = 0; // checkpoints already in the sidecar index
+  size_t checkpointBytes = 0;
+  double checkpointSeconds = 0;
+  size_t bytesSinceCheckpoint = 0;
+  uint64_t passedOffset = UINT64_MAX; // checkpoint the bytes count from
+  bool useIndex = false;
+  bool fast = false;
+  std::atomic<bool> running = true;
+  std::atomic<bool> finished = false;
+  std::atomic<double> time = 0;
+  std::atomic<double> seekTarget = -1;
+  std::thread player;
+};
+#endif // !REPLAYER_H
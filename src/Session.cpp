@@ -0,0 +1,45 @@
+#include "Session.h"
+#include "EscapeHandler.h"
+#include "Grid.h"
+#include "PTYHandler.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+uint32_t Session::nextId = 1;
+
+Session::Session(uint32_t rows, uint32_t cols, bool spawnShell)
+    : id(nextId++), primary(new Grid(rows, cols)),
+      alternate(new Grid(rows, cols, false)),
+      parser(new EscapeHandler(primary, alternate)) {
+  if (spawnShell)
+    pty = new PTYHandler();
+}
+
+Session::~Session() {
+  delete pty;
+  delete parser;
+  delete alternate;
+  delete primary;
+}
+
+uint32_t Session::get_id() { return id; }
+std::string Session::get_title() { return "Shell " + std::to_string(id); }
+PTYHandler *Session::get_pty() { return pty; }
+Grid *Session::get_primary() { return primary; }
+Grid *Session::get_alternate() { return alternate; }
+EscapeHandler *Session::get_parser() { return parser; }
+std::mutex &Session::get_mutex() { return mutex; }
+bool Session::is_exited() { return exited; }
+void Session::set_exited() { exited = true; }
+
+// Called with the mutex held: output after the child's SIGWINCH lands on the
+// new size
+void Session::resize(uint32_t rows, uint32_t cols, uint32_t width,
+                     uint32_t height) {
+  primary->resize(rows, cols);
+  alternate->resize(rows, cols);
+  if (pty != nullptr)
+    pty->set_window_size(rows, cols, width, height);
+  scrollDown = true;
+}
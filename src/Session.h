@@ -0,0 +1,41 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include "EscapeHandler.h"
+#include "Grid.h"
+#include "PTYHandler.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// One tab: a shell with its own screens, parser and scrollback. Replays use a
+// session without a PTY. The mutex guards the grids and the parser, the I/O
+// thread feeds them and the render loop draws them.
+class Session {
+public:
+  Session(uint32_t rows, uint32_t cols, bool spawnShell = true);
+  ~Session();
+  uint32_t get_id();
+  std::string get_title();
+  PTYHandler *get_pty();
+  Grid *get_primary();
+  Grid *get_alternate();
+  EscapeHandler *get_parser();
+  std::mutex &get_mutex();
+  void resize(uint32_t rows, uint32_t cols, uint32_t width, uint32_t height);
+  bool is_exited();
+  void set_exited();
+
+  std::atomic<bool> scrollDown = true; // follow the output on the next frame
+
+private:
+  static uint32_t nextId;
+  uint32_t id;
+  PTYHandler *pty = nullptr;
+  Grid *primary;   // scrollback kept
+  Grid *alternate; // full screen programs, no scrollback
+  EscapeHandler *parser;
+  std::mutex mutex;
+  std::atomic<bool> exited = false; // the shell is gone, the tab closes
+};
+#endif // !SESSION_H
@@ -0,0 +1,417 @@
+#include "SessionClient.h"
+#include "Config.h"
+#include "Helper.h"
+#include "Latency.h"
+#include "Logger.h"
+#include "Session.h"
+#include "SessionManager.h"
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <spawn.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+SessionClient *SessionClient::instance = nullptr;
+
+SessionClient::SessionClient() {}
+
+SessionClient *SessionClient::get_instance() {
+  if (instance == nullptr)
+    instance = new SessionClient();
+  return instance;
+}
+
+// Called on the reader thread once a snapshot or diff is in the session's
+// grids with the size of the message, with 0 once its shell exited
+void SessionClient::set_update_callback(void (*callback)(Session *session,
+                                                         size_t size)) {
+  update_callback = callback;
+}
+
+bool SessionClient::__connect() {
+  fd = SessionServer::connect_socket(SessionServer::get_socket_path());
+  return fd >= 0;
+}
+
+// Starts `<this program> --daemon` in a session of its own, it outlives the
+// window. The shell options go along.
+bool SessionClient::__spawn_server() {
+  char program[PATH_MAX];
+  ssize_t length = readlink("/proc/self/exe", program, sizeof(program) - 1);
+  if (length <= 0)
+    return false;
+  program[length] = 0;
+  Config *config = Config::get_instance();
+  std::vector<std::string> args = {program, "--daemon", "--socket",
+                                   SessionServer::get_socket_path()};
+  if (!config->loginShell)
+    args.push_back("--no-login");
+  if (config->shellPool > 0) {
+    args.push_back("--shell-pool");
+    args.push_back(std::to_string(config->shellPool));
+  }
+  std::vector<char *> argv;
+  for (std::string &arg : args)
+    argv.push_back(arg.data());
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attributes;
+  posix_spawn_file_actions_init(&actions);
+  for (int stream : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})
+    posix_spawn_file_actions_addopen(&actions, stream, "/dev/null", O_RDWR,
+                                     0);
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID);
+  pid_t pid;
+  int error =
+      posix_spawn(&pid, program, &actions, &attributes, argv.data(), environ);
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    pretty_log("CLIENT", std::string("Spawning the server failed: ") +
+                             strerror(error),
+               ERR);
+    return false;
+  }
+  pretty_log("CLIENT", "Started the server, pid " + std::to_string(pid));
+  return true;
+}
+
+// Connects, starting a server when none listens, and mirrors every session
+// of the server before returning. A server without sessions opens one of
+// rows x cols.
+bool SessionClient::attach(uint32_t rows, uint32_t cols) {
+  if (!__connect()) {
+    if (!__spawn_server())
+      return false;
+    auto start = std::chrono::steady_clock::now();
+    while (!__connect()) {
+      if (std::chrono::steady_clock::now() - start >
+          std::chrono::duration<double>(CLIENT_CONNECT_TIMEOUT)) {
+        pretty_log("CLIENT", "The server didn't come up.", ERR);
+        return false;
+      }
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(CLIENT_CONNECT_RETRY));
+    }
+  }
+  std::string payload;
+  put_varint(payload, rows);
+  put_varint(payload, cols);
+  put_varint(payload, Config::get_instance()->sharedGrids);
+  __write(MSG_ATTACH, 0, payload);
+  attaching = true;
+  Server_Header header;
+  int passedFd;
+  while (attaching) {
+    if (!SessionServer::read_message(fd, header, payload, &passedFd)) {
+      pretty_log("CLIENT", "The server closed the connection.", ERR);
+      detach();
+      return false;
+    }
+    __apply(header, payload, passedFd);
+  }
+  pretty_log("CLIENT", "Attached to " + std::to_string(sessions.size()) +
+                           " sessions.");
+  SessionManager::get_instance()->set_input_callback(__input_callback);
+  reader = std::thread(&SessionClient::__reader_thread, this);
+  return !sessions.empty();
+}
+
+// Asks the server for a session, it mirrors its snapshot once that arrives
+Session *SessionClient::create(uint32_t rows, uint32_t cols) {
+  Session *session = new Session(rows, cols, false);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    created.push_back(session);
+  }
+  std::string payload;
+  put_varint(payload, rows);
+  put_varint(payload, cols);
+  __write(MSG_NEW, 0, payload);
+  return session;
+}
+
+// Keys typed before the server's snapshot of a new session are dropped
+void SessionClient::send(Session *session, const std::string &input) {
+  uint32_t id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = ids.find(session);
+    if (found == ids.end())
+      return;
+    id = found->second;
+  }
+  __write(MSG_INPUT, id, input);
+  LatencyTracker::get_instance()->input_written(session->get_id());
+}
+
+// The local grids are resized by the caller, the server's reflowed ones
+// replace them with the next snapshot. Not called with the session mutex
+// held, the reader thread takes it under ours.
+void SessionClient::resize(Session *session, uint32_t rows, uint32_t cols,
+                           uint32_t width, uint32_t height) {
+  uint32_t id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = ids.find(session);
+    if (found == ids.end())
+      return;
+    id = found->second;
+  }
+  std::string payload;
+  for (uint32_t value : {rows, cols, width, height})
+    put_varint(payload, value);
+  __write(MSG_RESIZE, id, payload);
+}
+
+// The server hangs up the shell and reports its exit, a session still
+// waiting for its snapshot closes right away
+void SessionClient::close(Session *session) {
+  uint32_t id = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = ids.find(session);
+    if (found != ids.end())
+      id = found->second;
+  }
+  if (id != 0)
+    __write(MSG_CLOSE, id, "");
+  else
+    session->set_exited();
+}
+
+// Called before the session is deleted, the reader thread won't touch it
+// anymore. A session the server hasn't opened yet is closed once it is.
+void SessionClient::forget(Session *session) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = ids.find(session);
+  if (found != ids.end()) {
+    __drop_segment(found->second);
+    sessions.erase(found->second);
+    ids.erase(found);
+  }
+  for (Session *&pending : created)
+    if (pending == session)
+      pending = nullptr;
+}
+
+// Leaves the sessions running on the server
+void SessionClient::detach() {
+  if (fd < 0)
+    return;
+  detaching = true;
+  shutdown(fd, SHUT_RDWR);
+  if (reader.joinable())
+    reader.join();
+  ::close(fd);
+  fd = -1;
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &[id, segment] : segments)
+    delete segment;
+  segments.clear();
+  pretty_log("CLIENT", "Detached.");
+}
+
+void SessionClient::__drop_segment(uint32_t id) {
+  auto found = segments.find(id);
+  if (found == segments.end())
+    return;
+  delete found->second;
+  segments.erase(found);
+}
+
+void SessionClient::__write(uint32_t type, uint32_t session,
+                            const std::string &payload) {
+  std::lock_guard<std::mutex> lock(writeMutex);
+  if (fd >= 0 && !SessionServer::write_message(fd, type, session, payload))
+    pretty_log("CLIENT", "Writing to the server failed.", ERR);
+}
+
+void SessionClient::__input_callback(Session *session,
+                                     const std::string &input) {
+  instance->send(session, input);
+}
+
+// A snapshot of a session the client doesn't know belongs to the oldest
+// MSG_NEW, or while attaching to a session of the server's. The segment
+// sent along with a snapshot replaces the session's one.
+void SessionClient::__apply(const Server_Header &header,
+                            const std::string &payload, int passedFd) {
+  Session *session = nullptr;
+  std::unique_lock<std::mutex> lock(mutex);
+  auto found = sessions.find(header.session);
+  if (found != sessions.end())
+    session = found->second;
+  switch (header.type) {
+  case MSG_SNAPSHOT:
+    if (session == nullptr) {
+      if (attaching) {
+        session = new Session(PTY_DEFAULT_ROWS, PTY_DEFAULT_COLS, false);
+        SessionManager::get_instance()->add_session(session);
+      } else if (!created.empty()) {
+        session = created.front();
+        created.pop_front();
+      }
+      if (session == nullptr) {
+        // closed while the server opened it
+        __write(MSG_CLOSE, header.session, "");
+        if (passedFd >= 0)
+          ::close(passedFd);
+        return;
+      }
+      sessions[header.session] = session;
+      ids[session] = header.session;
+    }
+    [[fallthrough]];
+  case MSG_DIFF:
+  case MSG_NOTIFY:
+    if (session == nullptr)
+      return;
+    {
+      std::lock_guard<std::mutex> sessionLock(session->get_mutex());
+      Grid *primary = session->get_primary();
+      Grid *alternate = session->get_alternate();
+      size_t pos = 0;
+      bool applied = true;
+      if (header.type == MSG_SNAPSHOT) {
+        applied = primary->deserialize(payload, pos) &&
+                  alternate->deserialize(payload, pos);
+        __drop_segment(header.session);
+        GridSegment *segment = nullptr;
+        if (applied && passedFd >= 0)
+          segment = GridSegment::map(passedFd, primary, alternate);
+        else if (passedFd >= 0)
+          ::close(passedFd);
+        if (segment != nullptr)
+          segments[header.session] = segment;
+      } else if (header.type == MSG_DIFF) {
+        applied = primary->deserialize_damage(payload, pos) &&
+                  alternate->deserialize_damage(payload, pos);
+      } else {
+        auto segment = segments.find(header.session);
+        if (segment == segments.end() ||
+            !primary->deserialize_lines(payload, pos))
+          applied = false;
+        // grids resized since the segment's snapshot wait for the next one,
+        // a segment that can't be read for the next notification
+        else if (!segment->second->read(primary, alternate, payload, pos))
+          return;
+      }
+      if (!applied || !session->get_parser()->deserialize_modes(payload, pos))
+        pretty_log("CLIENT", "Corrupt update from the server.", ERR);
+      session->scrollDown = true;
+    }
+    break;
+  case MSG_EXIT:
+    if (header.session == 0 && !created.empty()) {
+      session = created.front(); // the server couldn't open it
+      created.pop_front();
+    } else if (session != nullptr) {
+      __drop_segment(header.session);
+      sessions.erase(header.session);
+      ids.erase(session);
+    }
+    if (session == nullptr)
+      return;
+    session->set_exited();
+    break;
+  case MSG_ATTACHED:
+    attaching = false;
+    return;
+  default:
+    return;
+  }
+  lock.unlock();
+  if (update_callback != nullptr)
+    update_callback(session, header.type == MSG_EXIT ? 0 : payload.size());
+}
+
+// Once the server is gone every session closes
+void SessionClient::__reader_thread() {
+  Server_Header header;
+  std::string payload;
+  int passedFd;
+  while (SessionServer::read_message(fd, header, payload, &passedFd))
+    __apply(header, payload, passedFd);
+  if (detaching)
+    return;
+  pretty_log("CLIENT", "Lost the server.", ERR);
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &[id, session] : sessions) {
+    session->set_exited();
+    if (update_callback != nullptr)
+      update_callback(session, 0);
+  }
+}
+
+static std::atomic<int64_t> __last_update_ms = 0;
+
+static int64_t __now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void __headless_update(Session *session, size_t size) {
+  __last_update_ms = __now_ms();
+}
+
+// Row text without the trailing blanks
+static std::string __row_text(Grid *grid, uint32_t row) {
+  std::string text;
+  for (const Cell &cell : grid->get_row(row)) {
+    if (cell.flags & CELL_WIDE_SPACER)
+      continue;
+    if (cell.flags & CELL_CLUSTER)
+      for (char32_t codepoint : grid->get_clusters().get(cell.codepoint))
+        utf8_append(text, codepoint);
+    else
+      utf8_append(text, cell.codepoint);
+  }
+  return text.substr(0, text.find_last_not_of(' ') + 1);
+}
+
+// Attaches without a window: stdin, when it isn't a terminal, is typed into
+// the first session, and once the screens were quiet for HEADLESS_SETTLE_MS
+// every session's screen is printed. The sessions stay on the server.
+int SessionClient::run_headless() {
+  set_update_callback(__headless_update);
+  if (!attach(PTY_DEFAULT_ROWS, PTY_DEFAULT_COLS))
+    return 1;
+  SessionManager *manager = SessionManager::get_instance();
+  if (!isatty(STDIN_FILENO)) {
+    std::string input((std::istreambuf_iterator<char>(std::cin)),
+                      std::istreambuf_iterator<char>());
+    if (!input.empty())
+      manager->send(manager->get_session(0), input);
+  }
+  __last_update_ms = __now_ms();
+  int64_t start = __now_ms();
+  while (__now_ms() - __last_update_ms < HEADLESS_SETTLE_MS &&
+         __now_ms() - start < HEADLESS_TIMEOUT_MS)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  detach();
+  for (size_t i = 0; i < manager->get_count(); i++) {
+    Session *session = manager->get_session(i);
+    Grid *grid = session->get_parser()->get_grid();
+    std::cout << "--- " << session->get_title() << " ("
+              << grid->get_scrollback_size() << " scrollback lines)\n";
+    for (uint32_t row = 0; row < grid->get_rows(); row++)
+      std::cout << __row_text(grid, row) << "\n";
+  }
+  std::cout.flush();
+  manager->stop();
+  return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef SESSION_CLIENT_H
+#define SESSION_CLIENT_H
+#include "GridSegment.h"
+#include "Session.h"
+#include "SessionServer.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#define CLIENT_CONNECT_TIMEOUT 2.0 // seconds a spawned server gets to listen
+#define CLIENT_CONNECT_RETRY 10    // ms between connection attempts
+#define HEADLESS_SETTLE_MS 300 // quiet time before a headless client prints
+#define HEADLESS_TIMEOUT_MS 5000
+
+// The window's side of detachable sessions (see SessionServer). The sessions
+// are mirrors without a PTY: the reader thread applies the server's
+// snapshots and diffs to their grids under the session mutex, keys, resizes
+// and closes go to the server. A server is spawned when none listens yet.
+// With shared grids the server's snapshots come with a GridSegment, the
+// rows of its notifications are read from there.
+class SessionClient {
+public:
+  static SessionClient *get_instance();
+  bool attach(uint32_t rows, uint32_t cols);
+  Session *create(uint32_t rows, uint32_t cols);
+  void send(Session *session, const std::string &input);
+  void resize(Session *session, uint32_t rows, uint32_t cols, uint32_t width,
+              uint32_t height);
+  void close(Session *session);
+  void forget(Session *session);
+  void detach();
+  void set_update_callback(void (*callback)(Session *session, size_t size));
+  int run_headless();
+
+private:
+  SessionClient();
+  bool __connect();
+  bool __spawn_server();
+  void __apply(const Server_Header &header, const std::string &payload,
+               int passedFd);
+  void __drop_segment(uint32_t id);
+  void __reader_thread();
+  void __write(uint32_t type, uint32_t session, const std::string &payload);
+  static void __input_callback(Session *session, const std::string &input);
+  static SessionClient *instance;
+  int fd = -1;
+  bool attaching = false; // snapshots of unknown sessions open new ones
+  std::unordered_map<uint32_t, Session *> sessions; // by server id
+  std::unordered_map<Session *, uint32_t> ids;
+  std::unordered_map<uint32_t, GridSegment *> segments; // by server id
+  std::deque<Session *> created; // waiting for their snapshot, null: closed
+  std::mutex mutex;              // the maps and created
+  std::mutex writeMutex;
+  void (*update_callback)(Session *session, size_t size) = nullptr;
+  std::atomic<bool> detaching = false;
+  std::thread reader;
+};
+#endif // !SESSION_CLIENT_H
@@ -0,0 +1,208 @@
+#include "SessionManager.h"
+#include "Latency.h"
+#include "Logger.h"
+#include "Session.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+SessionManager *SessionManager::instance = nullptr;
+
+SessionManager::SessionManager() {
+  if (pipe2(wakePipe, O_CLOEXEC) == -1)
+    throw "Can't create the session wake pipe";
+  worker = std::thread(&SessionManager::__io_thread, this);
+}
+
+SessionManager *SessionManager::get_instance() {
+  if (instance == nullptr)
+    instance = new SessionManager();
+  return instance;
+}
+
+SessionManager::~SessionManager() { stop(); }
+
+void SessionManager::set_output_callback(
+    void (*callback)(Session *session, const char *data, size_t size)) {
+  output_callback = callback;
+}
+
+// Called on the I/O thread once a session's shell exited
+void SessionManager::set_exit_callback(void (*callback)(Session *session)) {
+  exit_callback = callback;
+}
+
+// Takes the input of sessions without a PTY of their own, e.g. mirrors of a
+// server's sessions
+void SessionManager::set_input_callback(
+    void (*callback)(Session *session, const std::string &input)) {
+  input_callback = callback;
+}
+
+// Adds the session and makes it the active one. Output a pooled shell wrote
+// while idle is delivered before the I/O thread sees it.
+void SessionManager::add_session(Session *session) {
+  PTYHandler *pty = session->get_pty();
+  if (pty != nullptr && output_callback != nullptr) {
+    std::string output = pty->take_pooled_output();
+    if (!output.empty())
+      output_callback(session, output.data(), output.size());
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    sessions.push_back(session);
+    active = session;
+  }
+  __wake();
+  pretty_log("SESSION", "Opened session " + std::to_string(session->get_id()) +
+                            ", " + std::to_string(sessions.size()) + " open.");
+}
+
+// Removes the session and hangs up its shell. The I/O thread may still be
+// working on it, it is deleted once that is done.
+void SessionManager::close_session(Session *session) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = std::find(sessions.begin(), sessions.end(), session);
+    if (found == sessions.end())
+      return;
+    sessions.erase(found);
+    if (active == session)
+      active = sessions.empty() ? nullptr : sessions.back();
+  }
+  pretty_log("SESSION", "Closed session " + std::to_string(session->get_id()) +
+                            ", " + std::to_string(sessions.size()) + " open.");
+  {
+    std::lock_guard<std::mutex> lock(ioMutex);
+    delete session;
+  }
+  __wake();
+}
+
+// Closes the sessions whose shell exited, true when there were any
+bool SessionManager::remove_exited() {
+  bool removed = false;
+  for (size_t i = 0; i < sessions.size();) {
+    if (sessions[i]->is_exited()) {
+      close_session(sessions[i]);
+      removed = true;
+    } else {
+      i++;
+    }
+  }
+  return removed;
+}
+
+// Queues input for the session's shell, written by the I/O thread
+void SessionManager::send(Session *session, const std::string &input) {
+  if (session->get_pty() == nullptr) {
+    if (input_callback != nullptr)
+      input_callback(session, input);
+    return;
+  }
+  session->get_pty()->send(input);
+  __wake();
+}
+
+// Keeps the session open while the lock is held, for threads that picked it
+// before the render thread may have closed it. The lock owns nothing when the
+// session is gone already.
+std::unique_lock<std::mutex> SessionManager::hold(Session *session) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (std::find(sessions.begin(), sessions.end(), session) == sessions.end())
+    lock.unlock();
+  return lock;
+}
+
+bool SessionManager::__is_open(Session *session) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return std::find(sessions.begin(), sessions.end(), session) !=
+         sessions.end();
+}
+
+size_t SessionManager::get_count() { return sessions.size(); }
+Session *SessionManager::get_session(size_t index) {
+  return index < sessions.size() ? sessions[index] : nullptr;
+}
+Session *SessionManager::get_active() { return active; }
+void SessionManager::set_active(Session *session) { active = session; }
+
+// Joins the I/O thread and hangs up every shell
+void SessionManager::stop() {
+  if (!worker.joinable())
+    return;
+  running = false;
+  __wake();
+  worker.join();
+  for (Session *session : sessions)
+    delete session;
+  sessions.clear();
+  close(wakePipe[0]);
+  close(wakePipe[1]);
+}
+
+void SessionManager::__wake() {
+  char signal = 0;
+  if (write(wakePipe[1], &signal, 1) == -1)
+    pretty_log("SESSION", "Waking the I/O thread failed.", ERR);
+}
+
+void SessionManager::__io_thread() {
+  pretty_log("SESSION", "I/O thread started.");
+  std::vector<struct pollfd> fds;
+  std::vector<Session *> polled;
+  char buffer[SESSION_READ_SIZE];
+  while (running) {
+    fds.clear();
+    polled.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (Session *session : sessions) {
+        PTYHandler *pty = session->get_pty();
+        if (pty == nullptr || session->is_exited())
+          continue;
+        short events = POLLIN | (pty->has_input() ? POLLOUT : 0);
+        fds.push_back({pty->get_fd(), events, 0});
+        polled.push_back(session);
+      }
+    }
+    fds.push_back({wakePipe[0], POLLIN, 0});
+    if (poll(fds.data(), fds.size(), -1) == -1)
+      continue;
+    if (fds.back().revents & POLLIN &&
+        read(wakePipe[0], buffer, sizeof(buffer)) == -1)
+      pretty_log("SESSION", "Reading the wake pipe failed.", ERR);
+    // shells hung up by close_session() or exited on their own
+    while (waitpid(-1, nullptr, WNOHANG) > 0)
+      ;
+    // the output is parsed without the mutex, hold() never waits for it
+    std::lock_guard<std::mutex> ioLock(ioMutex);
+    for (size_t i = 0; i < polled.size(); i++) {
+      Session *session = polled[i];
+      if (fds[i].revents == 0 || !__is_open(session))
+        continue; // closed since the poll
+      PTYHandler *pty = session->get_pty();
+      if (fds[i].revents & POLLOUT && pty->write_input() && !pty->has_input())
+        LatencyTracker::get_instance()->input_written(session->get_id());
+      if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      ssize_t bytes = pty->read_output(buffer, sizeof(buffer));
+      if (bytes > 0 && output_callback != nullptr) {
+        output_callback(session, buffer, bytes);
+      } else if (bytes == 0) {
+        pretty_log("SESSION",
+                   "Shell of session " + std::to_string(session->get_id()) +
+                       " exited.");
+        session->set_exited();
+        if (exit_callback != nullptr)
+          exit_callback(session);
+      }
+    }
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef SESSION_MANAGER_H
+#define SESSION_MANAGER_H
+#include "Session.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SESSION_READ_SIZE 4096 // bytes read from a PTY at a time
+
+// The open sessions and the one I/O thread serving all of them:
+// it polls every PTY master, feeds output to the output callback and writes
+// queued input once the PTY has room.
+// Sessions are added and removed on the render thread only. The mutex guards
+// the list and is only held briefly, other threads hold() a session with it;
+// the I/O thread holds ioMutex while it works on the sessions, a closed
+// session is deleted under it.
+class SessionManager {
+public:
+  static SessionManager *get_instance();
+  ~SessionManager();
+  void set_output_callback(void (*callback)(Session *session, const char *data,
+                                            size_t size));
+  void set_exit_callback(void (*callback)(Session *session));
+  void set_input_callback(void (*callback)(Session *session,
+                                           const std::string &input));
+  void add_session(Session *session);
+  void close_session(Session *session);
+  bool remove_exited();
+  void send(Session *session, const std::string &input);
+  std::unique_lock<std::mutex> hold(Session *session);
+  size_t get_count();
+  Session *get_session(size_t index);
+  Session *get_active();
+  void set_active(Session *session);
+  void stop();
+
+private:
+  SessionManager();
+  void __io_thread();
+  void __wake();
+  bool __is_open(Session *session);
+  static SessionManager *instance;
+  std::vector<Session *> sessions;
+  Session *active = nullptr; // takes the keyboard input
+  std::mutex mutex;   // the sessions
+  std::mutex ioMutex; // the I/O thread reading and parsing
+  int wakePipe[2] = {-1, -1};
+  void (*output_callback)(Session *session, const char *data,
+                          size_t size) = nullptr;
+  void (*exit_callback)(Session *session) = nullptr;
+  void (*input_callback)(Session *session, const std::string &input) = nullptr;
+  std::atomic<bool> running = true;
+  std::thread worker;
+};
+#endif // !SESSION_MANAGER_H
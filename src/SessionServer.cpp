@@ -0,0 +1,457 @@
+#include "SessionServer.h"
+#include "Config.h"
+#include "Helper.h"
+#include "Logger.h"
+#include "Session.h"
+#include "SessionManager.h"
+#include "ShellPool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_set>
+
+SessionServer *SessionServer::instance = nullptr;
+
+SessionServer::SessionServer() {}
+
+SessionServer *SessionServer::get_instance() {
+  if (instance == nullptr)
+    instance = new SessionServer();
+  return instance;
+}
+
+// --socket, else terminal.sock in $XDG_RUNTIME_DIR, else one per user in /tmp
+std::string SessionServer::get_socket_path() {
+  const std::string &path = Config::get_instance()->socketPath;
+  if (!path.empty())
+    return path;
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime != nullptr && *runtime)
+    return std::string(runtime) + "/terminal.sock";
+  return "/tmp/terminal-" + std::to_string(getuid()) + ".sock";
+}
+
+// passFd goes along with the first bytes (SCM_RIGHTS)
+bool SessionServer::write_message(int fd, uint32_t type, uint32_t session,
+                                  const std::string &payload, int passFd) {
+  Server_Header header = {type, session, (uint32_t)payload.size()};
+  std::string message((const char *)&header, sizeof(header));
+  message += payload;
+  size_t sent = 0;
+  if (passFd >= 0) {
+    struct iovec data = {message.data(), message.size()};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr carrier = {};
+    carrier.msg_iov = &data;
+    carrier.msg_iovlen = 1;
+    carrier.msg_control = control;
+    carrier.msg_controllen = sizeof(control);
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&carrier);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(rights), &passFd, sizeof(int));
+    ssize_t bytes;
+    do
+      bytes = sendmsg(fd, &carrier, MSG_NOSIGNAL);
+    while (bytes < 0 && errno == EINTR);
+    if (bytes <= 0)
+      return false;
+    sent = bytes;
+  }
+  while (sent < message.size()) {
+    ssize_t bytes = send(fd, message.data() + sent, message.size() - sent,
+                         MSG_NOSIGNAL);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      return false;
+    sent += bytes;
+  }
+  return true;
+}
+
+static bool __read_exactly(int fd, char *buffer, size_t size) {
+  for (size_t got = 0; got < size;) {
+    ssize_t bytes = read(fd, buffer + got, size - got);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      return false;
+    got += bytes;
+  }
+  return true;
+}
+
+// Blocks until a whole message is read, false once the peer is gone. A file
+// descriptor sent along lands in passedFd, else it is -1.
+bool SessionServer::read_message(int fd, Server_Header &header,
+                                 std::string &payload, int *passedFd) {
+  struct iovec data = {&header, sizeof(header)};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr carrier = {};
+  carrier.msg_iov = &data;
+  carrier.msg_iovlen = 1;
+  carrier.msg_control = control;
+  carrier.msg_controllen = sizeof(control);
+  ssize_t bytes;
+  do
+    bytes = recvmsg(fd, &carrier, MSG_CMSG_CLOEXEC);
+  while (bytes < 0 && errno == EINTR);
+  if (bytes <= 0)
+    return false;
+  int received = -1;
+  struct cmsghdr *rights = CMSG_FIRSTHDR(&carrier);
+  if (rights != nullptr && rights->cmsg_level == SOL_SOCKET &&
+      rights->cmsg_type == SCM_RIGHTS)
+    memcpy(&received, CMSG_DATA(rights), sizeof(int));
+  if (passedFd != nullptr)
+    *passedFd = received;
+  else if (received >= 0)
+    close(received);
+  if (!__read_exactly(fd, (char *)&header + bytes, sizeof(header) - bytes) ||
+      header.length > SERVER_MAX_MESSAGE)
+    return false;
+  payload.resize(header.length);
+  return __read_exactly(fd, payload.data(), header.length);
+}
+
+// Serves until the last session closed. The server thread is the one adding
+// and removing sessions, the session I/O thread feeds the parsers.
+int SessionServer::run() {
+  SessionManager *sessions = SessionManager::get_instance();
+  sessions->set_output_callback(__output_callback);
+  sessions->set_exit_callback(__exit_callback);
+  if (pipe2(wakePipe, O_CLOEXEC) == -1) {
+    pretty_log("SERVER", "Can't create the server wake pipe.", ERR);
+    return 1;
+  }
+  socketPath = get_socket_path();
+  listenFd = listen_socket(socketPath);
+  if (listenFd < 0)
+    return 1;
+  ShellPool::get_instance()->start(Config::get_instance()->shellPool);
+  pretty_log("SERVER", "Serving sessions on " + socketPath);
+  bool opened = false;
+  bool held = false;
+  char buffer[64];
+  for (;;) {
+    // poll skips the client slot while its fd is -1
+    struct pollfd fds[3] = {{listenFd, POLLIN, 0},
+                            {wakePipe[0], POLLIN, 0},
+                            {clientFd, POLLIN, 0}};
+    if (poll(fds, 3, held ? SERVER_HOLD_POLL : -1) == -1 && errno != EINTR)
+      break;
+    if (fds[1].revents & POLLIN &&
+        read(wakePipe[0], buffer, sizeof(buffer)) == -1)
+      pretty_log("SERVER", "Reading the wake pipe failed.", ERR);
+    if (clientFd >= 0 && fds[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+      Server_Header header;
+      std::string payload;
+      if (read_message(clientFd, header, payload))
+        __handle(header, payload);
+      else
+        __detach();
+    }
+    if (fds[0].revents & POLLIN)
+      __accept();
+    held = __send_updates();
+    if (sessions->get_count() > 0)
+      opened = true;
+    else if (opened)
+      break;
+  }
+  pretty_log("SERVER", "No session left, exiting.");
+  __detach();
+  close(listenFd);
+  unlink(socketPath.c_str());
+  sessions->stop();
+  ShellPool::get_instance()->stop();
+  return 0;
+}
+
+// A socket nobody accepts on is left over from a server that died, one that
+// answers belongs to a running server. Returns the listening fd or -1.
+int SessionServer::listen_socket(const std::string &path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    pretty_log("SERVER", "Socket path too long: " + path, ERR);
+    return -1;
+  }
+  strcpy(address.sun_path, path.c_str());
+  int probe = connect_socket(path);
+  if (probe >= 0) {
+    close(probe);
+    pretty_log("SERVER", "A server already listens on " + path, ERR);
+    return -1;
+  }
+  unlink(path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  // only the user may attach to their shells
+  mode_t mask = umask(077);
+  bool bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+  umask(mask);
+  if (!bound || listen(fd, 4) == -1) {
+    pretty_log("SERVER", "Can't listen on " + path, ERR);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// The connected fd, -1 when nobody listens
+int SessionServer::connect_socket(const std::string &path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    return -1;
+  strcpy(address.sun_path, path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+    return fd;
+  close(fd);
+  return -1;
+}
+
+// The new client takes over, the attached one is dropped
+void SessionServer::__accept() {
+  int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd == -1)
+    return;
+  __detach();
+  clientFd = fd;
+  pretty_log("SERVER", "Client connected.");
+}
+
+// The sessions keep running, the next client gets snapshots
+void SessionServer::__detach() {
+  if (clientFd < 0)
+    return;
+  close(clientFd);
+  clientFd = -1;
+  for (auto &[id, mirror] : mirrors)
+    delete mirror.segment;
+  mirrors.clear();
+  pretty_log("SERVER", "Client detached.");
+}
+
+Session *SessionServer::__find(uint32_t id) {
+  SessionManager *sessions = SessionManager::get_instance();
+  for (size_t i = 0; i < sessions->get_count(); i++)
+    if (sessions->get_session(i)->get_id() == id)
+      return sessions->get_session(i);
+  return nullptr;
+}
+
+// Sizes from a client, checked before they reach a grid or the PTY's winsize
+static bool __valid_size(uint64_t rows, uint64_t cols) {
+  return rows > 0 && cols > 0 && rows <= SNAPSHOT_MAX_SIDE &&
+         cols <= SNAPSHOT_MAX_SIDE && rows * cols <= SNAPSHOT_MAX_CELLS;
+}
+
+// Null when the size is invalid or the shell can't be started
+Session *SessionServer::__open_session(uint64_t rows, uint64_t cols) {
+  if (!__valid_size(rows, cols)) {
+    pretty_log("SERVER", "Invalid session size from the client.", ERR);
+    return nullptr;
+  }
+  Session *session;
+  try {
+    session = new Session(rows, cols);
+  } catch (const char *error) {
+    pretty_log("SERVER", error, ERR);
+    return nullptr;
+  }
+  session->get_pty()->set_window_size(rows, cols, 0, 0);
+  SessionManager::get_instance()->add_session(session);
+  return session;
+}
+
+void SessionServer::__handle(const Server_Header &header,
+                             const std::string &payload) {
+  uint64_t values[4] = {0, 0, 0, 0};
+  size_t pos = 0;
+  if (header.type != MSG_INPUT)
+    for (uint64_t &value : values)
+      if (!get_varint(payload, pos, value))
+        break;
+  SessionManager *sessions = SessionManager::get_instance();
+  Session *session = __find(header.session);
+  switch (header.type) {
+  case MSG_ATTACH:
+    sharedGrids = values[2];
+    if (sessions->get_count() == 0)
+      __open_session(values[0], values[1]);
+    for (size_t i = 0; i < sessions->get_count(); i++)
+      __send_session(sessions->get_session(i), true);
+    __send(MSG_ATTACHED, 0, "");
+    break;
+  case MSG_NEW:
+    session = __open_session(values[0], values[1]);
+    if (session == nullptr)
+      __send(MSG_EXIT, 0, "");
+    else
+      __send_session(session, true);
+    break;
+  case MSG_INPUT:
+    if (session != nullptr)
+      sessions->send(session, payload);
+    break;
+  case MSG_RESIZE:
+    if (session == nullptr)
+      break;
+    if (!__valid_size(values[0], values[1]) || values[2] > UINT16_MAX ||
+        values[3] > UINT16_MAX) {
+      pretty_log("SERVER", "Invalid resize from the client.", ERR);
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lock(session->get_mutex());
+      session->resize(values[0], values[1], values[2], values[3]);
+    }
+    __changed(session->get_id()); // resized grids go out as a snapshot
+    break;
+  case MSG_CLOSE:
+    if (session != nullptr)
+      session->set_exited(); // hung up when it's removed
+    break;
+  default:
+    pretty_log("SERVER", "Unknown message " + std::to_string(header.type),
+               ERR);
+    break;
+  }
+}
+
+// A lost client is detached
+void SessionServer::__send(uint32_t type, uint32_t session,
+                           const std::string &payload, int passFd) {
+  if (clientFd >= 0 &&
+      !write_message(clientFd, type, session, payload, passFd))
+    __detach();
+}
+
+void SessionServer::__drop_mirror(uint32_t id) {
+  auto found = mirrors.find(id);
+  if (found == mirrors.end())
+    return;
+  delete found->second.segment;
+  mirrors.erase(found);
+}
+
+// Sends what the client is missing of the session: a snapshot when it has
+// none (attach) or the grids were resized or their scrollback rewritten,
+// then the damage since. The snapshot leaves every slot dirty, the diff
+// after it gives the client the server's slot order. Returns false while a
+// synchronized update holds the diff back, the session stays changed.
+// With shared grids every snapshot comes with a segment of the grids' size
+// and the damage is published to it, the client is only notified.
+bool SessionServer::__send_session(Session *session, bool attach) {
+  uint32_t id = session->get_id();
+  Mirror_State &mirror = mirrors[id];
+  std::string snapshot, diff;
+  bool held;
+  {
+    std::lock_guard<std::mutex> lock(session->get_mutex());
+    Grid *primary = session->get_primary();
+    Grid *alternate = session->get_alternate();
+    EscapeHandler *parser = session->get_parser();
+    held = parser->is_synchronized();
+    if (attach || primary->get_rewrites() != mirror.rewrites[0] ||
+        alternate->get_rewrites() != mirror.rewrites[1]) {
+      primary->serialize(snapshot, SCROLLBACK_LINES);
+      alternate->serialize(snapshot, 0);
+      parser->serialize_modes(snapshot);
+      primary->mark_all_dirty();
+      alternate->mark_all_dirty();
+      delete mirror.segment;
+      mirror.segment =
+          sharedGrids ? GridSegment::create(primary, alternate) : nullptr;
+      mirror.pushedLines = primary->get_pushed_lines();
+      mirror.rewrites[0] = primary->get_rewrites();
+      mirror.rewrites[1] = alternate->get_rewrites();
+    }
+    size_t newLines = primary->get_pushed_lines() - mirror.pushedLines;
+    if (!held && mirror.segment != nullptr) {
+      primary->serialize_lines(diff, newLines);
+      mirror.segment->publish(primary, alternate, diff);
+      parser->serialize_modes(diff);
+    } else if (!held) {
+      primary->serialize_damage(diff, newLines);
+      alternate->serialize_damage(diff, 0);
+      parser->serialize_modes(diff);
+    }
+    if (!held)
+      mirror.pushedLines = primary->get_pushed_lines();
+  }
+  // a failed write detaches the client and drops the mirrors, mirror with
+  // them
+  int segmentFd = mirror.segment ? mirror.segment->get_fd() : -1;
+  uint32_t diffType = mirror.segment ? MSG_NOTIFY : MSG_DIFF;
+  if (!snapshot.empty())
+    __send(MSG_SNAPSHOT, id, snapshot, segmentFd);
+  if (!diff.empty())
+    __send(diffType, id, diff);
+  if (held)
+    __changed(id);
+  return !held;
+}
+
+// Diffs of the sessions with new output, then the exits of the shells that
+// are gone. Returns whether a synchronized update holds a diff back.
+bool SessionServer::__send_updates() {
+  SessionManager *sessions = SessionManager::get_instance();
+  std::unordered_set<uint32_t> pending;
+  {
+    std::lock_guard<std::mutex> lock(changedMutex);
+    pending.swap(changed);
+  }
+  bool held = false;
+  for (size_t i = 0; i < sessions->get_count(); i++) {
+    Session *session = sessions->get_session(i);
+    uint32_t id = session->get_id();
+    if (session->is_exited()) {
+      // the last output, then the exit
+      if (clientFd >= 0 && pending.count(id))
+        __send_session(session, false);
+      __send(MSG_EXIT, id, "");
+      __drop_mirror(id);
+    } else if (clientFd >= 0 && pending.count(id)) {
+      held |= !__send_session(session, false);
+    }
+  }
+  sessions->remove_exited();
+  return held;
+}
+
+void SessionServer::__changed(uint32_t id) {
+  std::lock_guard<std::mutex> lock(changedMutex);
+  changed.insert(id);
+}
+
+void SessionServer::__wake() {
+  char signal = 0;
+  if (write(wakePipe[1], &signal, 1) == -1)
+    pretty_log("SERVER", "Waking the server thread failed.", ERR);
+}
+
+// Runs on the session I/O thread
+void SessionServer::__output_callback(Session *session, const char *data,
+                                      size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(session->get_mutex());
+    session->get_parser()->feed(data, size);
+  }
+  instance->__changed(session->get_id());
+  instance->__wake();
+}
+
+void SessionServer::__exit_callback(Session *session) { instance->__wake(); }
@@ -0,0 +1,90 @@
+#ifndef SESSION_SERVER_H
+#define SESSION_SERVER_H
+#include "GridSegment.h"
+#include "Session.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#define SERVER_MAX_MESSAGE (64 << 20) // larger messages drop the connection
+#define SERVER_HOLD_POLL 10 // ms between looks at a held synchronized update
+
+// Messages on the server socket: a Server_Header, then length payload bytes.
+// Numbers in the payloads are varints.
+enum Server_Message : uint32_t {
+  MSG_ATTACH,   // client: rows, cols, shared grids; a server without
+                // sessions opens one
+  MSG_NEW,      // client: rows, cols of a new session
+  MSG_INPUT,    // client: bytes for the session's shell
+  MSG_RESIZE,   // client: rows, cols, width and height in pixels
+  MSG_CLOSE,    // client: hang up the session's shell
+  MSG_SNAPSHOT, // server: both grids and the modes, of a new session too;
+                // the grid segment's fd along with shared grids
+  MSG_DIFF,     // server: damage of both grids since the last message, modes
+  MSG_NOTIFY,   // server: rows were published to the segment; new lines,
+                // rows with clusters of both grids, modes
+  MSG_EXIT,     // server: the shell exited; session 0: a MSG_NEW failed
+  MSG_ATTACHED, // server: every session of the attach was sent
+};
+
+typedef struct Server_Header {
+  uint32_t type;
+  uint32_t session; // id on the server
+  uint32_t length;
+} Server_Header;
+
+// Detachable sessions: a daemon owns the shells, parsers and grids, and a GUI
+// attaches over a Unix domain socket. Closing the window leaves the sessions
+// running, the next client gets a snapshot of every session with its
+// scrollback and from then on grid diffs (Grid::serialize_damage), so
+// attaching costs the screens and the kept lines, not the output history.
+// One client at a time, a new one takes over from the attached one.
+// Diffs of a session are held while its synchronized update is in flight.
+class SessionServer {
+public:
+  static SessionServer *get_instance();
+  int run();
+  static std::string get_socket_path();
+  static int listen_socket(const std::string &path);
+  static int connect_socket(const std::string &path);
+  static bool write_message(int fd, uint32_t type, uint32_t session,
+                            const std::string &payload, int passFd = -1);
+  static bool read_message(int fd, Server_Header &header,
+                           std::string &payload, int *passedFd = nullptr);
+
+private:
+  SessionServer();
+  // what the client has of a session
+  typedef struct Mirror_State {
+    uint64_t pushedLines = 0;        // primary scrollback lines sent
+    uint64_t rewrites[2] = {0, 0};   // of the grids at the last snapshot
+    GridSegment *segment = nullptr;  // with shared grids
+  } Mirror_State;
+  void __accept();
+  void __detach();
+  void __handle(const Server_Header &header, const std::string &payload);
+  Session *__find(uint32_t id);
+  Session *__open_session(uint64_t rows, uint64_t cols);
+  void __send(uint32_t type, uint32_t session, const std::string &payload,
+              int passFd = -1);
+  void __drop_mirror(uint32_t id);
+  bool __send_session(Session *session, bool attach);
+  bool __send_updates();
+  void __changed(uint32_t id);
+  void __wake();
+  static void __output_callback(Session *session, const char *data,
+                                size_t size);
+  static void __exit_callback(Session *session);
+  static SessionServer *instance;
+  std::string socketPath;
+  int listenFd = -1;
+  int clientFd = -1;
+  bool sharedGrids = false; // the client maps grid segments
+  int wakePipe[2] = {-1, -1};
+  std::unordered_map<uint32_t, Mirror_State> mirrors; // by session id
+  std::unordered_set<uint32_t> changed; // sessions with output since a diff
+  std::mutex changedMutex;
+};
+#endif // !SESSION_SERVER_H
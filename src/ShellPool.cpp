@@ -0,0 +1,139 @@
+#include "ShellPool.h"
+#include "Logger.h"
+#include "PTYHandler.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+ShellPool *ShellPool::instance = nullptr;
+
+ShellPool::ShellPool() {}
+
+ShellPool *ShellPool::get_instance() {
+  if (instance == nullptr)
+    instance = new ShellPool();
+  return instance;
+}
+
+ShellPool::~ShellPool() { stop(); }
+
+// Keeps size shells idle from now on, spawned by the pool thread
+void ShellPool::start(size_t size) {
+  if (size == 0 || worker.joinable())
+    return;
+  if (pipe2(wakePipe, O_CLOEXEC) == -1) {
+    pretty_log("POOL", "Can't create the shell pool wake pipe.", ERR);
+    return;
+  }
+  this->size = size;
+  running = true;
+  worker = std::thread(&ShellPool::__pool_thread, this);
+  pretty_log("POOL", "Keeping " + std::to_string(size) + " idle shells.");
+}
+
+// Hands out the oldest idle shell, its rc files are the most likely done.
+// The caller owns the master afterwards and resizes it.
+bool ShellPool::claim(Pooled_Shell &shell) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idle.empty())
+      return false;
+    shell = std::move(idle.front());
+    idle.erase(idle.begin());
+  }
+  __wake(); // refill
+  return true;
+}
+
+// Hangs up the idle shells
+void ShellPool::stop() {
+  if (!worker.joinable())
+    return;
+  running = false;
+  __wake();
+  worker.join();
+  for (Pooled_Shell &shell : idle) {
+    close(shell.masterFd);
+    kill(shell.pid, SIGHUP);
+    waitpid(shell.pid, nullptr, WNOHANG);
+  }
+  idle.clear();
+  close(wakePipe[0]);
+  close(wakePipe[1]);
+}
+
+void ShellPool::__wake() {
+  char signal = 0;
+  if (write(wakePipe[1], &signal, 1) == -1)
+    pretty_log("POOL", "Waking the pool thread failed.", ERR);
+}
+
+// Spawns the missing shells, then drains what the idle ones write so the
+// prompt is there on claim. A shell past SHELL_POOL_OUTPUT_LIMIT isn't read
+// any more and blocks until claimed.
+void ShellPool::__pool_thread() {
+  std::vector<struct pollfd> fds;
+  char buffer[4096];
+  while (running) {
+    size_t missing;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      missing = size - idle.size();
+    }
+    for (; missing > 0 && running; missing--) {
+      Pooled_Shell shell;
+      if (!PTYHandler::spawn_shell(shell.masterFd, shell.pid))
+        break; // tried again on the next claim
+      std::lock_guard<std::mutex> lock(mutex);
+      idle.push_back(std::move(shell));
+    }
+    fds.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const Pooled_Shell &shell : idle)
+        if (shell.output.size() < SHELL_POOL_OUTPUT_LIMIT)
+          fds.push_back({shell.masterFd, POLLIN, 0});
+    }
+    fds.push_back({wakePipe[0], POLLIN, 0});
+    if (poll(fds.data(), fds.size(), -1) == -1)
+      continue;
+    if (fds.back().revents & POLLIN &&
+        read(wakePipe[0], buffer, sizeof(buffer)) == -1)
+      pretty_log("POOL", "Reading the wake pipe failed.", ERR);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i + 1 < fds.size(); i++) {
+      if (fds[i].revents == 0)
+        continue;
+      auto shell = std::find_if(idle.begin(), idle.end(),
+                                [&](const Pooled_Shell &shell) {
+                                  return shell.masterFd == fds[i].fd;
+                                });
+      if (shell == idle.end())
+        continue; // claimed since the poll
+      size_t room = SHELL_POOL_OUTPUT_LIMIT - shell->output.size();
+      ssize_t bytes = read(shell->masterFd, buffer,
+                           std::min(room, sizeof(buffer)));
+      if (bytes > 0) {
+        shell->output.append(buffer, bytes);
+        continue;
+      }
+      if (bytes == -1 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      // the shell exited while idle, e.g. its rc file failed; the pool
+      // shrinks instead of respawning it in a loop
+      close(shell->masterFd);
+      waitpid(shell->pid, nullptr, WNOHANG);
+      idle.erase(shell);
+      size--;
+      pretty_log("POOL", "Idle shell exited, keeping " +
+                             std::to_string(size) + " shells.", ERR);
+    }
+  }
+}
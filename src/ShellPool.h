@@ -0,0 +1,41 @@
+#ifndef SHELL_POOL_H
+#define SHELL_POOL_H
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+#define SHELL_POOL_OUTPUT_LIMIT (64 << 10) // kept per idle shell, then unread
+
+typedef struct Pooled_Shell {
+  int masterFd = -1;
+  pid_t pid = -1;
+  std::string output; // written while idle, its prompt among it
+} Pooled_Shell;
+
+// Idle shells spawned ahead of time on PTYs of the default size. A new session
+// claims one and has its prompt right away, however long the rc files take;
+// the pool refills in the background.
+class ShellPool {
+public:
+  static ShellPool *get_instance();
+  ~ShellPool();
+  void start(size_t size);
+  bool claim(Pooled_Shell &shell);
+  void stop();
+
+private:
+  ShellPool();
+  void __pool_thread();
+  void __wake();
+  static ShellPool *instance;
+  size_t size = 0;
+  std::vector<Pooled_Shell> idle; // oldest first
+  std::mutex mutex;
+  int wakePipe[2] = {-1, -1};
+  std::atomic<bool> running = false;
+  std::thread worker;
+};
+#endif // !SHELL_POOL_H
@@ -0,0 +1,34 @@
+#include "StyleTable.h"
+#include <cstdint>
+
+size_t StyleTable::Style_Hash::operator()(const Style &style) const {
+  uint64_t hash = style.fg;
+  hash = hash * 0x9E3779B97F4A7C15ull ^ style.bg;
+  hash = hash * 0x9E3779B97F4A7C15ull ^ style.underlineColor;
+  hash = hash * 0x9E3779B97F4A7C15ull ^ (style.attrs | style.underline << 8);
+  return hash ^ (hash >> 32);
+}
+
+StyleTable::StyleTable() { clear(); }
+
+uint16_t StyleTable::intern(const Style &style) {
+  auto found = index.find(style);
+  if (found != index.end())
+    return found->second;
+  if (styles.size() == MAX_STYLES)
+    return STYLE_DEFAULT;
+  uint16_t id = styles.size();
+  styles.push_back(style);
+  index.emplace(style, id);
+  return id;
+}
+
+const Style &StyleTable::get(uint16_t id) { return styles[id]; }
+
+size_t StyleTable::size() { return styles.size(); }
+
+void StyleTable::clear() {
+  styles.assign(1, Style());
+  index.clear();
+  index.emplace(Style(), STYLE_DEFAULT);
+}
@@ -0,0 +1,67 @@
+#ifndef STYLE_TABLE_H
+#define STYLE_TABLE_H
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Style attribute bits
+#define ATTR_BOLD (1 << 0)
+#define ATTR_DIM (1 << 1)
+#define ATTR_ITALIC (1 << 2)
+#define ATTR_BLINK (1 << 3)
+#define ATTR_REVERSE (1 << 4)
+#define ATTR_HIDDEN (1 << 5)
+#define ATTR_STRIKE (1 << 6)
+
+// Colors are packed as <kind:8><value:24>
+#define COLOR_DEFAULT 0
+#define COLOR_PALETTE(i) ((1u << 24) | (uint32_t)(i))
+#define COLOR_RGB(r, g, b)                                                     \
+  ((2u << 24) | ((uint32_t)(r) << 16) | ((uint32_t)(g) << 8) | (uint32_t)(b))
+#define COLOR_KIND(c) ((c) >> 24)
+
+// id of the default style, always present
+#define STYLE_DEFAULT 0
+#define MAX_STYLES 65536
+
+// SGR 4:n underline styles
+enum Underline_Style : uint8_t {
+  UNDERLINE_NONE,
+  UNDERLINE_SINGLE,
+  UNDERLINE_DOUBLE,
+  UNDERLINE_CURLY,
+  UNDERLINE_DOTTED,
+  UNDERLINE_DASHED,
+};
+
+// Everything SGR sets for the characters printed after it
+typedef struct Style {
+  uint32_t fg = COLOR_DEFAULT;
+  uint32_t bg = COLOR_DEFAULT;
+  uint32_t underlineColor = COLOR_DEFAULT; // COLOR_DEFAULT follows fg
+  uint8_t attrs = 0;
+  uint8_t underline = UNDERLINE_NONE;
+  bool operator==(const Style &other) const = default;
+} Style;
+
+// Hash-consed styles: every distinct Style gets a 16-bit id, so cells carry
+// an id instead of the colors and comparing styles is comparing integers.
+// The table only grows, the owner compacts it when it fills up.
+class StyleTable {
+public:
+  StyleTable();
+  uint16_t intern(const Style &style); // STYLE_DEFAULT once the table is full
+  const Style &get(uint16_t id);
+  size_t size();
+  void clear();
+
+private:
+  typedef struct Style_Hash {
+    size_t operator()(const Style &style) const;
+  } Style_Hash;
+
+  std::vector<Style> styles;
+  std::unordered_map<Style, uint16_t, Style_Hash> index;
+};
+#endif // !STYLE_TABLE_H
@@ -1,57 +1,202 @@
 #include "Terminal.h"
+#include "Config.h"
 #include "EscapeHandler.h"
+#include "Grid.h"
 #include "Helper.h"
+#include "InputQueue.h"
+#include "Latency.h"
+#include "PaneLayout.h"
 #include "PTYHandler.h"
+#include "Session.h"
+#include "SessionManager.h"
+#include "ShellPool.h"
+#include "WindowServer.h"
 #include "imgui.h"
-#include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
+#include "imgui_internal.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <ctime>
+#include <deque>
 #include <iostream>
 #define GL_SILENCE_DEPRECATION
 #include "Logger.h"
 #include <GLFW/glfw3.h> // Will drag system OpenGL headers
 #include <filesystem>
+#include <mutex>
 #include <stdio.h>
 #include <string>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
 // Config definition to be ported in separate config manager
 #define FONT_STEP 0.01
 #define FONT_NAME "Nerd"
+#define FONT_PIXELS 128.0f // atlas size, drawn at FONT_SCALE
+#define FONT_SCALE 0.15f
+#define DEFAULT_COLS PTY_DEFAULT_COLS // until the first frame measures
+#define DEFAULT_ROWS PTY_DEFAULT_ROWS
+#define CHECKPOINT_SCROLLBACK 1000 // scrollback lines kept in a checkpoint
+#define SEEK_STEP 10.0             // seconds per seek key press in replays
+#define RESIZE_DEBOUNCE 0.1 // seconds the window size must hold before resizing
+#define REFLOW_LINES_PER_FRAME 64 // scrollback lines rewrapped in background
+#define REFLOW_LINES_IN_VIEW 4096 // at most, per frame, once scrolled into view
+#define FRAME_INTERVAL (1.0 / 60) // frame pacing without vsync
+#define LOW_LATENCY_MAX_FPS 240   // cap on echo frames in low latency mode
+#define FLOOD_WINDOW 0.1               // seconds the output rate is taken over
+#define FLOOD_BYTES_PER_SECOND (1 << 20) // output rate entering throughput mode
+#define FLOOD_FRAME_INTERVAL 0.08 // seconds between frames in throughput mode
+#define PANE_GAP 2.0f             // pixels between split panes
 // Global helpers
 std::vector<std::string> __find_system_fonts(const std::string &font_name);
 
-static std::string inputBuffer;
-/* static std::string outputBuffer; */
-static PTY_Payload_List *ptyPayload = nullptr;
-static PTY_Payload_List *ptyPayloadTail = nullptr;
-static bool __scroll_down = true;
+static Terminal_Window *__window = nullptr; // drawn or handling a command
+static std::atomic<bool> __echo_arrived = false; // wakes low latency frames
+static std::atomic<uint64_t> __bytes_parsed = 0;
+
+// Input for the render thread, see __post_input()
+static InputQueue __input;
+// Wakes the render thread out of __wait_renderer()
+static std::mutex __render_mutex;
+static std::condition_variable __render_wake;
+static bool __render_woken = false;
+static void __wake_renderer();
+static void __wait_renderer(double timeout);
+
+// ImGui's current context, see ImGuiConfig.h
+thread_local ImGuiContext *ImGuiThreadContext = nullptr;
+
+// Font atlas built by the font worker, swapped in by the render loop
+static ImFontAtlas *__font_atlas = nullptr;
+static std::atomic<bool> __font_atlas_ready = false;
+
+// Startup timeline, ms since the Terminal constructor started
+typedef struct Startup_Mark {
+  std::string name;
+  double ms;
+} Startup_Mark;
+static std::chrono::steady_clock::time_point __startup_begin;
+static std::vector<Startup_Mark> __startup_marks;
+static std::mutex __startup_mutex; // the font worker adds marks too
+static void __startup_mark(const std::string &name);
+static void __load_fonts();
 
 static void glfw_error_callback(int error, const char *description);
 static void glfw_key_callback(GLFWwindow *window, int key, int scancode,
                               int action, int mods);
-static void pty_handler_callback(PTY_Payload_List *payloadList);
-static void escape_sequence_handler_callback(int signal);
+static void glfw_mouse_button_callback(GLFWwindow *window, int button,
+                                       int action, int mods);
+static void glfw_scroll_callback(GLFWwindow *window, double x, double y);
+static void glfw_cursor_pos_callback(GLFWwindow *window, double x, double y);
+static void glfw_cursor_enter_callback(GLFWwindow *window, int entered);
+static void glfw_focus_callback(GLFWwindow *window, int focused);
+static void glfw_window_size_callback(GLFWwindow *window, int width,
+                                      int height);
+static void glfw_framebuffer_size_callback(GLFWwindow *window, int width,
+                                           int height);
+static void pty_handler_callback(Session *session, const char *data,
+                                 size_t size);
+static void pty_exit_callback(Session *session);
+static void remote_update_callback(Session *session, size_t size);
+static void replay_output_callback(const char *data, size_t size);
+static void checkpoint_snapshot_callback(std::string &state);
+static bool checkpoint_restore_callback(const std::string &state);
+static void replay_resize_callback(uint32_t width, uint32_t height);
 
-static void __render_text_to_terminal(PTY_Payload_List *payload);
+static void __render_grid(Session *session);
+static void __render_tabs();
+static float __render_panes(const Pane_Rect &area);
+static void __activate_tab(size_t index);
+static void __focus(Session *session);
+static Session *__active_session();
+static Session *__new_session();
+static bool __close_exited();
+static void __render_hud(const Frame_Stats &frameStats);
+static void __new_platform_frame(Terminal_Window *target);
+static void __run_command(int command);
 Terminal *Terminal::instance = nullptr;
 
+// The shell is spawned first so its startup overlaps ours, fonts are found and
+// rasterized on a worker while GLFW and the GL context come up
 Terminal::Terminal() {
-  pty = PTYHandler::get_instance();
-  if (pty == nullptr)
+  __startup_begin = std::chrono::steady_clock::now();
+  Config *config = Config::get_instance();
+  SessionManager *sessions = SessionManager::get_instance();
+  sessions->set_output_callback(pty_handler_callback);
+  sessions->set_exit_callback(pty_exit_callback);
+  server = config->server;
+  if (server && !WindowServer::get_instance()->start())
     exit(1);
-  // callback registration for output from the pty
-  pty->set_output_callback(pty_handler_callback);
-  if (!init())
+  std::vector<PaneLayout *> tabs;
+  if (!config->replayPath.empty()) {
+    // replaying a recording into a session without a shell
+    replayer = new Replayer(config->replayPath);
+    Session *session =
+        new Session(replayer->get_height(), replayer->get_width(), false);
+    sessions->add_session(session);
+    tabs.push_back(new PaneLayout(session));
+    replayer->set_checkpoints(checkpoint_snapshot_callback,
+                              checkpoint_restore_callback,
+                              config->checkpointBytes,
+                              config->checkpointSeconds, config->replayIndex);
+    replayer->set_resize_callback(replay_resize_callback);
+  } else if (config->attach) {
+    // mirrors of the server's sessions, a tab each
+    client = SessionClient::get_instance();
+    client->set_update_callback(remote_update_callback);
+    if (!client->attach(DEFAULT_ROWS, DEFAULT_COLS)) {
+      pretty_log("TERM", "Can't attach to the session server.", ERR);
+      exit(1);
+    }
+    for (size_t i = 0; i < sessions->get_count(); i++)
+      tabs.push_back(new PaneLayout(sessions->get_session(i)));
+    sessions->set_active(tabs[0]->get_focused());
+  } else {
+    Session *session = new Session(DEFAULT_ROWS, DEFAULT_COLS);
+    __startup_mark("shell spawned");
+    // only the first session is recorded
+    if (!config->recordPath.empty()) {
+      recorder = new Recorder(config->recordPath, DEFAULT_COLS, DEFAULT_ROWS);
+      session->get_pty()->set_recorder(recorder);
+    }
+    sessions->add_session(session);
+    tabs.push_back(new PaneLayout(session));
+  }
+  latencyHud = config->latencyHud;
+  lowLatency = config->lowLatency && !replayer;
+  if (!init() || __open_window(tabs) == nullptr)
     exit(1);
+  if (replayer) {
+    replayer->play(replay_output_callback, config->replayFast);
+    if (config->replaySeek > 0)
+      replayer->seek(config->replaySeek);
+  }
 }
 Terminal::~Terminal() {
-  ImGui_ImplOpenGL3_Shutdown();
-  ImGui_ImplGlfw_Shutdown();
-  ImGui::DestroyContext();
-  glfwDestroyWindow(window);
+  if (fontWorker.joinable()) {
+    fontWorker.join();
+    if (__font_atlas)
+      IM_DELETE(__font_atlas);
+  }
+  // render() returns with every window destroyed
+  if (server)
+    WindowServer::get_instance()->stop();
+  // the server keeps the sessions running
+  if (client)
+    client->detach();
+  SessionManager::get_instance()->stop();
+  ShellPool::get_instance()->stop();
+  delete replayer;
+  delete recorder;
+  if (fontAtlas)
+    IM_DELETE(fontAtlas);
   glfwTerminate();
   if (instance)
     delete instance;
@@ -69,35 +214,149 @@ void Terminal::set_window_dim(uint32_t width, uint32_t height) {
   if (height > 0)
     windowHeight = height;
 }
-PTYHandler *Terminal::get_pty() { return pty; }
-uint32_t Terminal::get_height() { return windowHeight; }
-uint32_t Terminal::get_width() { return windowWidth; }
-GLFWwindow *Terminal::get_window() { return window; }
-float Terminal::get_scroll_pos() { return scrollPos; }
+Replayer *Terminal::get_replayer() { return replayer; }
+SessionClient *Terminal::get_client() { return client; }
+// Render thread: the window drawn or handling a command, the size of new
+// windows between frames
+uint32_t Terminal::get_height() {
+  return __window ? __window->height : windowHeight;
+}
+uint32_t Terminal::get_width() {
+  return __window ? __window->width : windowWidth;
+}
+GLFWwindow *Terminal::get_window() {
+  return __window ? __window->window : nullptr;
+}
+float Terminal::get_scroll_pos() { return __window ? __window->scrollPos : 0; }
 bool Terminal::init() {
+  fontWorker = std::thread(__load_fonts);
 
+  glfwSetErrorCallback(glfw_error_callback);
   if (!glfwInit())
     return false;
+  __startup_mark("glfw initialized");
 
-  const char *glsl_version = "#version 130";
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
   glfwWindowHint(GLFW_DECORATED, GLFW_TRUE); // Keep window decorations
   glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
-  window =
+  return true;
+}
+
+// Event thread: a window and its GL context, handed to the render thread
+// with its tabs. A --client's window comes with its request and no tab, the
+// render thread opens its session.
+Terminal_Window *Terminal::__open_window(const std::vector<PaneLayout *> &tabs,
+                                         int requestFd) {
+  GLFWwindow *handle =
       glfwCreateWindow(windowWidth, windowHeight, "Terminal", nullptr, nullptr);
-  if (window == nullptr)
-    return false;
-  glfwMakeContextCurrent(window);
-  glfwSwapInterval(1); // Enable vsync
+  if (handle == nullptr)
+    return nullptr;
+  Terminal_Window *target = new Terminal_Window();
+  target->window = handle;
+  target->tabs = tabs;
+  target->requestFd = requestFd;
+  glfwSetWindowUserPointer(handle, target);
+  if (startupPending)
+    __startup_mark("window and GL context");
+  int width, height;
+  glfwGetWindowSize(handle, &width, &height);
+  target->windowWidth = width;
+  target->windowHeight = height;
+  glfwGetFramebufferSize(handle, &width, &height);
+  target->framebufferWidth = width;
+  target->framebufferHeight = height;
 
-  // Setting Callbacks
-  glfwSetErrorCallback(glfw_error_callback);
-  glfwSetKeyCallback(window, glfw_key_callback);
-  glfwSetInputMode(window, GLFW_LOCK_KEY_MODS,
+  // Setting Callbacks: ImGui's GLFW backend would hand the events to the
+  // current context, which lives on the render thread
+  glfwSetKeyCallback(handle, glfw_key_callback);
+  glfwSetMouseButtonCallback(handle, glfw_mouse_button_callback);
+  glfwSetScrollCallback(handle, glfw_scroll_callback);
+  glfwSetCursorPosCallback(handle, glfw_cursor_pos_callback);
+  glfwSetCursorEnterCallback(handle, glfw_cursor_enter_callback);
+  glfwSetWindowFocusCallback(handle, glfw_focus_callback);
+  glfwSetWindowSizeCallback(handle, glfw_window_size_callback);
+  glfwSetFramebufferSizeCallback(handle, glfw_framebuffer_size_callback);
+  glfwSetInputMode(handle, GLFW_LOCK_KEY_MODS,
                    GLFW_TRUE); // Enable caps on detection
+  {
+    std::lock_guard<std::mutex> lock(handoffMutex);
+    opened.push_back(target);
+  }
+  __wake_renderer();
+  return target;
+}
+
+// Event thread: the windows the render thread gave up. Their callbacks
+// stop with glfwDestroyWindow(), only then the rest goes.
+void Terminal::__destroy_released() {
+  std::vector<Terminal_Window *> destroyed;
+  {
+    std::lock_guard<std::mutex> lock(handoffMutex);
+    destroyed.swap(released);
+  }
+  for (Terminal_Window *target : destroyed) {
+    glfwDestroyWindow(target->window);
+    // a client whose window never came up gets no answer
+    if (target->requestFd >= 0)
+      close(target->requestFd);
+    delete target;
+  }
+}
+
+// --client requests: a window each with a new session. The client is
+// answered once the window's first frame is up.
+void Terminal::__serve_window_requests() {
+  if (!server)
+    return;
+  for (int fd : WindowServer::get_instance()->take_requests()) {
+    if (__open_window({}, fd) == nullptr) {
+      pretty_log("TERM", "Can't open a window for a client.", ERR);
+      close(fd);
+    }
+  }
+}
+
+// Render thread: takes over the windows the event thread opened. A client's
+// window gets its session here, sessions are opened and closed on this
+// thread only.
+void Terminal::__adopt_windows() {
+  std::vector<Terminal_Window *> adopted;
+  {
+    std::lock_guard<std::mutex> lock(handoffMutex);
+    adopted.swap(opened);
+  }
+  for (Terminal_Window *target : adopted) {
+    if (target->tabs.empty()) {
+      Session *session;
+      try {
+        session = new Session(DEFAULT_ROWS, DEFAULT_COLS);
+      } catch (const char *error) {
+        pretty_log("TERM", error, ERR);
+        __release_window(target);
+        continue;
+      }
+      SessionManager::get_instance()->add_session(session);
+      target->tabs.push_back(new PaneLayout(session));
+    }
+    __init_window(target);
+    __activate_tab(target->activeTab);
+  }
+}
+
+// Render thread: the window's ImGui context and the GL state of its backend,
+// its GL context stays current on this thread. Once the font atlas is
+// loaded every window shares it, a new window only uploads its texture.
+void Terminal::__init_window(Terminal_Window *target) {
+  const char *glsl_version = "#version 130";
+  glfwMakeContextCurrent(target->window);
+  // low latency mode paces itself, an echo doesn't wait for the next vblank;
+  // otherwise the first window's vblank paces the loop
+  target->vsync = !lowLatency && windows.empty();
+  glfwSwapInterval(target->vsync ? 1 : 0);
   IMGUI_CHECKVERSION();
-  ImGui::CreateContext();
+  target->context = ImGui::CreateContext(fontAtlas);
+  ImGui::SetCurrentContext(target->context);
   ImGuiIO &io = ImGui::GetIO();
   (void)io;
 
@@ -110,16 +369,6 @@ bool Terminal::init() {
   style.FrameRounding = 5.0f;         // Round frame corners
   style.ItemSpacing = ImVec2(10, 10); // Spacing between items
 
-  // Font customisation
-  std::vector<std::string> fontFile = __find_system_fonts(FONT_NAME);
-  if (!fontFile.empty()) {
-    ImGuiIO &io = ImGui::GetIO();
-    io.Fonts->AddFontFromFileTTF(fontFile[0].c_str(), 128.0f);
-    set_font_size(0.15f);
-    pretty_log("FONT", "Font loaded correctly.");
-  } else {
-    pretty_log("FONT", "Specified font not found.", ERR);
-  }
   // Customize colors
   style.Colors[ImGuiCol_WindowBg] =
       ImVec4(0.1f, 0.1f, 0.15f, 1.00f); // Dark background
@@ -135,58 +384,462 @@ bool Terminal::init() {
 
   /*---------- Hard Code Style Region End-----------------*/
 
-  // Setup Platform/Renderer backends
-  ImGui_ImplGlfw_InitForOpenGL(window, true);
+  // Setup Renderer backend, the platform side is __new_platform_frame()
   ImGui_ImplOpenGL3_Init(glsl_version);
+  if (startupPending)
+    __startup_mark("imgui initialized");
+
+  windows.push_back(target);
+  __window = target;
+  if (fontAtlas)
+    set_font_size(FONT_SCALE);
+}
+
+// Render thread: gives the window back to the event thread for
+// destruction. The window's tabs go with it, its sessions are the caller's.
+void Terminal::__release_window(Terminal_Window *target) {
+  for (PaneLayout *tab : target->tabs)
+    delete tab;
+  target->tabs.clear();
+  target->focused = nullptr;
+  if (target->context) {
+    glfwMakeContextCurrent(target->window);
+    ImGui::SetCurrentContext(target->context);
+    ImGui_ImplOpenGL3_Shutdown();
+    ImGui::DestroyContext(target->context);
+    target->context = nullptr;
+  }
+  // GLFW destroys no window whose context is current on another thread
+  glfwMakeContextCurrent(nullptr);
+  if (__window == target)
+    __window = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(handoffMutex);
+    released.push_back(target);
+  }
+  glfwPostEmptyEvent();
+}
+
+// Drops the panes whose shell exited in every window, then the windows left
+// without a tab. A --server hangs up the shells of the windows the user
+// closed and stays up without windows; otherwise closing the window ends the
+// loop. Returns false once the loop ends.
+bool Terminal::__close_windows() {
+  static std::vector<Session *> tabSessions;
+  for (Terminal_Window *target : windows) {
+    if (!glfwWindowShouldClose(target->window))
+      continue;
+    if (!server)
+      return false;
+    tabSessions.clear();
+    for (PaneLayout *tab : target->tabs)
+      tab->get_sessions(tabSessions);
+    for (Session *session : tabSessions)
+      session->set_exited();
+  }
+  for (Terminal_Window *target : windows) {
+    __window = target;
+    __close_exited();
+  }
+  SessionManager::get_instance()->remove_exited();
+  bool closed = false;
+  for (size_t i = 0; i < windows.size();) {
+    if (!windows[i]->tabs.empty()) {
+      i++;
+      continue;
+    }
+    __release_window(windows[i]);
+    windows.erase(windows.begin() + i);
+    closed = true;
+  }
+  if (windows.empty())
+    return server;
+  __window = windows.front();
+  if (closed)
+    __activate_tab(__window->activeTab);
+  return true;
+}
+
+
+// Font worker: finds the font and rasterizes its atlas. It has no current
+// ImGui context, the atlas is the only ImGui state it touches.
+void __load_fonts() {
+  std::vector<std::string> fontFile = __find_system_fonts(FONT_NAME);
+  __startup_mark("fonts found");
+  ImFontAtlas *atlas = nullptr;
+  if (!fontFile.empty()) {
+    atlas = IM_NEW(ImFontAtlas)();
+    if (atlas->AddFontFromFileTTF(fontFile[0].c_str(), FONT_PIXELS)) {
+      unsigned char *pixels;
+      int width, height;
+      atlas->GetTexDataAsRGBA32(&pixels, &width, &height);
+      __startup_mark("atlas rasterized");
+    } else {
+      IM_DELETE(atlas);
+      atlas = nullptr;
+    }
+  }
+  __font_atlas = atlas;
+  __font_atlas_ready = true;
+}
+
+// Between frames, replaces ImGui's default font with the worker's atlas in
+// every window, the windows opened later are created with it
+void Terminal::__swap_font_atlas() {
+  if (!fontWorker.joinable() || !__font_atlas_ready)
+    return;
+  fontWorker.join();
+  if (__font_atlas == nullptr) {
+    pretty_log("FONT", "Specified font not found.", ERR);
+  } else {
+    fontAtlas = __font_atlas; // the process's from here on
+    for (Terminal_Window *target : windows) {
+      __window = target;
+      glfwMakeContextCurrent(target->window);
+      ImGui::SetCurrentContext(target->context);
+      ImGuiIO &io = ImGui::GetIO();
+      ImGui_ImplOpenGL3_DestroyFontsTexture();
+      IM_DELETE(io.Fonts);
+      io.Fonts = fontAtlas;
+      ImGui::GetCurrentContext()->FontAtlasOwnedByContext = false;
+      ImGui_ImplOpenGL3_CreateFontsTexture();
+      target->fontTexture = io.Fonts->TexID;
+      set_font_size(FONT_SCALE);
+    }
+    pretty_log("FONT", "Font loaded correctly.");
+  }
+  __startup_mark("atlas swapped in");
+}
+
+void __startup_mark(const std::string &name) {
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - __startup_begin)
+                  .count();
+  std::lock_guard<std::mutex> lock(__startup_mutex);
+  __startup_marks.push_back({name, ms});
+}
+
+// Logged once the first frame is up and the font is in
+void Terminal::__print_startup_timeline() {
+  std::lock_guard<std::mutex> lock(__startup_mutex);
+  Session *first = SessionManager::get_instance()->get_session(0);
+  double firstOutput = first != nullptr && first->get_pty() != nullptr
+                           ? first->get_pty()->get_first_output_ms()
+                           : -1;
+  if (firstOutput >= 0 && !__startup_marks.empty() &&
+      __startup_marks.front().name == "shell spawned")
+    __startup_marks.push_back(
+        {"first shell output", __startup_marks.front().ms + firstOutput});
+  std::stable_sort(
+      __startup_marks.begin(), __startup_marks.end(),
+      [](const Startup_Mark &a, const Startup_Mark &b) { return a.ms < b.ms; });
+  char line[96];
+  for (const Startup_Mark &mark : __startup_marks) {
+    snprintf(line, sizeof(line), "%8.2f ms  %s", mark.ms, mark.name.c_str());
+    pretty_log("STARTUP", line);
+  }
+}
 
+// From any thread: output to present, input, a window to adopt or size
+void __wake_renderer() {
+  {
+    std::lock_guard<std::mutex> lock(__render_mutex);
+    __render_woken = true;
+  }
+  __render_wake.notify_one();
+}
+
+// Render thread: sleeps until woken or for timeout seconds, negative waits
+// for a wake only
+void __wait_renderer(double timeout) {
+  std::unique_lock<std::mutex> lock(__render_mutex);
+  if (timeout < 0)
+    __render_wake.wait(lock, [] { return __render_woken; });
+  else
+    __render_wake.wait_for(lock, std::chrono::duration<double>(timeout),
+                           [] { return __render_woken; });
+  __render_woken = false;
+}
+
+// Low latency pacing: frames at FRAME_INTERVAL while idle or flooded with
+// output, but one as soon as a key echo lands (at most LOW_LATENCY_MAX_FPS)
+void Terminal::__wait_for_frame() {
+  double due = lastFrame + FRAME_INTERVAL;
+  for (double now = glfwGetTime(); now < due && !__echo_arrived;
+       now = glfwGetTime())
+    __wait_renderer(due - now);
+  double earliest = lastFrame + 1.0 / LOW_LATENCY_MAX_FPS;
+  double now = glfwGetTime();
+  if (now < earliest)
+    std::this_thread::sleep_for(std::chrono::duration<double>(earliest - now));
+  __echo_arrived = false;
+  lastFrame = glfwGetTime();
+}
+
+// Throughput mode: while the PTY output rate stays above
+// FLOOD_BYTES_PER_SECOND the intermediate screens aren't worth drawing, frames
+// are only presented every FLOOD_FRAME_INTERVAL and the parser has the grid
+// to itself in between. The mode ends once the rate drops below a quarter of
+// the threshold.
+//
+// Synchronized updates hold back only their own pane, see __render_grid().
+bool Terminal::__skip_frame() {
+  double now = glfwGetTime();
+  uint64_t bytes = __bytes_parsed;
+  if (now - rateStart >= FLOOD_WINDOW) {
+    double rate = (bytes - rateBytes) / (now - rateStart);
+    bool flood = frameStats.flooding ? rate > FLOOD_BYTES_PER_SECOND / 4
+                                     : rate > FLOOD_BYTES_PER_SECOND;
+    if (flood != frameStats.flooding)
+      pretty_log("TERM", std::string(flood ? "Entering" : "Leaving") +
+                             " throughput mode, " +
+                             std::to_string(frameStats.skipped) +
+                             " frames skipped so far.");
+    frameStats.flooding = flood;
+    rateStart = now;
+    rateBytes = bytes;
+  }
+  if (!frameStats.flooding || now - lastPresent >= FLOOD_FRAME_INTERVAL)
+    return false;
+  // keys don't wait for frames, Ctrl-C gets through anyway
+  __wait_renderer(
+      std::min(FRAME_INTERVAL, lastPresent + FLOOD_FRAME_INTERVAL - now));
+  frameStats.skipped++;
   return true;
 }
 
 void Terminal::stop() { running = false; }
 
 bool Terminal::is_running() { return running; }
+// Of the current window
 void Terminal::set_font_size(float size) {
   ImGui::GetIO().FontGlobalScale = size;
-  fontSize = size;
+  __window->fontSize = size;
+}
+
+float Terminal::get_font_size() { return __window->fontSize; }
+void Terminal::toggle_latency_hud() { latencyHud = !latencyHud; }
+
+// Ctrl+Shift+T: a new tab, on an idle shell from the pool when there is one
+void Terminal::new_tab() {
+  Session *session = __new_session();
+  if (session == nullptr)
+    return;
+  __window->tabs.push_back(new PaneLayout(session));
+  __activate_tab(__window->tabs.size() - 1);
 }
 
-float Terminal::get_font_size() { return fontSize; }
+// Ctrl+Shift+E splits the focused pane side by side, Ctrl+Shift+O stacked.
+// The new pane gets a new session and the focus.
+void Terminal::split_pane(Split_Direction direction) {
+  Session *session = __new_session();
+  if (session == nullptr)
+    return;
+  __window->tabs[__window->activeTab]->split(direction, session);
+  __focus(session);
+}
 
+// Ctrl+Shift+W: hangs up the focused pane's shell, the pane closes with the
+// next frame and the tab with its last pane
+void Terminal::close_pane() {
+  Session *session = __active_session();
+  if (session == nullptr)
+    return;
+  if (client)
+    client->close(session);
+  else if (!replayer)
+    session->set_exited();
+}
+
+// Ctrl+Tab/Ctrl+Shift+Tab: the next or previous pane of the tab
+void Terminal::focus_pane(int step) {
+  PaneLayout *tab = __window->tabs[__window->activeTab];
+  tab->focus_next(step);
+  __focus(tab->get_focused());
+}
+
+// Ctrl+PageDown/PageUp: the next or previous tab
+void Terminal::select_tab(int step) {
+  size_t count = __window->tabs.size();
+  __activate_tab((__window->activeTab + count + step % (int)count) % count);
+}
+
+// The calling (main) thread handles the GLFW events from here on: keys go
+// to the PTYs right away, the other input is queued for the render thread,
+// which draws every window. Windows are created and destroyed here, GLFW
+// wants them on the main thread.
 void Terminal::render() {
+  renderer = std::thread(&Terminal::__render_thread, this);
+  while (rendering) {
+    glfwWaitEvents();
+    __destroy_released();
+    __serve_window_requests();
+  }
+  renderer.join();
+  __destroy_released();
+  if (!Config::get_instance()->latencyPath.empty())
+    LatencyTracker::get_instance()->export_json(
+        Config::get_instance()->latencyPath);
+  // flush what is left of the recording before the process goes away
+  if (recorder)
+    recorder->close();
+  if (replayer)
+    replayer->stop();
+  if (server)
+    WindowServer::get_instance()->stop();
+}
 
-  // Main loop
-  while (running && !glfwWindowShouldClose(window)) {
-    glfwPollEvents();
-    glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
-    glViewport(0, 0, windowWidth, windowHeight);
-    glClearColor(0.0f, 0.0f, 0.0f, 1.00f); // Background color
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    ImGui_ImplOpenGL3_NewFrame();
-    ImGui_ImplGlfw_NewFrame();
-    ImGui::NewFrame();
-    ImGui::SetNextWindowSize(ImVec2(windowWidth, windowHeight));
-    ImGui::SetNextWindowPos(ImVec2(0, 0));
-    ImGui::Begin("##", nullptr,
-                 ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse |
-                     ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoTitleBar);
-    ImGui::PushTextWrapPos(ImGui::GetContentRegionAvail().x);
-    __render_text_to_terminal(ptyPayload);
-
-    ImGui::PopTextWrapPos();
-    if (__scroll_down) {
-      ImGui::SetScrollHereY(1.0f);
-      __scroll_down = false;
+// Render thread: the windows' frames, a slow one keeps no key from its PTY.
+// Returns once the loop ended, the windows given back to the event thread.
+void Terminal::__render_thread() {
+  while (running) {
+    __adopt_windows();
+    __drain_input();
+    // panes whose shell exited close, a window with its last one
+    if (!__close_windows())
+      break;
+    __swap_font_atlas();
+    if (windows.empty()) {
+      __wait_renderer(-1); // a server waits for the next client
+      continue;
+    }
+    if (__skip_frame())
+      continue;
+    for (Terminal_Window *target : windows)
+      __render_window(target);
+    LatencyTracker::get_instance()->frame_presented();
+    lastPresent = glfwGetTime();
+    uint64_t bytes = __bytes_parsed;
+    frameStats.lastBytes = bytes - frameStats.totalBytes;
+    frameStats.totalBytes = bytes;
+    frameStats.presented++;
+    if (frameStats.presented == 1) {
+      __startup_mark("first frame");
+      // spawned once this shell and the window are up, not competing with
+      // them
+      if (!replayer && !client)
+        ShellPool::get_instance()->start(Config::get_instance()->shellPool);
+    }
+    if (startupPending && !fontWorker.joinable()) {
+      startupPending = false;
+      if (Config::get_instance()->startupTimeline)
+        __print_startup_timeline();
     }
-    scrollPos = ImGui::GetScrollY();
-    ImGui::End();
-    ImGui::Render();
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    if (lowLatency)
+      __wait_for_frame();
+  }
+  for (Terminal_Window *target : windows)
+    __release_window(target);
+  windows.clear();
+  rendering = false;
+  glfwPostEmptyEvent();
+}
 
-    glfwSwapBuffers(window);
+// Render thread: hands the queued input to the windows' ImGui contexts and
+// runs the commands bound to keys. Events of windows closed meanwhile, or
+// not adopted yet, are dropped.
+void Terminal::__drain_input() {
+  Input_Event event;
+  while (__input.pop(event)) {
+    if (std::find(windows.begin(), windows.end(), event.window) ==
+        windows.end())
+      continue;
+    __window = event.window;
+    ImGui::SetCurrentContext(__window->context);
+    ImGuiIO &io = ImGui::GetIO();
+    switch (event.kind) {
+    case INPUT_MOUSE_POS:
+      io.AddMousePosEvent(event.x, event.y);
+      break;
+    case INPUT_MOUSE_BUTTON:
+      if (event.code >= 0 && event.code < ImGuiMouseButton_COUNT)
+        io.AddMouseButtonEvent(event.code, event.down);
+      break;
+    case INPUT_SCROLL:
+      io.AddMouseWheelEvent(event.x, event.y);
+      break;
+    case INPUT_FOCUS:
+      io.AddFocusEvent(event.down);
+      // the focused window's pane takes the keys
+      if (event.down && !__window->tabs.empty())
+        __focus(__window->tabs[__window->activeTab]->get_focused());
+      break;
+    case INPUT_COMMAND:
+      __run_command(event.code);
+      break;
+    }
   }
 }
 
+// One frame of the window, its GL and ImGui contexts made current
+void Terminal::__render_window(Terminal_Window *target) {
+  __window = target;
+  glfwMakeContextCurrent(target->window);
+  ImGui::SetCurrentContext(target->context);
+  // one vblank wait per loop, not one per window
+  bool vsync = !lowLatency && target == windows.front();
+  if (vsync != target->vsync) {
+    glfwSwapInterval(vsync ? 1 : 0);
+    target->vsync = vsync;
+  }
+  target->width = target->framebufferWidth;
+  target->height = target->framebufferHeight;
+  glViewport(0, 0, target->width, target->height);
+  glClearColor(0.0f, 0.0f, 0.0f, 1.00f); // Background color
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  // the shared atlas draws with this context's texture
+  ImGuiIO &io = ImGui::GetIO();
+  if (target->fontTexture)
+    io.Fonts->SetTexID(target->fontTexture);
+  ImGui_ImplOpenGL3_NewFrame();
+  target->fontTexture = io.Fonts->TexID;
+  __new_platform_frame(target);
+  ImGui::NewFrame();
+  ImGui::SetNextWindowSize(ImVec2(target->width, target->height));
+  ImGui::SetNextWindowPos(ImVec2(0, 0));
+  ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
+  ImGui::Begin("##", nullptr,
+               ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse |
+                   ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoTitleBar |
+                   ImGuiWindowFlags_NoScrollbar |
+                   ImGuiWindowFlags_NoScrollWithMouse);
+  ImGui::PopStyleVar();
+  __render_tabs();
+  ImVec2 origin = ImGui::GetCursorPos();
+  ImVec2 area = ImGui::GetContentRegionAvail();
+  target->scrollPos = __render_panes({origin.x, origin.y, area.x, area.y});
+  ImGui::End();
+  if (latencyHud)
+    __render_hud(frameStats);
+  ImGui::Render();
+  ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+
+  glfwSwapBuffers(target->window);
+  if (!target->presented) {
+    target->presented = true;
+    if (target->requestFd >= 0)
+      WindowServer::get_instance()->opened(target->requestFd);
+    target->requestFd = -1;
+  }
+}
+
+// What ImGui's GLFW backend does each frame, from the sizes the event
+// thread stored: GLFW answers window queries on the main thread only
+void __new_platform_frame(Terminal_Window *target) {
+  ImGuiIO &io = ImGui::GetIO();
+  int width = target->windowWidth, height = target->windowHeight;
+  io.DisplaySize = ImVec2(width, height);
+  if (width > 0 && height > 0)
+    io.DisplayFramebufferScale = ImVec2((float)target->width / width,
+                                        (float)target->height / height);
+  double now = glfwGetTime();
+  io.DeltaTime = target->lastTime > 0.0 && now > target->lastTime
+                     ? (float)(now - target->lastTime)
+                     : (float)FRAME_INTERVAL;
+  target->lastTime = now;
+}
+
 void glfw_error_callback(int error, const char *description) {
   fprintf(stderr, "GLFW Error %d: %s\n", error, description);
 }
@@ -195,165 +848,376 @@ void glfw_error_callback(int error, const char *description) {
  * Keyboard handling section below
  */
 
-void __handle_key_up(int key, int mods);
-void __handle_key_down(int key, int mods);
-void __handle_key_held_down(int key, int mods);
+void __handle_key_up(Terminal_Window *target, int key, int mods);
+void __handle_key_down(Terminal_Window *target, int key, int mods);
+void __handle_key_held_down(Terminal_Window *target, int key, int mods);
 
-void glfw_key_callback(GLFWwindow *window, int key, int scancode, int action,
-                       int mods) {
-  if (action == GLFW_PRESS) {
-    __handle_key_down(key, mods);
-  } else if (action == GLFW_RELEASE) {
-    __handle_key_up(key, mods);
-  } else if (action == GLFW_REPEAT) {
-    __handle_key_held_down(key, mods);
-  }
+// GLFW calls back on the event thread. The ImGui contexts are the render
+// thread's, the events reach them through the input queue.
+static void __post_input(const Input_Event &event) {
+  if (!__input.push(event))
+    pretty_log("TERM", "Input queue full, event dropped.", ERR);
+  __wake_renderer();
 }
-// Action Key section started
-void handle_enter_key(int key, int mods) {
-  if (GLFW_MOD_SHIFT & mods) {
-    inputBuffer += '\n';
-  } else {
-    PTYHandler *pty = Terminal::get_instance()->get_pty();
-    if (pty)
-      pty->send(inputBuffer + '\n');
-    inputBuffer.erase();
-  }
+
+static Terminal_Window *__event_window(GLFWwindow *window) {
+  return (Terminal_Window *)glfwGetWindowUserPointer(window);
 }
-// Action Key section ended
 
-// Symbol section started
-static std::unordered_map<int, char> __valid_symbols = {
-    {39, '\''}, {44, ','}, {45, '-'},  {46, '.'}, {47, '/'}, {59, ';'},
-    {61, '='},  {91, '['}, {92, '\\'}, {93, ']'}, {96, '`'}};
+void glfw_mouse_button_callback(GLFWwindow *window, int button, int action,
+                                int mods) {
+  __post_input({INPUT_MOUSE_BUTTON, __event_window(window), button,
+                action == GLFW_PRESS});
+}
 
-static std::unordered_map<char, char> __valid_symbols_shift = {
-    {'\'', '"'}, {',', '<'}, {'-', '_'},  {'.', '>'}, {'/', '?'}, {';', ':'},
-    {'=', '+'},  {'[', '{'}, {'\\', '|'}, {']', '}'}, {'`', '~'}};
+void glfw_scroll_callback(GLFWwindow *window, double x, double y) {
+  __post_input(
+      {INPUT_SCROLL, __event_window(window), 0, false, (float)x, (float)y});
+}
 
-bool __is_symbol(int key) {
-  for (std::pair<int, char> p : __valid_symbols) {
-    if (p.first == key)
-      return true;
-  }
-  return false;
+void glfw_cursor_pos_callback(GLFWwindow *window, double x, double y) {
+  __post_input(
+      {INPUT_MOUSE_POS, __event_window(window), 0, false, (float)x, (float)y});
 }
 
-char __get_adapted_symbol(int key, int mods) {
-  if (!__is_symbol(key))
-    throw "Key should be a symbol.";
-  if (mods & GLFW_MOD_SHIFT) {
-    return __valid_symbols_shift[__valid_symbols[key]];
-  } else {
-    return __valid_symbols[key];
-  }
+void glfw_cursor_enter_callback(GLFWwindow *window, int entered) {
+  if (!entered)
+    __post_input({INPUT_MOUSE_POS, __event_window(window), 0, false, -FLT_MAX,
+                  -FLT_MAX});
 }
-// Symbol section ended
 
-// Number section started
-static std::unordered_map<char, char> __valid_number_shift = {
-    {'0', ')'}, {'1', '!'}, {'2', '@'}, {'3', '#'}, {'4', '$'},
-    {'5', '%'}, {'6', '^'}, {'7', '&'}, {'8', '*'}, {'9', '('}};
+void glfw_focus_callback(GLFWwindow *window, int focused) {
+  __post_input({INPUT_FOCUS, __event_window(window), 0, focused != 0});
+}
 
-bool __is_number(int key) { return key <= (int)'9' && key >= (int)'0'; }
+// The sizes the next frame of the window takes
+void glfw_window_size_callback(GLFWwindow *window, int width, int height) {
+  Terminal_Window *target = __event_window(window);
+  target->windowWidth = width;
+  target->windowHeight = height;
+  __wake_renderer();
+}
 
-char __get_adapted_number(int key, int mods) {
-  if (!__is_number(key))
-    throw "Key should be a number.";
-  if (mods & GLFW_MOD_SHIFT) {
-    return __valid_number_shift[(char)key];
-  } else {
-    return (char)key;
+void glfw_framebuffer_size_callback(GLFWwindow *window, int width,
+                                    int height) {
+  Terminal_Window *target = __event_window(window);
+  target->framebufferWidth = width;
+  target->framebufferHeight = height;
+  __wake_renderer();
+}
+
+void glfw_key_callback(GLFWwindow *window, int key, int scancode, int action,
+                       int mods) {
+  Terminal_Window *target = __event_window(window);
+  if (action == GLFW_PRESS) {
+    __handle_key_down(target, key, mods);
+  } else if (action == GLFW_RELEASE) {
+    __handle_key_up(target, key, mods);
+  } else if (action == GLFW_REPEAT) {
+    __handle_key_held_down(target, key, mods);
   }
 }
-// Number section ended
+// Keys with text: GLFW codes the printable keys by their US layout ASCII
+// character
+typedef struct Key_Text {
+  char normal;
+  char shifted;
+} Key_Text;
 
-// Alphabet section start
-bool __is_alpha(int key) {
-  return (key >= (int)'A' && key <= (int)'Z') || (key >= 'a' && key <= 'z');
+static constexpr std::array<Key_Text, 128> __build_key_text() {
+  std::array<Key_Text, 128> text{};
+  const char *symbols = "'\",<-_.>/?;:=+[{\\|]}`~  ";
+  for (const char *c = symbols; *c; c += 2)
+    text[(unsigned char)c[0]] = {c[0], c[1]};
+  const char *digits = ")!@#$%^&*(";
+  for (int i = 0; i < 10; i++)
+    text['0' + i] = {(char)('0' + i), digits[i]};
+  for (char c = 'A'; c <= 'Z'; c++)
+    text[(unsigned char)c] = {(char)(c - 'A' + 'a'), c};
+  return text;
 }
+static constexpr std::array<Key_Text, 128> __key_text = __build_key_text();
 
-char __alpha_lower(char c) {
-  if (!__is_alpha((int)c))
-    throw "Key should be alphabet.";
-  if (c <= 'Z')
-    return c - 'A' + 'a';
-  else
-    return c;
+// Keys sending escape sequences, indexed from GLFW_KEY_ESCAPE
+enum Key_Kind : uint8_t {
+  KEY_NONE,
+  KEY_CURSOR, // CSI <final>, SS3 <final> in application cursor mode
+  KEY_SS3,    // SS3 <final>
+  KEY_TILDE,  // CSI <number> ~
+  KEY_KEYPAD, // its text, SS3 <final> in application keypad mode
+};
+
+typedef struct Key_Sequence {
+  Key_Kind kind;
+  char final;
+  uint8_t number;
+  char text; // keypad keys outside application mode
+} Key_Sequence;
+
+#define KEY_SEQUENCES (GLFW_KEY_LAST - GLFW_KEY_ESCAPE + 1)
+
+static constexpr std::array<Key_Sequence, KEY_SEQUENCES>
+__build_key_sequences() {
+  std::array<Key_Sequence, KEY_SEQUENCES> keys{};
+  auto set = [&keys](int key, Key_Kind kind, char final, uint8_t number = 0,
+                     char text = 0) {
+    keys[key - GLFW_KEY_ESCAPE] = {kind, final, number, text};
+  };
+  set(GLFW_KEY_UP, KEY_CURSOR, 'A');
+  set(GLFW_KEY_DOWN, KEY_CURSOR, 'B');
+  set(GLFW_KEY_RIGHT, KEY_CURSOR, 'C');
+  set(GLFW_KEY_LEFT, KEY_CURSOR, 'D');
+  set(GLFW_KEY_HOME, KEY_CURSOR, 'H');
+  set(GLFW_KEY_END, KEY_CURSOR, 'F');
+  set(GLFW_KEY_INSERT, KEY_TILDE, '~', 2);
+  set(GLFW_KEY_DELETE, KEY_TILDE, '~', 3);
+  set(GLFW_KEY_PAGE_UP, KEY_TILDE, '~', 5);
+  set(GLFW_KEY_PAGE_DOWN, KEY_TILDE, '~', 6);
+  set(GLFW_KEY_F1, KEY_SS3, 'P');
+  set(GLFW_KEY_F2, KEY_SS3, 'Q');
+  set(GLFW_KEY_F3, KEY_SS3, 'R');
+  set(GLFW_KEY_F4, KEY_SS3, 'S');
+  const uint8_t function[] = {15, 17, 18, 19, 20, 21, 23, 24,
+                              25, 26, 28, 29, 31, 32, 33, 34};
+  for (int i = 0; i < 16; i++)
+    set(GLFW_KEY_F5 + i, KEY_TILDE, '~', function[i]);
+  for (int i = 0; i < 10; i++)
+    set(GLFW_KEY_KP_0 + i, KEY_KEYPAD, 'p' + i, 0, '0' + i);
+  set(GLFW_KEY_KP_DECIMAL, KEY_KEYPAD, 'n', 0, '.');
+  set(GLFW_KEY_KP_DIVIDE, KEY_KEYPAD, 'o', 0, '/');
+  set(GLFW_KEY_KP_MULTIPLY, KEY_KEYPAD, 'j', 0, '*');
+  set(GLFW_KEY_KP_SUBTRACT, KEY_KEYPAD, 'm', 0, '-');
+  set(GLFW_KEY_KP_ADD, KEY_KEYPAD, 'k', 0, '+');
+  set(GLFW_KEY_KP_ENTER, KEY_KEYPAD, 'M', 0, '\r');
+  set(GLFW_KEY_KP_EQUAL, KEY_KEYPAD, 'X', 0, '=');
+  return keys;
 }
+static constexpr std::array<Key_Sequence, KEY_SEQUENCES> __key_sequences =
+    __build_key_sequences();
 
-char __alpha_upper(char c) {
-  if (!__is_alpha((int)c))
-    throw "Key should be alphabet.";
-  if (c >= 'a')
-    return c - 'a' + 'A';
-  else
+// xterm modifier parameter, 1 is no modifier
+static int __modifier_param(int mods) {
+  return 1 + (mods & GLFW_MOD_SHIFT ? 1 : 0) + (mods & GLFW_MOD_ALT ? 2 : 0) +
+         (mods & GLFW_MOD_CONTROL ? 4 : 0);
+}
+
+// Control character Ctrl sends with c, c itself when there is none
+static char __control_char(char c) {
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 1;
+  if (c >= '@' && c <= '_')
+    return c - '@';
+  switch (c) {
+  case ' ':
+  case '2':
+    return 0;
+  case '3':
+  case '4':
+  case '5':
+  case '6':
+  case '7':
+    return c - '3' + 0x1b;
+  case '8':
+  case '?':
+    return 0x7f;
+  case '/':
+    return 0x1f;
+  default:
     return c;
+  }
 }
 
-char __get_adapted_alpha(int key, int mods) {
-  if (!__is_alpha(key))
-    throw "Key should be alphabet.";
-  if (mods & GLFW_MOD_CAPS_LOCK) {
-    if (mods & GLFW_MOD_SHIFT)
-      return __alpha_lower(key);
+// Encodes a key press the way xterm does, empty for keys that send nothing
+static std::string __encode_key(int key, int mods, bool applicationCursor,
+                                bool applicationKeypad) {
+  std::string out;
+  bool alt = mods & GLFW_MOD_ALT;
+  if (key >= 0 && key < (int)__key_text.size() && __key_text[key].normal) {
+    const Key_Text &text = __key_text[key];
+    bool shifted = mods & GLFW_MOD_SHIFT;
+    if (key >= 'A' && key <= 'Z' && mods & GLFW_MOD_CAPS_LOCK)
+      shifted = !shifted;
+    char c = shifted ? text.shifted : text.normal;
+    if (mods & GLFW_MOD_CONTROL)
+      c = __control_char(c);
+    if (alt)
+      out += '\x1b';
+    out += c;
+    return out;
+  }
+  switch (key) {
+  case GLFW_KEY_ESCAPE:
+    return "\x1b";
+  case GLFW_KEY_ENTER:
+    return alt ? "\x1b\r" : "\r";
+  case GLFW_KEY_TAB:
+    return mods & GLFW_MOD_SHIFT ? "\x1b[Z" : "\t";
+  case GLFW_KEY_BACKSPACE:
+    out = mods & GLFW_MOD_CONTROL ? "\b" : "\x7f";
+    return alt ? "\x1b" + out : out;
+  }
+  if (key < GLFW_KEY_ESCAPE || key > GLFW_KEY_LAST)
+    return out;
+  const Key_Sequence &sequence = __key_sequences[key - GLFW_KEY_ESCAPE];
+  int modifier = __modifier_param(mods);
+  switch (sequence.kind) {
+  case KEY_NONE:
+    break;
+  case KEY_CURSOR:
+  case KEY_SS3:
+    if (modifier > 1)
+      out = "\x1b[1;" + std::to_string(modifier);
+    else if (sequence.kind == KEY_SS3 || applicationCursor)
+      out = "\x1bO";
     else
-      return __alpha_upper(key);
-
-  } else {
-    if (mods & GLFW_MOD_SHIFT)
-      return __alpha_upper(key);
+      out = "\x1b[";
+    out += sequence.final;
+    break;
+  case KEY_TILDE:
+    out = "\x1b[" + std::to_string(sequence.number);
+    if (modifier > 1)
+      out += ";" + std::to_string(modifier);
+    out += '~';
+    break;
+  case KEY_KEYPAD:
+    if (applicationKeypad)
+      out = std::string("\x1bO") + sequence.final;
     else
-      return __alpha_lower(key);
+      out = sequence.text;
+    break;
   }
+  return out;
 }
-// Alphabet section ended
 
-// Detect internal commands of the emulator
+// Internal commands of the emulator: recognized on the event thread, run on
+// the render thread, which owns the tabs and the font size
+enum Terminal_Command : int {
+  COMMAND_NONE,
+  COMMAND_ZOOM_IN,
+  COMMAND_ZOOM_OUT,
+  COMMAND_LATENCY_HUD,
+  COMMAND_NEW_TAB,
+  COMMAND_SPLIT_HORIZONTAL,
+  COMMAND_SPLIT_VERTICAL,
+  COMMAND_CLOSE_PANE,
+  COMMAND_NEXT_PANE,
+  COMMAND_PREVIOUS_PANE,
+  COMMAND_NEXT_TAB,
+  COMMAND_PREVIOUS_TAB,
+};
 
-bool __is_internal_command(int key, int mods) {
-  if (key == GLFW_KEY_EQUAL && mods & GLFW_MOD_SHIFT && mods & GLFW_MOD_SHIFT) {
-    Terminal *term = Terminal::get_instance();
+static Terminal_Command __internal_command(int key, int mods) {
+  bool zoom = (mods & GLFW_MOD_CONTROL) && (mods & GLFW_MOD_SHIFT);
+  if (key == GLFW_KEY_EQUAL && zoom)
+    return COMMAND_ZOOM_IN;
+  else if (key == GLFW_KEY_MINUS && zoom)
+    return COMMAND_ZOOM_OUT;
+  else if (key == GLFW_KEY_L && zoom)
+    return COMMAND_LATENCY_HUD;
+  else if (key == GLFW_KEY_T && zoom)
+    return COMMAND_NEW_TAB;
+  else if (key == GLFW_KEY_E && zoom)
+    return COMMAND_SPLIT_HORIZONTAL;
+  else if (key == GLFW_KEY_O && zoom)
+    return COMMAND_SPLIT_VERTICAL;
+  else if (key == GLFW_KEY_W && zoom)
+    return COMMAND_CLOSE_PANE;
+  else if (key == GLFW_KEY_TAB && (mods & GLFW_MOD_CONTROL))
+    return mods & GLFW_MOD_SHIFT ? COMMAND_PREVIOUS_PANE : COMMAND_NEXT_PANE;
+  else if ((key == GLFW_KEY_PAGE_UP || key == GLFW_KEY_PAGE_DOWN) &&
+           mods == GLFW_MOD_CONTROL)
+    return key == GLFW_KEY_PAGE_DOWN ? COMMAND_NEXT_TAB : COMMAND_PREVIOUS_TAB;
+  return COMMAND_NONE;
+}
+
+// Render thread, __window is the window the key went to
+void __run_command(int command) {
+  Terminal *term = Terminal::get_instance();
+  if (__window->tabs.empty())
+    return;
+  // the window's panes may have moved the focus while it was in the back
+  SessionManager::get_instance()->set_active(__window->focused);
+  switch (command) {
+  case COMMAND_ZOOM_IN:
     term->set_font_size(term->get_font_size() + FONT_STEP);
-    return true;
-  } else if (key == GLFW_KEY_MINUS && mods & GLFW_MOD_SHIFT &&
-             mods & GLFW_MOD_SHIFT) {
-    Terminal *term = Terminal::get_instance();
+    break;
+  case COMMAND_ZOOM_OUT:
     term->set_font_size(term->get_font_size() - FONT_STEP);
-    return true;
+    break;
+  case COMMAND_LATENCY_HUD:
+    term->toggle_latency_hud();
+    break;
+  case COMMAND_NEW_TAB:
+    term->new_tab();
+    break;
+  case COMMAND_SPLIT_HORIZONTAL:
+    term->split_pane(SPLIT_HORIZONTAL);
+    break;
+  case COMMAND_SPLIT_VERTICAL:
+    term->split_pane(SPLIT_VERTICAL);
+    break;
+  case COMMAND_CLOSE_PANE:
+    term->close_pane();
+    break;
+  case COMMAND_NEXT_PANE:
+  case COMMAND_PREVIOUS_PANE:
+    term->focus_pane(command == COMMAND_NEXT_PANE ? 1 : -1);
+    break;
+  case COMMAND_NEXT_TAB:
+  case COMMAND_PREVIOUS_TAB:
+    term->select_tab(command == COMMAND_NEXT_TAB ? 1 : -1);
+    break;
   }
-  return false;
 }
 
 // Generic key functions start
-void __handle_key_down(int key, int mods) {
-  // Internal function for the glfw_key_callback
-  __scroll_down = true;
-  if (__is_alpha(key)) {
-    // TODO: Just adding to the buffer. Fix later
-    inputBuffer += __get_adapted_alpha(key, mods);
+// Event thread: the key is encoded and queued for the PTY without waiting
+// for the render thread, which may be in the middle of a frame
+void __handle_key_down(Terminal_Window *target, int key, int mods) {
+  Terminal_Command command = __internal_command(key, mods);
+  if (command != COMMAND_NONE) {
+    __post_input({INPUT_COMMAND, target, command});
+    return;
   }
-
-  if (__is_internal_command(key, mods))
+  Replayer *replayer = Terminal::get_instance()->get_replayer();
+  if (replayer) {
+    // replays have no shell to type into, arrows seek instead
+    if (key == GLFW_KEY_RIGHT)
+      replayer->seek(replayer->get_time() + SEEK_STEP);
+    else if (key == GLFW_KEY_LEFT)
+      replayer->seek(replayer->get_time() - SEEK_STEP);
     return;
-  if (__is_symbol(key)) {
-    inputBuffer += __get_adapted_symbol(key, mods);
   }
-  if (__is_number(key)) {
-    inputBuffer += __get_adapted_number(key, mods);
+  Session *session = target->focused;
+  if (session == nullptr)
+    return;
+  // the render thread may close the session meanwhile. Only the session
+  // list's mutex is taken, briefly held by everyone: the parser's key modes
+  // are atomics, the session mutex the I/O thread and the frames take isn't
+  // needed.
+  SessionManager *sessions = SessionManager::get_instance();
+  std::unique_lock<std::mutex> hold = sessions->hold(session);
+  if (!hold.owns_lock())
+    return;
+  session->scrollDown = true;
+  EscapeHandler *parser = session->get_parser();
+  // every key goes to the PTY right away, the line discipline or the
+  // program echoes it
+  std::string sequence =
+      __encode_key(key, mods, parser->is_application_cursor(),
+                   parser->is_application_keypad());
+  if (!sequence.empty()) {
+    LatencyTracker::get_instance()->key_pressed(session->get_id());
+    sessions->send(session, sequence);
   }
-  if (key == GLFW_KEY_BACKSPACE && inputBuffer.length())
-    inputBuffer.pop_back();
-  if (key == GLFW_KEY_SPACE)
-    inputBuffer += ' ';
-  if (key == GLFW_KEY_ENTER)
-    handle_enter_key(key, mods);
 }
 
-void __handle_key_up(int key, int mods) {
+void __handle_key_up(Terminal_Window *target, int key, int mods) {
   // Internal function for the glfw_key_callback
 }
-void __handle_key_held_down(int key, int mods) { __handle_key_down(key, mods); }
+void __handle_key_held_down(Terminal_Window *target, int key, int mods) {
+  __handle_key_down(target, key, mods);
+}
 // Generic key functions end
 
 /*
@@ -363,20 +1227,85 @@ void __handle_key_held_down(int key, int mods) { __handle_key_down(key, mods); }
 /*
  *  PTY Handler section start
  * */
-void pty_handler_callback(PTY_Payload_List *payloadList) {
-  pretty_log("TERM", std::string("PTY Callback recieved"));
-  if (!__scroll_down) {
-    __scroll_down = true;
+// Runs on the session I/O thread
+void pty_handler_callback(Session *session, const char *data, size_t size) {
+  bool updated;
+  {
+    std::lock_guard<std::mutex> lock(session->get_mutex());
+    EscapeHandler *parser = session->get_parser();
+    bool synchronized = parser->is_synchronized();
+    parser->feed(data, size);
+    updated = synchronized && !parser->is_synchronized();
+    session->scrollDown = true;
   }
-  if (ptyPayload == nullptr) {
-    ptyPayload = payloadList;
-  } else {
-    ptyPayloadTail->next = payloadList;
+  __bytes_parsed += size;
+  // a finished synchronized update is presented right away
+  if (updated)
+    __wake_renderer();
+  // the output is in the grid the next frame draws
+  if (LatencyTracker::get_instance()->output_read(session->get_id()) &&
+      Config::get_instance()->lowLatency) {
+    __echo_arrived = true;
+    __wake_renderer();
   }
-  while (payloadList->next) {
-    payloadList = payloadList->next;
+}
+
+// The tab closes on the next frame
+void pty_exit_callback(Session *session) { __wake_renderer(); }
+
+// Runs on the session client's reader thread, the server's update is in the
+// grids already. size is 0 once the shell exited.
+void remote_update_callback(Session *session, size_t size) {
+  __bytes_parsed += size;
+  if (size == 0) {
+    __wake_renderer();
+  } else if (LatencyTracker::get_instance()->output_read(session->get_id()) &&
+             Config::get_instance()->lowLatency) {
+    __echo_arrived = true;
+    __wake_renderer();
   }
-  ptyPayloadTail = payloadList;
+}
+
+// A replay plays into the only session
+void replay_output_callback(const char *data, size_t size) {
+  pty_handler_callback(SessionManager::get_instance()->get_session(0), data,
+                       size);
+}
+
+// Replay checkpoints hold both grids and the parser state
+void checkpoint_snapshot_callback(std::string &state) {
+  Session *session = SessionManager::get_instance()->get_session(0);
+  std::lock_guard<std::mutex> lock(session->get_mutex());
+  session->get_primary()->serialize(state, CHECKPOINT_SCROLLBACK);
+  session->get_alternate()->serialize(state, 0);
+  session->get_parser()->serialize(state);
+}
+
+// False when the checkpoint is corrupt, the replayer drops it. All of it is
+// decoded aside first, the session takes it only once every part decoded.
+bool checkpoint_restore_callback(const std::string &state) {
+  Grid primary(1, 1), alternate(1, 1, false);
+  EscapeHandler parser(&primary, &alternate);
+  size_t pos = 0;
+  if (!primary.deserialize(state, pos) || !alternate.deserialize(state, pos))
+    return false;
+  size_t parserPos = pos;
+  if (!parser.deserialize(state, pos))
+    return false;
+  Session *session = SessionManager::get_instance()->get_session(0);
+  std::lock_guard<std::mutex> lock(session->get_mutex());
+  session->get_primary()->restore(std::move(primary));
+  session->get_alternate()->restore(std::move(alternate));
+  // the parser state is a few bytes, read again for the session's grids
+  session->get_parser()->deserialize(state, parserPos);
+  return true;
+}
+
+// resize event in a recording, the grids follow the recorded size
+void replay_resize_callback(uint32_t width, uint32_t height) {
+  Session *session = SessionManager::get_instance()->get_session(0);
+  std::lock_guard<std::mutex> lock(session->get_mutex());
+  session->resize(height, width, 0, 0);
 }
 /*
  *  PTY Handler section end
@@ -422,33 +1351,564 @@ std::vector<std::string> __find_system_fonts(const std::string &font_name) {
 }
 
 // Text presentation to screen
-void __render_text_to_terminal(PTY_Payload_List *payload) {
-  PTY_Payload_List *curr = payload;
-  while (curr != nullptr && curr->next != nullptr) {
-    if (curr->curr->type == PAYLOAD_INS) {
-      if (handle_escape_sequence(curr->curr->data,
-                                 escape_sequence_handler_callback)) {
-        curr = ptyPayload;
-        break;
+
+// xterm's default palette for the 16 ANSI colors
+static const ImU32 __ansi_colors[16] = {
+    IM_COL32(0, 0, 0, 255),       IM_COL32(205, 0, 0, 255),
+    IM_COL32(0, 205, 0, 255),     IM_COL32(205, 205, 0, 255),
+    IM_COL32(0, 0, 238, 255),     IM_COL32(205, 0, 205, 255),
+    IM_COL32(0, 205, 205, 255),   IM_COL32(229, 229, 229, 255),
+    IM_COL32(127, 127, 127, 255), IM_COL32(255, 0, 0, 255),
+    IM_COL32(0, 255, 0, 255),     IM_COL32(255, 255, 0, 255),
+    IM_COL32(92, 92, 255, 255),   IM_COL32(255, 0, 255, 255),
+    IM_COL32(0, 255, 255, 255),   IM_COL32(255, 255, 255, 255)};
+
+static ImU32 __palette_color(uint32_t index) {
+  if (index < 16)
+    return __ansi_colors[index];
+  if (index < 232) {
+    // 6x6x6 color cube
+    static const int levels[6] = {0, 95, 135, 175, 215, 255};
+    index -= 16;
+    return IM_COL32(levels[index / 36], levels[(index / 6) % 6],
+                    levels[index % 6], 255);
+  }
+  int gray = 8 + (index - 232) * 10;
+  return IM_COL32(gray, gray, gray, 255);
+}
+
+static ImU32 __resolve_color(uint32_t color, bool foreground, uint8_t attrs) {
+  switch (COLOR_KIND(color)) {
+  case 1: {
+    uint32_t index = color & 0xFF;
+    if (foreground && (attrs & ATTR_BOLD) && index < 8)
+      index += 8; // bold shows as the bright variant
+    return __palette_color(index);
+  }
+  case 2:
+    return IM_COL32((color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF,
+                    255);
+  default:
+    return foreground ? ImGui::GetColorU32(ImGuiCol_Text)
+                      : ImGui::GetColorU32(ImGuiCol_WindowBg);
+  }
+}
+
+// Draw data of one row: runs of cells sharing the same style id
+typedef struct Render_Run {
+  uint16_t first; // columns [first, last)
+  uint16_t last;
+  ImU32 fg;
+  ImU32 bg;
+  ImU32 underlineColor;
+  bool fillBackground;
+  uint8_t attrs;
+  uint8_t underline;
+  uint32_t textStart; // utf-8 of the run in Row_Render_Cache::text
+  uint32_t textEnd;
+} Render_Run;
+
+typedef struct Row_Render_Cache {
+  std::string text;
+  std::vector<Render_Run> runs;
+} Row_Render_Cache;
+
+// A visible line of a pane's frame: its draw data and where it goes, from the
+// top left corner of the pane's content
+typedef struct Line_Draw {
+  const Row_Render_Cache *cache;
+  ImVec2 pos;
+} Line_Draw;
+
+// Draw data of a session's pane, kept between frames. The slot caches stay
+// until the grid marks the slot dirty: a pane whose screen didn't change
+// rebuilds nothing. While the session's program is in a synchronized update
+// the pane's last frame is drawn again as it was.
+typedef struct Pane_Frame {
+  std::vector<Row_Render_Cache> rowCache; // per grid row slot
+  // scrollback lines built into copies, a deque keeps them in place while
+  // more are added
+  std::deque<Row_Render_Cache> scrollbackCaches;
+  std::vector<Line_Draw> lines;
+  ImVec2 size; // of the content, all the lines
+  ImVec2 cursor;
+  bool cursorVisible = false;
+} Pane_Frame;
+static std::unordered_map<uint32_t, Pane_Frame> paneFrames;
+
+static void __build_row_cache(const Grid_Row &row, StyleTable &styles,
+                              ClusterTable &clusters,
+                              Row_Render_Cache &cache) {
+  cache.text.clear();
+  cache.runs.clear();
+  // trailing blanks draw nothing
+  size_t length = row.size();
+  while (length > 0 && row[length - 1] == Cell())
+    length--;
+  size_t start = 0;
+  while (start < length) {
+    const Cell &first = row[start];
+    size_t end = start + 1;
+    while (end < length && !(first.flags & CELL_CLUSTER) &&
+           row[end].style == first.style && row[end].flags == first.flags)
+      end++;
+    const Style &style = styles.get(first.style);
+    Render_Run run;
+    run.first = start;
+    run.last = end;
+    run.attrs = style.attrs;
+    run.underline = style.underline;
+    run.fg = __resolve_color(style.fg, true, style.attrs);
+    run.bg = __resolve_color(style.bg, false, style.attrs);
+    if (style.attrs & ATTR_REVERSE)
+      std::swap(run.fg, run.bg);
+    if (style.attrs & ATTR_DIM)
+      run.fg = (run.fg & 0x00FFFFFF) | 0x80000000;
+    run.underlineColor = style.underlineColor == COLOR_DEFAULT
+                             ? run.fg
+                             : __resolve_color(style.underlineColor, true, 0);
+    run.fillBackground =
+        style.bg != COLOR_DEFAULT || (style.attrs & ATTR_REVERSE);
+    run.textStart = cache.text.length();
+    // wide characters differ in flags from their neighbours so each one is
+    // a run of its own, placed at its column whatever the glyph advance is;
+    // a cluster is a run of its own too, drawn as all of its codepoints
+    if (style.attrs & ATTR_HIDDEN || first.flags & CELL_WIDE_SPACER)
+      ;
+    else if (first.flags & CELL_CLUSTER)
+      for (char32_t codepoint : clusters.get(first.codepoint))
+        utf8_append(cache.text, codepoint);
+    else
+      for (size_t i = start; i < end; i++)
+        utf8_append(cache.text, row[i].codepoint);
+    run.textEnd = cache.text.length();
+    cache.runs.push_back(run);
+    start = end;
+  }
+}
+
+// SGR 4:n underline variants along the bottom of the run
+static void __draw_underline(ImDrawList *drawList, const Render_Run &run,
+                             ImVec2 from, float to, float charWidth) {
+  ImU32 color = run.underlineColor;
+  switch (run.underline) {
+  case UNDERLINE_DOUBLE:
+    drawList->AddLine(ImVec2(from.x, from.y - 2), ImVec2(to, from.y - 2),
+                      color);
+    drawList->AddLine(from, ImVec2(to, from.y), color);
+    break;
+  case UNDERLINE_CURLY: {
+    float step = charWidth / 2;
+    for (float x = from.x; x < to; x += step) {
+      float y = ((int)((x - from.x) / step) & 1) ? from.y : from.y - 2;
+      drawList->AddLine(ImVec2(x, y), ImVec2(std::min(x + step, to),
+                                             y == from.y ? from.y - 2 : from.y),
+                        color);
+    }
+    break;
+  }
+  case UNDERLINE_DOTTED:
+    for (float x = from.x; x < to; x += 2)
+      drawList->AddRectFilled(ImVec2(x, from.y - 1), ImVec2(x + 1, from.y),
+                              color);
+    break;
+  case UNDERLINE_DASHED:
+    for (float x = from.x; x < to; x += charWidth / 2)
+      drawList->AddLine(ImVec2(x, from.y),
+                        ImVec2(std::min(x + charWidth / 4, to), from.y), color);
+    break;
+  default:
+    drawList->AddLine(from, ImVec2(to, from.y), color);
+    break;
+  }
+}
+
+static void __draw_row_cache(ImDrawList *drawList,
+                             const Row_Render_Cache &cache, ImVec2 pos,
+                             float charWidth, float lineHeight) {
+  const char *text = cache.text.data();
+  for (const Render_Run &run : cache.runs) {
+    ImVec2 runPos(pos.x + run.first * charWidth, pos.y);
+    ImVec2 runEnd(pos.x + run.last * charWidth, pos.y + lineHeight);
+    if (run.fillBackground)
+      drawList->AddRectFilled(runPos, runEnd, run.bg);
+    if (run.textStart == run.textEnd)
+      continue;
+    drawList->AddText(runPos, run.fg, text + run.textStart,
+                      text + run.textEnd);
+    if (run.underline != UNDERLINE_NONE)
+      __draw_underline(drawList, run, ImVec2(runPos.x, runEnd.y - 1),
+                       runEnd.x, charWidth);
+    if (run.attrs & ATTR_STRIKE)
+      drawList->AddLine(ImVec2(runPos.x, runPos.y + lineHeight / 2),
+                        ImVec2(runEnd.x, runPos.y + lineHeight / 2), run.fg);
+  }
+}
+
+// Rows and columns of a pane's child window
+static void __pane_grid_size(const Pane_Rect &rect, float charWidth,
+                             float lineHeight, uint32_t &rows,
+                             uint32_t &cols) {
+  const ImGuiStyle &style = ImGui::GetStyle();
+  float width = rect.width - 2 * style.WindowPadding.x - style.ScrollbarSize;
+  float height = rect.height - 2 * style.WindowPadding.y;
+  cols = std::max(1.0f, width / charWidth);
+  rows = std::max(1.0f, height / lineHeight);
+}
+
+// Fits the grids and PTYs to their panes once the layout stopped changing,
+// dragging a window edge would otherwise reflow the screens and make the
+// children redraw every frame. Background tabs share the area and follow too,
+// a tab switch shows the right size right away.
+static void __resize_panes(const Pane_Rect &area, float charWidth,
+                           float lineHeight) {
+  std::vector<uint32_t> &pending = __window->pendingSizes;
+  double &pendingSince = __window->pendingSince;
+  static std::vector<Pane_View> views;
+  if (Terminal::get_instance()->get_replayer())
+    return; // a replay keeps the size it was recorded at
+  views.clear();
+  for (PaneLayout *tab : __window->tabs)
+    tab->get_views(area, PANE_GAP, views);
+  std::vector<uint32_t> sizes;
+  bool changed = false;
+  for (const Pane_View &view : views) {
+    uint32_t rows, cols;
+    __pane_grid_size(view.rect, charWidth, lineHeight, rows, cols);
+    sizes.push_back(rows);
+    sizes.push_back(cols);
+    Grid *grid = view.session->get_primary();
+    changed |= rows != grid->get_rows() || cols != grid->get_cols();
+  }
+  if (!changed)
+    return;
+  double now = ImGui::GetTime();
+  if (sizes != pending) {
+    pending = sizes;
+    pendingSince = now;
+    return;
+  }
+  if (now - pendingSince < RESIZE_DEBOUNCE)
+    return;
+  SessionClient *client = Terminal::get_instance()->get_client();
+  for (size_t i = 0; i < views.size(); i++) {
+    uint32_t rows = sizes[2 * i], cols = sizes[2 * i + 1];
+    Session *session = views[i].session;
+    {
+      std::lock_guard<std::mutex> lock(session->get_mutex());
+      if (rows == session->get_primary()->get_rows() &&
+          cols == session->get_primary()->get_cols())
+        continue;
+      session->resize(rows, cols, cols * charWidth, rows * lineHeight);
+    }
+    // the server's reflowed grids follow, not under the session mutex
+    if (client)
+      client->resize(session, rows, cols, cols * charWidth,
+                     rows * lineHeight);
+  }
+}
+
+// Every pane of the active tab is a child window at its viewport: its own
+// clip rect and scroll position, drawn in the same pass as the others.
+// Returns the focused pane's scroll position.
+float __render_panes(const Pane_Rect &area) {
+  static std::vector<Pane_View> views;
+  float charWidth = ImGui::CalcTextSize("M").x;
+  float lineHeight = ImGui::GetTextLineHeight();
+  __resize_panes(area, charWidth, lineHeight);
+  PaneLayout *tab = __window->tabs[__window->activeTab];
+  Session *focused = tab->get_focused();
+  views.clear();
+  tab->get_views(area, PANE_GAP, views);
+  float scroll = 0.0f;
+  for (const Pane_View &view : views) {
+    ImGui::SetCursorPos(ImVec2(view.rect.x, view.rect.y));
+    ImGui::BeginChild(view.session->get_id(),
+                      ImVec2(view.rect.width, view.rect.height),
+                      ImGuiChildFlags_AlwaysUseWindowPadding);
+    __render_grid(view.session);
+    if (view.session->scrollDown.exchange(false))
+      ImGui::SetScrollHereY(1.0f);
+    if (view.session == focused)
+      scroll = ImGui::GetScrollY();
+    // a click focuses the pane
+    if (view.session != focused && ImGui::IsWindowHovered() &&
+        ImGui::IsMouseClicked(ImGuiMouseButton_Left))
+      __focus(view.session);
+    ImGui::EndChild();
+    if (views.size() > 1 && view.session == focused) {
+      ImVec2 min = ImGui::GetItemRectMin(), max = ImGui::GetItemRectMax();
+      ImGui::GetWindowDrawList()->AddRect(
+          min, max, ImGui::GetColorU32(ImGuiCol_Text, 0.3f));
+    }
+  }
+  return scroll;
+}
+
+// Renders the scrollback followed by the screen rows, only the lines inside
+// the visible part of the window are drawn. The session mutex is held while
+// the frame's snapshot is taken: the draw data of the visible lines, the slot
+// caches brought up to date and the scrollback lines built into copies. The
+// draw calls come after, the parser has the grid back meanwhile. A pane in
+// a synchronized update takes no snapshot, it shows its last frame until the
+// update ends or times out; the other panes go on.
+void __render_grid(Session *session) {
+  float charWidth = ImGui::CalcTextSize("M").x;
+  float lineHeight = ImGui::GetTextLineHeight();
+  Pane_Frame &frame = paneFrames[session->get_id()];
+  static Grid_Row scrollbackRow;
+  size_t scrollbackUsed = 0;
+  ImVec2 origin = ImGui::GetCursorScreenPos();
+
+  ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0, 0));
+  bool held;
+  {
+    std::lock_guard<std::mutex> lock(session->get_mutex());
+    held = session->get_parser()->is_synchronized() && !frame.lines.empty();
+    // keys go to the focused pane, its echo is what the latency is about
+    if (!held && session == SessionManager::get_instance()->get_active())
+      LatencyTracker::get_instance()->frame_started();
+    Grid *active = session->get_parser()->get_grid();
+    if (!held) {
+      // scrollback from before a resize is rewrapped a little every frame
+      // and faster once it is scrolled into view, the snapshot stays short
+      // either way: the next frames go on
+      active->reflow_scrollback(REFLOW_LINES_PER_FRAME);
+      size_t firstVisible = ImGui::GetScrollY() / lineHeight;
+      for (size_t reflowed = 0;
+           active->get_unreflowed_lines() > firstVisible &&
+           reflowed < REFLOW_LINES_IN_VIEW;
+           reflowed += REFLOW_LINES_PER_FRAME)
+        active->reflow_scrollback(REFLOW_LINES_PER_FRAME);
+    }
+    size_t history = active->get_scrollback_size();
+    if (!held) {
+      frame.lines.clear();
+      frame.rowCache.resize(active->get_rows());
+      frame.size = ImVec2(charWidth * active->get_cols(),
+                          (history + active->get_rows()) * lineHeight);
+
+      ImGuiListClipper clipper;
+      clipper.Begin(history + active->get_rows(), lineHeight);
+      while (clipper.Step()) {
+        for (int line = clipper.DisplayStart; line < clipper.DisplayEnd;
+             line++) {
+          Row_Render_Cache *cache;
+          if ((size_t)line < history) {
+            if (scrollbackUsed == frame.scrollbackCaches.size())
+              frame.scrollbackCaches.emplace_back();
+            cache = &frame.scrollbackCaches[scrollbackUsed++];
+            active->get_scrollback_row(line, scrollbackRow);
+            __build_row_cache(scrollbackRow, active->get_styles(),
+                              active->get_clusters(), *cache);
+          } else {
+            // the cache follows the row storage, scrolling moves no draw
+            // data
+            uint32_t slot = active->get_row_slot(line - history);
+            cache = &frame.rowCache[slot];
+            if (active->is_slot_dirty(slot)) {
+              __build_row_cache(active->get_slot(slot), active->get_styles(),
+                                active->get_clusters(), *cache);
+              active->clear_slot_dirty(slot);
+            }
+          }
+          ImVec2 pos = ImGui::GetCursorScreenPos();
+          frame.lines.push_back({cache, ImVec2(pos.x - origin.x,
+                                               pos.y - origin.y)});
+          ImGui::Dummy(ImVec2(frame.size.x, lineHeight));
+        }
       }
+      clipper.End();
+      frame.cursor =
+          ImVec2(active->get_cursor_col() * charWidth,
+                 (history + active->get_cursor_row()) * lineHeight);
+      frame.cursorVisible = active->is_cursor_visible();
     }
+  }
+  // the held frame's lines keep their place in the content
+  if (held)
+    ImGui::Dummy(frame.size);
+  ImGui::PopStyleVar();
 
-    else {
-      ImGui::Text("%s", curr->curr->data.c_str());
+  ImDrawList *drawList = ImGui::GetWindowDrawList();
+  for (const Line_Draw &line : frame.lines)
+    __draw_row_cache(drawList, *line.cache,
+                     ImVec2(origin.x + line.pos.x, origin.y + line.pos.y),
+                     charWidth, lineHeight);
+  if (frame.cursorVisible) {
+    ImVec2 cursor(origin.x + frame.cursor.x, origin.y + frame.cursor.y);
+    drawList->AddRectFilled(cursor,
+                            ImVec2(cursor.x + charWidth, cursor.y + lineHeight),
+                            ImGui::GetColorU32(ImGuiCol_Text, 0.5f));
+  }
+}
+
+// Makes the tab at index the one drawn, its focused pane takes the keyboard
+void __activate_tab(size_t index) {
+  __window->activeTab = index;
+  __window->focused = __window->tabs[index]->get_focused();
+  SessionManager::get_instance()->set_active(__window->focused);
+  __window->selectTab = true;
+}
+
+void __focus(Session *session) {
+  __window->tabs[__window->activeTab]->set_focused(session);
+  __window->focused = session;
+  SessionManager::get_instance()->set_active(session);
+}
+
+// Render thread: the session commands act on, the window's focused pane
+// while no session is active; null when neither is there
+Session *__active_session() {
+  Session *session = SessionManager::get_instance()->get_active();
+  if (session == nullptr && __window)
+    session = __window->focused;
+  return session;
+}
+
+// A session at the focused pane's size, the layout fits it on the next frames
+Session *__new_session() {
+  if (Terminal::get_instance()->get_replayer())
+    return nullptr;
+  // without a pane to follow the layout fits it on the next frames
+  Session *focused = __active_session();
+  uint32_t rows = DEFAULT_ROWS, cols = DEFAULT_COLS;
+  if (focused) {
+    rows = focused->get_primary()->get_rows();
+    cols = focused->get_primary()->get_cols();
+  }
+  SessionClient *client = Terminal::get_instance()->get_client();
+  Session *session;
+  if (client) {
+    // opened by the server, drawn once its snapshot arrived
+    session = client->create(rows, cols);
+  } else {
+    try {
+      session = new Session(rows, cols);
+    } catch (const char *error) {
+      pretty_log("TERM", error, ERR);
+      return nullptr;
+    }
+    session->get_pty()->set_window_size(rows, cols, 0, 0);
+  }
+  SessionManager::get_instance()->add_session(session);
+  return session;
+}
+
+// Drops the window's panes whose shell exited, a tab goes with its last
+// pane; the caller removes the sessions. Returns false once no tab is left.
+bool __close_exited() {
+  static std::vector<Session *> tabSessions;
+  std::vector<PaneLayout *> &tabs = __window->tabs;
+  size_t &activeTab = __window->activeTab;
+  bool changed = false;
+  for (size_t i = 0; i < tabs.size();) {
+    bool open = true;
+    tabSessions.clear();
+    tabs[i]->get_sessions(tabSessions);
+    for (Session *session : tabSessions) {
+      if (!session->is_exited())
+        continue;
+      if (Terminal::get_instance()->get_client())
+        Terminal::get_instance()->get_client()->forget(session);
+      paneFrames.erase(session->get_id());
+      open = tabs[i]->remove(session);
+      changed = true;
+    }
+    if (open) {
+      i++;
+      continue;
+    }
+    delete tabs[i];
+    tabs.erase(tabs.begin() + i);
+    if (activeTab > i || activeTab == tabs.size())
+      activeTab = activeTab > 0 ? activeTab - 1 : 0;
+  }
+  if (tabs.empty())
+    return false;
+  if (changed)
+    __activate_tab(activeTab);
+  return true;
+}
+
+// Tab bar, shown once there is more than one tab. A click selects a tab, its
+// close button hangs up all of its shells.
+void __render_tabs() {
+  std::vector<PaneLayout *> &tabs = __window->tabs;
+  if (tabs.size() < 2 || !ImGui::BeginTabBar("##tabs"))
+    return;
+  bool selecting = __window->selectTab;
+  __window->selectTab = false;
+  static std::vector<Session *> tabSessions;
+  for (size_t i = 0; i < tabs.size(); i++) {
+    Session *focused = tabs[i]->get_focused();
+    bool active = i == __window->activeTab;
+    bool open = true;
+    // the id stays when the focus and the title change
+    char id[32];
+    snprintf(id, sizeof(id), "###%p", (void *)tabs[i]);
+    std::string label = focused->get_title() + id;
+    if (ImGui::BeginTabItem(label.c_str(), &open,
+                            selecting && active ? ImGuiTabItemFlags_SetSelected
+                                                : ImGuiTabItemFlags_None)) {
+      if (!active && !selecting)
+        __activate_tab(i);
+      ImGui::EndTabItem();
     }
-    curr = curr->next;
+    if (open)
+      continue;
+    // closes with the next frame
+    tabSessions.clear();
+    tabs[i]->get_sessions(tabSessions);
+    for (Session *session : tabSessions)
+      session->set_exited();
   }
-  if (curr != nullptr) {
-    std::string tempString = curr->curr->data + inputBuffer;
-    ImGui::Text("%s", tempString.c_str());
-  } else
-    ImGui::Text("%s", inputBuffer.c_str());
+  ImGui::EndTabBar();
 }
 
-// EscapeSequenceHandler section
-void escape_sequence_handler_callback(int signal) {
-  if (signal == SCR_CLEAR_SIGNAL) {
-    ptyPayload = erase_PTY_Payload_List(ptyPayload);
-    ptyPayloadTail = ptyPayload;
+// Overlay in the top right corner: key latency percentiles per stage, the
+// histogram of the total and the frame counters
+void __render_hud(const Frame_Stats &frameStats) {
+  LatencyTracker *tracker = LatencyTracker::get_instance();
+  const ImGuiViewport *viewport = ImGui::GetMainViewport();
+  ImGui::SetNextWindowPos(
+      ImVec2(viewport->WorkPos.x + viewport->WorkSize.x - 10,
+             viewport->WorkPos.y + 10),
+      ImGuiCond_Always, ImVec2(1.0f, 0.0f));
+  ImGui::SetNextWindowBgAlpha(0.7f);
+  ImGui::Begin("##latency", nullptr,
+               ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoInputs |
+                   ImGuiWindowFlags_AlwaysAutoResize |
+                   ImGuiWindowFlags_NoFocusOnAppearing |
+                   ImGuiWindowFlags_NoNav);
+  for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+    Latency_Histogram histogram = tracker->get_histogram((Latency_Stage)stage);
+    ImGui::Text("%-14s p50 %5.1f  p99 %5.1f  max %5.1f ms",
+                LatencyTracker::get_stage_name((Latency_Stage)stage),
+                histogram.percentile(0.5), histogram.percentile(0.99),
+                histogram.max);
   }
+  Latency_Histogram total = tracker->get_histogram(LATENCY_TOTAL);
+  float buckets[LATENCY_BUCKETS];
+  for (int i = 0; i < LATENCY_BUCKETS; i++)
+    buckets[i] = total.buckets[i];
+  ImGui::PlotHistogram("##total", buckets, LATENCY_BUCKETS, 0, nullptr, 0.0f,
+                       FLT_MAX, ImVec2(0, 60));
+  ImGui::Text("%llu keys, %.1f ms per bucket", (unsigned long long)total.count,
+              LATENCY_BUCKET_MS);
+  ImGui::Separator();
+  ImGui::Text("%s, %llu frames skipped",
+              frameStats.flooding ? "throughput mode" : "every frame",
+              (unsigned long long)frameStats.skipped);
+  ImGui::Text("bytes per frame: last %llu, average %.0f",
+              (unsigned long long)frameStats.lastBytes,
+              frameStats.presented
+                  ? (double)frameStats.totalBytes / frameStats.presented
+                  : 0.0);
+  Session *session = __active_session();
+  PTYHandler *pty = session ? session->get_pty() : nullptr;
+  if (pty && pty->get_first_output_ms() >= 0)
+    ImGui::Text("session to first prompt: %.1f ms",
+                pty->get_first_output_ms());
+  ImGui::End();
 }
@@ -2,7 +2,56 @@
 #define TERMINAL_H
 
 #include "GLFW/glfw3.h"
-#include "PTYHandler.h"
+#include "PaneLayout.h"
+#include "Recorder.h"
+#include "Replayer.h"
+#include "SessionClient.h"
+#include "imgui.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Frames the throughput mode left out and the output behind the drawn ones
+typedef struct Frame_Stats {
+  uint64_t skipped = 0;
+  uint64_t presented = 0;
+  uint64_t lastBytes = 0;  // bytes parsed for the last presented frame
+  uint64_t totalBytes = 0; // bytes parsed up to the last presented frame
+  bool flooding = false;   // in throughput mode
+} Frame_Stats;
+
+// A top level window: its tabs and its GL and ImGui contexts. The sessions,
+// the font atlas and the config belong to the process, a --server shares
+// them between its windows.
+// The GLFW event thread creates and destroys the window, everything else is
+// the render thread's: the event thread only stores the sizes and reads the
+// pane its keys go to.
+typedef struct Terminal_Window {
+  GLFWwindow *window = nullptr;
+  ImGuiContext *context = nullptr;
+  ImTextureID fontTexture = 0; // this context's upload of the font atlas
+  std::vector<PaneLayout *> tabs; // the panes of every tab
+  size_t activeTab = 0;
+  bool selectTab = false; // the tab bar follows a tab change by key
+  std::atomic<Session *> focused = nullptr; // takes the window's keys
+  int width = 0;                            // framebuffer, of this frame
+  int height = 0;
+  // stored by the event thread's size callbacks
+  std::atomic<int> windowWidth = 0;
+  std::atomic<int> windowHeight = 0;
+  std::atomic<int> framebufferWidth = 0;
+  std::atomic<int> framebufferHeight = 0;
+  double lastTime = 0.0; // glfwGetTime() of the last frame
+  float fontSize = 1.0f;
+  float scrollPos = 0.0f;
+  bool vsync = false;
+  bool presented = false; // its first frame is up
+  int requestFd = -1;     // the --client waiting for that frame
+  // __resize_panes() debounce
+  std::vector<uint32_t> pendingSizes;
+  double pendingSince = 0.0;
+} Terminal_Window;
 
 class Terminal {
 public:
@@ -16,22 +65,63 @@ public:
   uint32_t get_height();
   void set_window_dim(uint32_t width = -1, uint32_t height = -1);
   GLFWwindow *get_window();
-  PTYHandler *get_pty();
+  Replayer *get_replayer();
+  SessionClient *get_client();
   ~Terminal();
   float get_font_size();
   void set_font_size(float size);
   float get_scroll_pos();
+  void toggle_latency_hud();
+  void new_tab();
+  void split_pane(Split_Direction direction);
+  void close_pane();
+  void focus_pane(int step);
+  void select_tab(int step);
 
 private:
   Terminal();
-  bool running = true;
+  Terminal_Window *__open_window(const std::vector<PaneLayout *> &tabs,
+                                 int requestFd = -1);
+  void __destroy_released();
+  void __serve_window_requests();
+  void __render_thread();
+  void __adopt_windows();
+  void __init_window(Terminal_Window *target);
+  void __release_window(Terminal_Window *target);
+  void __drain_input();
+  bool __close_windows();
+  void __render_window(Terminal_Window *target);
+  void __wait_for_frame();
+  bool __skip_frame();
+  void __swap_font_atlas();
+  void __print_startup_timeline();
+  std::atomic<bool> running = true;
   static Terminal *instance;
-  int windowWidth = 800;
+  int windowWidth = 800; // of new windows
   int windowHeight = 600;
-  GLFWwindow *window = nullptr;
-  PTYHandler *pty = nullptr;
-  float fontSize = 1.0f;
-  float scrollPos = 0.0f;
+  std::vector<Terminal_Window *> windows; // drawn by the render thread
+  // handed between the threads: created by the event thread and not adopted
+  // yet, given up by the render thread and not destroyed yet
+  std::vector<Terminal_Window *> opened;
+  std::vector<Terminal_Window *> released;
+  std::mutex handoffMutex;
+  std::thread renderer;
+  std::atomic<bool> rendering = true; // until the render thread returns
+  ImFontAtlas *fontAtlas = nullptr; // shared by the windows once loaded
+  bool server = false;              // stays up for --client windows
+  Recorder *recorder = nullptr;
+  Replayer *replayer = nullptr;
+  SessionClient *client = nullptr; // attached to a session server
+  bool latencyHud = false;
+  bool lowLatency = false;
+  double lastFrame = 0; // glfwGetTime() of the last frame, low latency mode
+  // throughput mode, see __skip_frame()
+  double rateStart = 0;
+  uint64_t rateBytes = 0;
+  double lastPresent = 0;
+  Frame_Stats frameStats;
+  std::thread fontWorker;
+  std::atomic<bool> startupPending = true; // timeline not printed yet
 };
 
 #endif // !TERMINAL_H
@@ -0,0 +1,129 @@
+#ifndef UNICODE_H
+#define UNICODE_H
+#include "UnicodeTables.h"
+#include <cstdint>
+
+// Looks up a packed value of bits width in a two-stage table
+constexpr uint32_t __unicode_lookup(const uint8_t *stage1,
+                                    const uint8_t *stage2, uint32_t codepoint,
+                                    uint32_t bits) {
+  uint32_t block = stage1[codepoint >> UNICODE_BLOCK_BITS];
+  uint32_t index = (block << UNICODE_BLOCK_BITS) |
+                   (codepoint & ((1 << UNICODE_BLOCK_BITS) - 1));
+  uint32_t perByte = 8 / bits;
+  return (stage2[index / perByte] >> ((index % perByte) * bits)) &
+         ((1 << bits) - 1);
+}
+
+// Number of cells a codepoint takes: 0 for combining/format characters,
+// 2 for East Asian wide and emoji presentation, 1 otherwise.
+// Replaces wcwidth(): no locale dependency and a table lookup in O(1).
+constexpr int unicode_width(uint32_t codepoint) {
+  // ASCII shortcut, the bulk of any terminal output
+  if (codepoint < 0x7F)
+    return codepoint >= 0x20;
+  if (codepoint >= 0x110000)
+    return 1;
+  return __unicode_lookup(UNICODE_WIDTH_STAGE1, UNICODE_WIDTH_STAGE2,
+                          codepoint, 2);
+}
+
+// Grapheme cluster break property of UAX #29, Extended_Pictographic folded in
+// (it only ever applies to codepoints whose property is Other)
+enum Grapheme_Break : uint8_t {
+  GB_OTHER,
+  GB_CR,
+  GB_LF,
+  GB_CONTROL,
+  GB_EXTEND,
+  GB_ZWJ,
+  GB_REGIONAL_INDICATOR,
+  GB_PREPEND,
+  GB_SPACING_MARK,
+  GB_L,
+  GB_V,
+  GB_T,
+  GB_LV,
+  GB_LVT,
+  GB_EXTENDED_PICTOGRAPHIC,
+};
+
+constexpr Grapheme_Break grapheme_break_property(uint32_t codepoint) {
+  if (codepoint < 0x7F) {
+    if (codepoint == '\r')
+      return GB_CR;
+    if (codepoint == '\n')
+      return GB_LF;
+    return codepoint < 0x20 ? GB_CONTROL : GB_OTHER;
+  }
+  if (codepoint >= 0x110000)
+    return GB_OTHER;
+  return (Grapheme_Break)__unicode_lookup(UNICODE_GRAPHEME_BREAK_STAGE1,
+                                          UNICODE_GRAPHEME_BREAK_STAGE2,
+                                          codepoint, 4);
+}
+
+// What the segmenter remembers of the cluster so far. The default state
+// breaks before anything, like the start of text.
+typedef struct Grapheme_State {
+  Grapheme_Break previous = GB_CONTROL;
+  bool pictographic = false; // Extended_Pictographic Extend* seen (GB11)
+  bool oddRegional = false;  // odd number of regional indicators (GB12/13)
+} Grapheme_State;
+
+// Incremental extended grapheme cluster segmentation: feeds one codepoint
+// and returns whether a cluster boundary comes before it.
+constexpr bool grapheme_break(Grapheme_State &state, uint32_t codepoint) {
+  // printable ASCII only ever continues a Prepend
+  if (codepoint >= 0x20 && codepoint < 0x7F && state.previous != GB_PREPEND) {
+    state = {GB_OTHER, false, false};
+    return true;
+  }
+  Grapheme_Break prev = state.previous;
+  Grapheme_Break next = grapheme_break_property(codepoint);
+  bool boundary = true;
+  if (prev == GB_CR && next == GB_LF) // GB3
+    boundary = false;
+  else if (prev == GB_CR || prev == GB_LF || prev == GB_CONTROL ||
+           next == GB_CR || next == GB_LF || next == GB_CONTROL) // GB4, GB5
+    boundary = true;
+  else if (prev == GB_L &&
+           (next == GB_L || next == GB_V || next == GB_LV || next == GB_LVT))
+    boundary = false; // GB6
+  else if ((prev == GB_LV || prev == GB_V) && (next == GB_V || next == GB_T))
+    boundary = false; // GB7
+  else if ((prev == GB_LVT || prev == GB_T) && next == GB_T) // GB8
+    boundary = false;
+  else if (next == GB_EXTEND || next == GB_ZWJ ||
+           next == GB_SPACING_MARK) // GB9, GB9a
+    boundary = false;
+  else if (prev == GB_PREPEND) // GB9b
+    boundary = false;
+  else if (prev == GB_ZWJ && state.pictographic &&
+           next == GB_EXTENDED_PICTOGRAPHIC) // GB11
+    boundary = false;
+  else if (prev == GB_REGIONAL_INDICATOR && state.oddRegional &&
+           next == GB_REGIONAL_INDICATOR) // GB12, GB13
+    boundary = false;
+
+  if (next == GB_EXTENDED_PICTOGRAPHIC)
+    state.pictographic = true;
+  else if (boundary || (next != GB_EXTEND && next != GB_ZWJ))
+    state.pictographic = false;
+  state.oddRegional = next == GB_REGIONAL_INDICATOR &&
+                      (boundary || !state.oddRegional);
+  state.previous = next;
+  return boundary;
+}
+
+static_assert(unicode_width('a') == 1);
+static_assert(unicode_width(0x0301) == 0); // combining acute accent
+static_assert(unicode_width(0x4E2D) == 2); // CJK ideograph
+static_assert(unicode_width(0x1F600) == 2); // emoji
+// Grid::print() shows wide characters as U+FFFD on a one column grid
+static_assert(unicode_width(0xFFFD) == 1);
+static_assert(grapheme_break_property(0x0301) == GB_EXTEND);
+static_assert(grapheme_break_property(0x200D) == GB_ZWJ);
+static_assert(grapheme_break_property(0x1F1E6) == GB_REGIONAL_INDICATOR);
+static_assert(grapheme_break_property(0x1F600) == GB_EXTENDED_PICTOGRAPHIC);
+#endif // !UNICODE_H
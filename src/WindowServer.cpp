@@ -0,0 +1,134 @@
+#include "WindowServer.h"
+#include "Config.h"
+#include "Logger.h"
+#include "SessionServer.h"
+#include <GLFW/glfw3.h>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+WindowServer *WindowServer::instance = nullptr;
+
+WindowServer::WindowServer() {}
+
+WindowServer *WindowServer::get_instance() {
+  if (instance == nullptr)
+    instance = new WindowServer();
+  return instance;
+}
+
+// --socket, else terminal-windows.sock in $XDG_RUNTIME_DIR, else one per user
+// in /tmp
+std::string WindowServer::get_socket_path() {
+  const std::string &path = Config::get_instance()->socketPath;
+  if (!path.empty())
+    return path;
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime != nullptr && *runtime)
+    return std::string(runtime) + "/terminal-windows.sock";
+  return "/tmp/terminal-windows-" + std::to_string(getuid()) + ".sock";
+}
+
+// --client: asks the server for a window and returns once it is drawn
+int WindowServer::request_window() {
+  auto start = std::chrono::steady_clock::now();
+  std::string path = get_socket_path();
+  int fd = SessionServer::connect_socket(path);
+  if (fd < 0) {
+    pretty_log("WINDOW", "No window server on " + path + ", start one with "
+                         "--server.",
+               ERR);
+    return 1;
+  }
+  struct timeval timeout = {WINDOW_REPLY_TIMEOUT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  Server_Header header;
+  std::string payload;
+  bool opened = SessionServer::write_message(fd, WINDOW_OPEN, 0, "") &&
+                SessionServer::read_message(fd, header, payload) &&
+                header.type == WINDOW_OPENED;
+  close(fd);
+  if (!opened) {
+    pretty_log("WINDOW", "The window server didn't open a window.", ERR);
+    return 1;
+  }
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  pretty_log("WINDOW", "Window up after " + std::to_string(ms) + " ms.");
+  return 0;
+}
+
+// Fails when another server listens already
+bool WindowServer::start() {
+  if (listenFd >= 0)
+    return true;
+  socketPath = get_socket_path();
+  listenFd = SessionServer::listen_socket(socketPath);
+  if (listenFd < 0)
+    return false;
+  listener = std::thread(&WindowServer::__listener_thread, this);
+  pretty_log("WINDOW", "Serving windows on " + socketPath);
+  return true;
+}
+
+void WindowServer::stop() {
+  if (listenFd < 0)
+    return;
+  // wakes the blocked accept
+  shutdown(listenFd, SHUT_RDWR);
+  if (listener.joinable())
+    listener.join();
+  close(listenFd);
+  listenFd = -1;
+  unlink(socketPath.c_str());
+  std::lock_guard<std::mutex> lock(mutex);
+  for (int fd : requests)
+    close(fd);
+  requests.clear();
+}
+
+// The clients whose window the render loop opens now, answered through
+// opened() once it is drawn
+std::vector<int> WindowServer::take_requests() {
+  std::vector<int> taken;
+  std::lock_guard<std::mutex> lock(mutex);
+  taken.swap(requests);
+  return taken;
+}
+
+void WindowServer::opened(int fd) {
+  if (!SessionServer::write_message(fd, WINDOW_OPENED, 0, ""))
+    pretty_log("WINDOW", "The client left before its window was up.", ERR);
+  close(fd);
+}
+
+void WindowServer::__listener_thread() {
+  for (;;) {
+    int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd == -1 && errno == EINTR)
+      continue;
+    if (fd == -1)
+      break;
+    // a client sends its request right after connecting
+    struct timeval timeout = {WINDOW_REPLY_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Server_Header header;
+    std::string payload;
+    if (!SessionServer::read_message(fd, header, payload) ||
+        header.type != WINDOW_OPEN) {
+      close(fd);
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      requests.push_back(fd);
+    }
+    glfwPostEmptyEvent();
+  }
+}
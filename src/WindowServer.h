@@ -0,0 +1,46 @@
+#ifndef WINDOW_SERVER_H
+#define WINDOW_SERVER_H
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define WINDOW_REPLY_TIMEOUT 5 // seconds a client waits for its window
+
+// Messages on the window socket, framed like the session server's
+// (SessionServer::write_message)
+enum Window_Message : uint32_t {
+  WINDOW_OPEN,   // client: a window with a new session
+  WINDOW_OPENED, // server: the window's first frame is up
+};
+
+// Single instance windows: a `--server` process stays up and opens a window
+// for every `--client` invocation, all of them GLFW windows of the one
+// process. GLFW, the font atlas, the config and the shell pool are up
+// already, a new window only creates its GL and ImGui contexts and uploads
+// the atlas texture.
+// The listener thread queues the clients and wakes the GLFW event loop,
+// which opens their windows (GLFW wants the main thread); the render thread
+// answers each client once its window's first frame is up.
+class WindowServer {
+public:
+  static WindowServer *get_instance();
+  static std::string get_socket_path();
+  static int request_window();
+  bool start();
+  void stop();
+  std::vector<int> take_requests();
+  void opened(int fd);
+
+private:
+  WindowServer();
+  void __listener_thread();
+  static WindowServer *instance;
+  std::string socketPath;
+  int listenFd = -1;
+  std::vector<int> requests; // clients waiting for their window
+  std::mutex mutex;
+  std::thread listener;
+};
+#endif // !WINDOW_SERVER_H
@@ -1,7 +1,20 @@
 #include<iostream>
+#include "Config.h"
+#include "SessionClient.h"
+#include "SessionServer.h"
 #include "Terminal.h"
+#include "WindowServer.h"
 
-int main(){
+int main(int argc, char **argv){
+  Config *config = Config::get_instance();
+  if (!config->parse_args(argc, argv))
+    return 1;
+  if (config->daemon)
+    return SessionServer::get_instance()->run();
+  if (config->headless)
+    return SessionClient::get_instance()->run_headless();
+  if (config->client)
+    return WindowServer::request_window();
   std::cout<<"Hello World"<<std::endl;
   Terminal::get_instance()->render();
 
@@ -0,0 +1,297 @@
+#!/usr/bin/env python3
+"""Generates src/UnicodeTables.h, the constexpr lookup tables behind Unicode.h.
+
+The width of every codepoint (0, 1 or 2 cells) is derived from the UCD files
+EastAsianWidth.txt, DerivedGeneralCategory.txt and emoji/emoji-data.txt and
+stored as a two-stage table: stage1[cp >> 8] selects a deduplicated block of
+256 two-bit widths in stage2.
+The grapheme cluster break property (UAX #29, GraphemeBreakProperty.txt plus
+Extended_Pictographic from emoji-data.txt) is stored the same way with four
+bits per codepoint.
+
+Data sources, in order of preference:
+  --ucd DIR         directory holding the UCD files
+  --version X.Y.Z   download the files from unicode.org
+  --python          use the unicodedata module of this Python (no emoji data,
+                    since Unicode 9 emoji presentation characters are wide in
+                    EastAsianWidth anyway; the grapheme break property is
+                    approximated from the general categories)
+"""
+import argparse
+import os
+import re
+import sys
+import urllib.request
+
+MAX_CODEPOINT = 0x110000
+BLOCK_BITS = 8
+BLOCK_SIZE = 1 << BLOCK_BITS
+
+# unassigned codepoints in these ranges default to wide (EastAsianWidth.txt)
+DEFAULT_WIDE = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+# zero width beyond the Mn/Me/Cf categories: Hangul medial vowels and final
+# consonants join the preceding syllable
+ZERO_WIDTH = [(0x1160, 0x11FF), (0xD7B0, 0xD7FF), (0x200B, 0x200F)]
+ZERO_WIDTH_CATEGORIES = {'Mn', 'Me', 'Cf', 'Cc'}
+# format characters that are still visible
+VISIBLE_FORMAT = {0x00AD, 0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605,
+                  0x06DD, 0x070F, 0x0890, 0x0891, 0x08E2, 0x110BD, 0x110CD}
+
+
+# grapheme break property values, must match Grapheme_Break in Unicode.h
+GRAPHEME_BREAK = ['Other', 'CR', 'LF', 'Control', 'Extend', 'ZWJ',
+                  'Regional_Indicator', 'Prepend', 'SpacingMark', 'L', 'V',
+                  'T', 'LV', 'LVT', 'Extended_Pictographic']
+
+# Fallback data for --python, which has no GraphemeBreakProperty
+PREPEND = [(0x0600, 0x0605), (0x06DD, 0x06DD), (0x070F, 0x070F),
+           (0x0890, 0x0891), (0x08E2, 0x08E2), (0x0D4E, 0x0D4E),
+           (0x110BD, 0x110BD), (0x110CD, 0x110CD), (0x111C2, 0x111C3),
+           (0x1193F, 0x1193F), (0x11941, 0x11941), (0x11A3A, 0x11A3A),
+           (0x11A84, 0x11A89), (0x11D46, 0x11D46)]
+EXTRA_EXTEND = [(0x200C, 0x200C), (0xFF9E, 0xFF9F), (0x1F3FB, 0x1F3FF),
+                (0xE0020, 0xE007F)]
+EXTENDED_PICTOGRAPHIC = [
+    (0x00A9, 0x00A9), (0x00AE, 0x00AE), (0x203C, 0x203C), (0x2049, 0x2049),
+    (0x2122, 0x2122), (0x2139, 0x2139), (0x2194, 0x2199), (0x21A9, 0x21AA),
+    (0x231A, 0x231B), (0x2328, 0x2328), (0x2388, 0x2388), (0x23CF, 0x23CF),
+    (0x23E9, 0x23F3), (0x23F8, 0x23FA), (0x24C2, 0x24C2), (0x25AA, 0x25AB),
+    (0x25B6, 0x25B6), (0x25C0, 0x25C0), (0x25FB, 0x25FE), (0x2600, 0x2605),
+    (0x2607, 0x2612), (0x2614, 0x2685), (0x2690, 0x2705), (0x2708, 0x2712),
+    (0x2714, 0x2714), (0x2716, 0x2716), (0x271D, 0x271D), (0x2721, 0x2721),
+    (0x2728, 0x2728), (0x2733, 0x2734), (0x2744, 0x2744), (0x2747, 0x2747),
+    (0x274C, 0x274C), (0x274E, 0x274E), (0x2753, 0x2755), (0x2757, 0x2757),
+    (0x2763, 0x2767), (0x2795, 0x2797), (0x27A1, 0x27A1), (0x27B0, 0x27B0),
+    (0x27BF, 0x27BF), (0x2934, 0x2935), (0x2B05, 0x2B07), (0x2B1B, 0x2B1C),
+    (0x2B50, 0x2B50), (0x2B55, 0x2B55), (0x3030, 0x3030), (0x303D, 0x303D),
+    (0x3297, 0x3297), (0x3299, 0x3299), (0x1F000, 0x1F0FF),
+    (0x1F10D, 0x1F10F), (0x1F12F, 0x1F12F), (0x1F16C, 0x1F171),
+    (0x1F17E, 0x1F17F), (0x1F18E, 0x1F18E), (0x1F191, 0x1F19A),
+    (0x1F1AD, 0x1F1E5), (0x1F201, 0x1F20F), (0x1F21A, 0x1F21A),
+    (0x1F22F, 0x1F22F), (0x1F232, 0x1F23A), (0x1F23C, 0x1F23F),
+    (0x1F249, 0x1F3FA), (0x1F400, 0x1F53D), (0x1F546, 0x1F64F),
+    (0x1F680, 0x1F6FF), (0x1F774, 0x1F77F), (0x1F7D5, 0x1F7FF),
+    (0x1F80C, 0x1F80F), (0x1F848, 0x1F84F), (0x1F85A, 0x1F85F),
+    (0x1F888, 0x1F88F), (0x1F8AE, 0x1F8FF), (0x1F90C, 0x1F93A),
+    (0x1F93C, 0x1F945), (0x1F947, 0x1FAFF), (0x1FC00, 0x1FFFD)]
+
+
+def hangul_syllable_type(cp):
+    if 0x1100 <= cp <= 0x115F or 0xA960 <= cp <= 0xA97C:
+        return 'L'
+    if 0x1160 <= cp <= 0x11A7 or 0xD7B0 <= cp <= 0xD7C6:
+        return 'V'
+    if 0x11A8 <= cp <= 0x11FF or 0xD7CB <= cp <= 0xD7FB:
+        return 'T'
+    if 0xAC00 <= cp <= 0xD7A3:
+        return 'LV' if (cp - 0xAC00) % 28 == 0 else 'LVT'
+    return None
+
+
+def parse_ucd_ranges(text):
+    """Yields (first, last, fields) for every data line of a UCD file."""
+    for line in text.splitlines():
+        line = line.split('#', 1)[0].strip()
+        if not line:
+            continue
+        fields = [f.strip() for f in line.split(';')]
+        span = fields[0].split('..')
+        first = int(span[0], 16)
+        last = int(span[-1], 16)
+        yield first, last, fields[1:]
+
+
+def set_ranges(values, ranges, value):
+    for first, last in ranges:
+        for cp in range(first, last + 1):
+            values[cp] = value
+
+
+def load_ucd(read):
+    breaks = [0] * MAX_CODEPOINT
+    for first, last, fields in parse_ucd_ranges(
+            read('auxiliary/GraphemeBreakProperty.txt')):
+        set_ranges(breaks, [(first, last)], GRAPHEME_BREAK.index(fields[0]))
+    for first, last, fields in parse_ucd_ranges(
+            read('emoji/emoji-data.txt')):
+        if fields[0] == 'Extended_Pictographic':
+            set_ranges(breaks, [(first, last)],
+                       GRAPHEME_BREAK.index('Extended_Pictographic'))
+    widths = [1] * MAX_CODEPOINT
+    for first, last in DEFAULT_WIDE:
+        for cp in range(first, last + 1):
+            widths[cp] = 2
+    for first, last, fields in parse_ucd_ranges(read('EastAsianWidth.txt')):
+        width = 2 if fields[0] in ('W', 'F') else 1
+        for cp in range(first, last + 1):
+            widths[cp] = width
+    for first, last, fields in parse_ucd_ranges(
+            read('extracted/DerivedGeneralCategory.txt')):
+        if fields[0] in ZERO_WIDTH_CATEGORIES:
+            for cp in range(first, last + 1):
+                if cp not in VISIBLE_FORMAT:
+                    widths[cp] = 0
+    for first, last, fields in parse_ucd_ranges(
+            read('emoji/emoji-data.txt')):
+        if fields[0] == 'Emoji_Presentation':
+            for cp in range(first, last + 1):
+                widths[cp] = 2
+    return widths, breaks
+
+
+def python_grapheme_break(cp, category):
+    if cp == 0x0D:
+        return 'CR'
+    if cp == 0x0A:
+        return 'LF'
+    if cp == 0x200D:
+        return 'ZWJ'
+    if 0x1F1E6 <= cp <= 0x1F1FF:
+        return 'Regional_Indicator'
+    syllable = hangul_syllable_type(cp)
+    if syllable:
+        return syllable
+    if any(first <= cp <= last for first, last in PREPEND):
+        return 'Prepend'
+    if category in ('Mn', 'Me') or any(first <= cp <= last
+                                       for first, last in EXTRA_EXTEND):
+        return 'Extend'
+    if category == 'Mc':
+        return 'SpacingMark'
+    if category in ('Cc', 'Cf', 'Zl', 'Zp'):
+        return 'Control'
+    if any(first <= cp <= last for first, last in EXTENDED_PICTOGRAPHIC):
+        return 'Extended_Pictographic'
+    return 'Other'
+
+
+def load_python():
+    import unicodedata
+    breaks = [0] * MAX_CODEPOINT
+    widths = [1] * MAX_CODEPOINT
+    for first, last in DEFAULT_WIDE:
+        for cp in range(first, last + 1):
+            widths[cp] = 2
+    for cp in range(MAX_CODEPOINT):
+        ch = chr(cp)
+        category = unicodedata.category(ch)
+        breaks[cp] = GRAPHEME_BREAK.index(python_grapheme_break(cp, category))
+        if category == 'Cn':
+            continue
+        if unicodedata.east_asian_width(ch) in ('W', 'F'):
+            widths[cp] = 2
+        else:
+            widths[cp] = 1
+        if category in ZERO_WIDTH_CATEGORIES and cp not in VISIBLE_FORMAT:
+            widths[cp] = 0
+    return widths, breaks, unicodedata.unidata_version
+
+
+def apply_overrides(widths):
+    for first, last in ZERO_WIDTH:
+        for cp in range(first, last + 1):
+            widths[cp] = 0
+    return widths
+
+
+def build_tables(values, bits):
+    """Two-stage table of values packed bits per codepoint."""
+    per_byte = 8 // bits
+    stage1, stage2, blocks = [], [], {}
+    for base in range(0, MAX_CODEPOINT, BLOCK_SIZE):
+        packed = []
+        for i in range(0, BLOCK_SIZE, per_byte):
+            byte = 0
+            for k in range(per_byte):
+                byte |= values[base + i + k] << (bits * k)
+            packed.append(byte)
+        packed = tuple(packed)
+        if packed not in blocks:
+            blocks[packed] = len(stage2)
+            stage2.append(packed)
+        stage1.append(blocks[packed])
+    return stage1, stage2
+
+
+def format_array(values, per_line=16):
+    lines = []
+    for i in range(0, len(values), per_line):
+        lines.append('    ' + ', '.join('0x%02x' % v
+                                         for v in values[i:i + per_line]) +
+                     ',')
+    return '\n'.join(lines)
+
+
+def write_table(out, name, stage1, stage2, comment):
+    assert len(stage2) < 256
+    out.write('// block of 256 codepoints -> index into the stage2 blocks\n')
+    out.write('inline constexpr uint8_t %s_STAGE1[%d] = {\n'
+              % (name, len(stage1)))
+    out.write(format_array(stage1) + '\n};\n\n')
+    out.write('// %s\n' % comment)
+    flat = [b for block in stage2 for b in block]
+    out.write('inline constexpr uint8_t %s_STAGE2[%d] = {\n'
+              % (name, len(flat)))
+    out.write(format_array(flat) + '\n};\n\n')
+
+
+def write_header(path, version, width_tables, break_tables):
+    with open(path, 'w') as out:
+        out.write('// Generated by tools/gen_unicode_tables.py, do not edit.\n')
+        out.write('// Unicode %s\n' % version)
+        out.write('#ifndef UNICODE_TABLES_H\n#define UNICODE_TABLES_H\n')
+        out.write('#include <cstdint>\n\n')
+        out.write('#define UNICODE_VERSION_STRING "%s"\n' % version)
+        out.write('#define UNICODE_BLOCK_BITS %d\n\n' % BLOCK_BITS)
+        write_table(out, 'UNICODE_WIDTH', *width_tables,
+                    'two bits per codepoint, four codepoints per byte')
+        write_table(out, 'UNICODE_GRAPHEME_BREAK', *break_tables,
+                    'four bits per codepoint, two codepoints per byte')
+        out.write('#endif // !UNICODE_TABLES_H\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawTextHelpFormatter)
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--ucd', help='directory with the UCD files')
+    source.add_argument('--version', help='Unicode version to download')
+    source.add_argument('--python', action='store_true',
+                        help='use the unicodedata module')
+    parser.add_argument('-o', '--output', required=True)
+    args = parser.parse_args()
+
+    if args.python:
+        widths, breaks, version = load_python()
+    else:
+        if args.ucd:
+            def read(name):
+                with open(os.path.join(args.ucd, name), encoding='utf-8') as f:
+                    return f.read()
+            match = re.search(r'EastAsianWidth-(\d+\.\d+\.\d+)',
+                              read('EastAsianWidth.txt'))
+            version = match.group(1) if match else 'unknown'
+        else:
+            version = args.version
+
+            def read(name):
+                url = 'https://www.unicode.org/Public/%s/ucd/%s' % (version,
+                                                                    name)
+                print('fetching', url, file=sys.stderr)
+                with urllib.request.urlopen(url) as f:
+                    return f.read().decode('utf-8')
+        widths, breaks = load_ucd(read)
+    width_tables = build_tables(apply_overrides(widths), 2)
+    break_tables = build_tables(breaks, 4)
+    write_header(args.output, version, width_tables, break_tables)
+    for name, (stage1, stage2) in (('width', width_tables),
+                                   ('grapheme break', break_tables)):
+        print('%s table: %d blocks, %d bytes' %
+              (name, len(stage2),
+               len(stage1) + sum(len(block) for block in stage2)),
+              file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()